@@ -8,9 +8,11 @@
 #include "db/dbformat.h"
 #include "db/table_cache.h"
 #include "db/version_edit.h"
+#include "koo/learned_index.h"
 #include "hyperleveldb/db.h"
 #include "hyperleveldb/env.h"
 #include "hyperleveldb/iterator.h"
+#include "table/table_builder_internal.h"
 
 namespace leveldb {
 
@@ -19,7 +21,8 @@ Status BuildTable(const std::string& dbname,
                   const Options& options,
                   TableCache* table_cache,
                   Iterator* iter,
-                  FileMetaData* meta) {
+                  FileMetaData* meta,
+                  koo::LearnedIndexData* model) {
   Status s;
   meta->file_size = 0;
   iter->SeekToFirst();
@@ -33,6 +36,13 @@ Status BuildTable(const std::string& dbname,
     }
 
     TableBuilder* builder = new TableBuilder(options, file);
+    if (model != NULL) {
+      iter->SeekToLast();
+      std::string largest = ExtractUserKey(iter->key()).ToString();
+      iter->SeekToFirst();
+      model->SetKeyRange(ExtractUserKey(iter->key()), largest);
+      TableBuilderInternal::SetLearnedIndex(builder, model);
+    }
     meta->smallest.DecodeFrom(iter->key());
     for (; iter->Valid(); iter->Next()) {
       Slice key = iter->key();
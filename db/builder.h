@@ -7,6 +7,8 @@
 
 #include "hyperleveldb/status.h"
 
+namespace koo { class LearnedIndexData; }
+
 namespace leveldb {
 
 struct Options;
@@ -21,13 +23,15 @@ class VersionEdit;
 // will be named according to meta->number.  On success, the rest of
 // *meta will be filled with metadata about the generated table.
 // If no data is present in *iter, meta->file_size will be set to
-// zero, and no Table file will be produced.
+// zero, and no Table file will be produced.  If "model" is non-NULL it
+// is trained on the keys of the table while the table is written.
 extern Status BuildTable(const std::string& dbname,
                          Env* env,
                          const Options& options,
                          TableCache* table_cache,
                          Iterator* iter,
-                         FileMetaData* meta);
+                         FileMetaData* meta,
+                         koo::LearnedIndexData* model = NULL);
 
 }  // namespace leveldb
 
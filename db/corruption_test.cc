@@ -38,6 +38,7 @@ class CorruptionTest {
     tiny_cache_ = NewLRUCache(100);
     options_.env = &env_;
     options_.block_cache = tiny_cache_;
+    options_.write_ahead_log = true;  // some tests corrupt the log
     dbname_ = test::TmpDir() + "/db_test";
     DestroyDB(dbname_, options_);
 
@@ -7,9 +7,11 @@
 #include <stdlib.h>
 #include "db/db_impl.h"
 #include "db/version_set.h"
+#include "koo/util.h"
 #include "hyperleveldb/cache.h"
 #include "hyperleveldb/db.h"
 #include "hyperleveldb/env.h"
+#include "hyperleveldb/learning_policy.h"
 #include "hyperleveldb/write_batch.h"
 #include "port/port.h"
 #include "util/crc32c.h"
@@ -99,9 +101,21 @@ static int FLAGS_bloom_bits = -1;
 // benchmark will fail.
 static bool FLAGS_use_existing_db = false;
 
+// If true, writes are appended to the write-ahead log.
+static bool FLAGS_write_ahead_log = false;
+
 // Use the db with the following name.
 static const char* FLAGS_db = NULL;
 
+// Model used for each level, as a comma-separated list of "plr", "rs" or
+// "pgm"; the last one is used for the remaining levels.
+static const char* FLAGS_model_type = NULL;
+
+// Which files get a model: "cba" (cost-benefit), "eager", "off" or "seek:N"
+// to learn a file after N lookups. NULL means cba, or off with --mod=0 or
+// --mod=8, which measure LevelDB without learned indexes.
+static const char* FLAGS_learning_policy = NULL;
+
 namespace leveldb {
 
 namespace {
@@ -150,6 +164,27 @@ static Slice TrimSpace(Slice s) {
   return Slice(s.data() + start, limit - start);
 }
 
+// The policy named by --learning_policy
+static const LearningPolicy* NewLearningPolicy() {
+  int lookups;
+  char junk;
+  if (FLAGS_learning_policy == NULL) {
+    if (koo::MOD == 0 || koo::MOD == 8) return NewNoLearningPolicy();
+    return NewCostBenefitLearningPolicy();
+  } else if (strcmp(FLAGS_learning_policy, "cba") == 0) {
+    return NewCostBenefitLearningPolicy();
+  } else if (strcmp(FLAGS_learning_policy, "eager") == 0) {
+    return NewEagerLearningPolicy();
+  } else if (strcmp(FLAGS_learning_policy, "off") == 0) {
+    return NewNoLearningPolicy();
+  } else if (sscanf(FLAGS_learning_policy, "seek:%d%c", &lookups, &junk) == 1 &&
+             lookups > 0) {
+    return NewSeekLearningPolicy(lookups);
+  }
+  fprintf(stderr, "Invalid learning policy '%s'\n", FLAGS_learning_policy);
+  exit(1);
+}
+
 static void AppendWithSpace(std::string* str, Slice msg) {
   if (msg.empty()) return;
   if (!str->empty()) {
@@ -328,6 +363,7 @@ class Benchmark {
   Benchmark& operator = (const Benchmark&);
   Cache* cache_;
   const FilterPolicy* filter_policy_;
+  const LearningPolicy* learning_policy_;
   DB* db_;
   int num_;
   int value_size_;
@@ -416,6 +452,7 @@ class Benchmark {
     filter_policy_(FLAGS_bloom_bits >= 0
                    ? NewBloomFilterPolicy(FLAGS_bloom_bits)
                    : NULL),
+    learning_policy_(NewLearningPolicy()),
     db_(NULL),
     num_(FLAGS_num),
     value_size_(FLAGS_value_size),
@@ -439,6 +476,7 @@ class Benchmark {
     delete db_;
     delete cache_;
     delete filter_policy_;
+    delete learning_policy_;
   }
 
   void Run() {
@@ -721,6 +759,8 @@ class Benchmark {
     options.write_buffer_size = FLAGS_write_buffer_size;
     options.max_open_files = FLAGS_open_files;
     options.filter_policy = filter_policy_;
+    options.learning_policy = learning_policy_;
+    options.write_ahead_log = FLAGS_write_ahead_log;
     Status s = DB::Open(options, FLAGS_db, &db_);
     if (!s.ok()) {
       fprintf(stderr, "open error: %s\n", s.ToString().c_str());
@@ -957,6 +997,7 @@ int main(int argc, char** argv) {
   for (int i = 1; i < argc; i++) {
     double d;
     int n;
+    long long ll;
     char junk;
     if (leveldb::Slice(argv[i]).starts_with("--benchmarks=")) {
       FLAGS_benchmarks = argv[i] + strlen("--benchmarks=");
@@ -968,6 +1009,9 @@ int main(int argc, char** argv) {
     } else if (sscanf(argv[i], "--use_existing_db=%d%c", &n, &junk) == 1 &&
                (n == 0 || n == 1)) {
       FLAGS_use_existing_db = n;
+    } else if (sscanf(argv[i], "--write_ahead_log=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      FLAGS_write_ahead_log = n;
     } else if (sscanf(argv[i], "--num=%d%c", &n, &junk) == 1) {
       FLAGS_num = n;
     } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
@@ -986,12 +1030,55 @@ int main(int argc, char** argv) {
       FLAGS_open_files = n;
     } else if (strncmp(argv[i], "--db=", 5) == 0) {
       FLAGS_db = argv[i] + 5;
+    } else if (sscanf(argv[i], "--mod=%d%c", &n, &junk) == 1) {
+      koo::MOD = n;
+    } else if (sscanf(argv[i], "--online_learning=%d%c", &n, &junk) == 1 &&
+               (n == 0 || n == 1)) {
+      koo::online_learning = n;
+    } else if (sscanf(argv[i], "--model_memory_budget=%lld%c", &ll, &junk) == 1) {
+      koo::model_memory_budget = ll;
+    } else if (sscanf(argv[i], "--learning_threads=%d%c", &n, &junk) == 1 && n > 0) {
+      koo::learning_threads = n;
+    } else if (sscanf(argv[i], "--learning_cpu_percent=%d%c", &n, &junk) == 1 && n >= 0) {
+      koo::learning_cpu_percent = n;
+    } else if (sscanf(argv[i], "--shadow_sample_interval=%d%c", &n, &junk) == 1 && n >= 0) {
+      koo::shadow_sample_interval = n;
+    } else if (sscanf(argv[i], "--vlog_gc_rate=%lld%c", &ll, &junk) == 1 && ll >= 0) {
+      koo::vlog_gc_rate = ll;
+    } else if (sscanf(argv[i], "--vlog_segment_size=%lld%c", &ll, &junk) == 1 &&
+               ll > 0 && ll < (1ll << 32) - (1 << 20)) {
+      koo::vlog_segment_size = ll;
+    } else if (sscanf(argv[i], "--vlog_partitions=%d%c", &n, &junk) == 1 &&
+               n > 0 && n <= koo::VLog::kMaxPartitions) {
+      koo::vlog_partitions = n;
+    } else if (strncmp(argv[i], "--learning_policy=", 18) == 0) {
+      FLAGS_learning_policy = argv[i] + 18;
+    } else if (strncmp(argv[i], "--model_type=", 13) == 0) {
+      FLAGS_model_type = argv[i] + 13;
     } else {
       fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
       exit(1);
     }
   }
 
+  if (FLAGS_model_type != NULL) {
+    std::string list = FLAGS_model_type;
+    koo::ModelType type = koo::kPLRModel;
+    size_t start = 0;
+    for (int level = 0; level < leveldb::config::kNumLevels; level++) {
+      if (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        if (!koo::ParseModelType(list.substr(start, end - start), &type)) {
+          fprintf(stderr, "Invalid model type in '%s'\n", FLAGS_model_type);
+          exit(1);
+        }
+        start = end + 1;
+      }
+      koo::model_types[level] = type;
+    }
+  }
+
   // Choose a location for the test database if none given with --db=<path>
   if (FLAGS_db == NULL) {
       leveldb::Env::Default()->GetTestDirectory(&default_db_path);
@@ -25,6 +25,7 @@
 #include "db/write_batch_internal.h"
 #include "hyperleveldb/db.h"
 #include "hyperleveldb/env.h"
+#include "hyperleveldb/learning_policy.h"
 #include "hyperleveldb/replay_iterator.h"
 #include "hyperleveldb/status.h"
 #include "hyperleveldb/table.h"
@@ -32,8 +33,10 @@
 #include "port/port.h"
 #include "table/block.h"
 #include "table/merger.h"
+#include "table/table_builder_internal.h"
 #include "table/two_level_iterator.h"
 #include "util/coding.h"
+#include "util/hash.h"
 #include "util/logging.h"
 #include "util/mutexlock.h"
 #include "koo/stats.h"
@@ -44,6 +47,13 @@ const unsigned kStraightReads = 10;		// TODO version이 더 자주 업데이트
 
 const int kNumNonTableCacheFiles = 10;
 
+// The value log garbage collector empties the segments of which at least
+// this share is garbage, scanning them in batches of kVlogGCBatch bytes, and
+// checks for work or shutdown this often
+const double kVlogGCMinGarbage = 0.5;
+const uint64_t kVlogGCBatch = 1 << 20;
+const uint64_t kVlogGCPollMicros = 10000;
+
 // Information kept for every waiting writer
 struct DBImpl::Writer {
   port::CondVar cv_;
@@ -114,6 +124,7 @@ struct DBImpl::CompactionState {
   // State kept for output being generated
   WritableFile* outfile;
   TableBuilder* builder;
+  koo::LearnedIndexData* model;  // Trained by builder in online learning
 
   uint64_t total_bytes;
 
@@ -125,6 +136,7 @@ struct DBImpl::CompactionState {
         outputs(),
         outfile(NULL),
         builder(NULL),
+        model(NULL),
         total_bytes(0) {
   }
  private:
@@ -161,6 +173,9 @@ Options SanitizeOptions(const std::string& dbname,
   if (result.block_cache == NULL) {
     result.block_cache = NewLRUCache(8 << 20);
   }
+  if (result.learning_policy == NULL) {
+    result.learning_policy = NewCostBenefitLearningPolicy();
+  }
   return result;
 }
 
@@ -172,6 +187,7 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
                                &internal_filter_policy_, raw_options)),
       owns_info_log_(options_.info_log != raw_options.info_log),
       owns_cache_(options_.block_cache != raw_options.block_cache),
+      owns_learning_policy_(options_.learning_policy != raw_options.learning_policy),
       dbname_(dbname),
       table_cache_(),
       db_lock_(NULL),
@@ -201,6 +217,9 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
                              SequenceNumber(0) : kMaxSequenceNumber),
       replay_iters_(),
       straight_reads_(0),
+      vlog_gc_(koo::vlog_gc_rate > 0),
+      vlog_read_epoch_(0),
+      learning_stats_saved_(0),
       versions_(),
       backup_cv_(&writers_mutex_),
       backup_in_progress_(),
@@ -215,8 +234,14 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
   env_->StartThread(&DBImpl::CompactMemTableWrapper, this);
   env_->StartThread(&DBImpl::CompactLevelWrapper, this);
   num_bg_threads_ = 2;
+  if (vlog_gc_) {
+    env_->StartThread(&DBImpl::VlogGCWrapper, this);
+    num_bg_threads_ += 1;
+  }
+  vlog_reads_[0] = vlog_reads_[1] = 0;
 	koo::db = this;
-	vlog = new koo::VLog(dbname_ + "/vlog.txt");
+	version_count.store(0);
+	vlog = new koo::VLog(dbname_);
 
   // Reserve ten files or so for other uses and give the rest to TableCache.
   const int table_cache_size = options_.max_open_files - kNumNonTableCacheFiles;
@@ -233,6 +258,20 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
 }
 
 DBImpl::~DBImpl() {
+  // Without the write-ahead log, the memtable is the only copy of the
+  // latest writes.  A DB that failed to open has none, and no log file.
+  mutex_.Lock();
+  const bool flush = !options_.write_ahead_log && logfile_number_ != 0 &&
+                     allow_background_activity_ && bg_error_.ok();
+  mutex_.Unlock();
+  if (flush) {
+    Status s = FlushMemTable();
+    if (!s.ok()) {
+      Log(options_.info_log, "Memtable write on close error: %s",
+          s.ToString().c_str());
+    }
+  }
+
   // Wait for background work to finish
   mutex_.Lock();
   shutting_down_.Release_Store(this);  // Any non-NULL value is ok
@@ -246,6 +285,11 @@ DBImpl::~DBImpl() {
 	//koo::db->vlog->Sync();			// TODO read_cold.cc에선 쓰는데 필요한가?
 
   mutex_.Unlock();
+  // the learning jobs use the models and versions freed below
+  env_->StopLearning();
+  if (learning_stats_saved_ != 0) {
+    SaveLearningStats();
+  }
 
   if (db_lock_ != NULL) {
     env_->UnlockFile(db_lock_);
@@ -263,8 +307,13 @@ DBImpl::~DBImpl() {
   }
   if (owns_cache_) {
     delete options_.block_cache;
+  }
+  if (owns_learning_policy_) {
+    delete options_.learning_policy;
   }
 	delete koo::file_data;
+	koo::file_data = nullptr;
+	if (koo::db == this) koo::db = nullptr;
 	delete koo::learn_cb_model;
 	koo::file_stats.clear();
 	delete vlog;
@@ -373,10 +422,12 @@ void DBImpl::DeleteObsoleteFiles() {
 					if (!koo::fresh_write) {
 						koo::file_stats_mutex.Lock();
 						auto iter = koo::file_stats.find(number);
-						koo::FileStats& file_stat = iter->second;
-						file_stat.Finish();
-						if (file_stat.end - file_stat.start >= koo::learn_trigger_time) {
-							koo::learn_cb_model->AddFileData(file_stat.level, file_stat.num_lookup_neg, file_stat.num_lookup_pos, file_stat.size);
+						// the lifetimes of files written before the DB was opened are
+						// unknown
+						if (iter != koo::file_stats.end() && !iter->second.recovered) {
+							koo::FileStats& file_stat = iter->second;
+							file_stat.Finish();
+							options_.learning_policy->OnFileDeleted(file_stat.level, number, file_stat.end - file_stat.start);
 						}
 						koo::file_stats_mutex.Unlock();
 					}
@@ -426,6 +477,10 @@ Status DBImpl::Recover(VersionEdit* edit) {
   }
 
   s = versions_->Recover();
+  if (s.ok()) {
+    // The value log was opened with the DB, and cut off its torn records
+    s = vlog->Sync();
+  }
   if (s.ok()) {
     SequenceNumber max_sequence(0);
 
@@ -483,6 +538,35 @@ Status DBImpl::Recover(VersionEdit* edit) {
   return s;
 }
 
+namespace {
+// Copies a batch from the log without the pointers to the values that the
+// value log lost in a crash
+class VlogRecoveryFilter : public WriteBatch::Handler {
+ public:
+  explicit VlogRecoveryFilter(koo::VLog* vlog) : vlog_(vlog), dropped_(0) { }
+  koo::VLog* vlog_;
+  WriteBatch batch_;
+  int dropped_;
+
+  virtual void Put(const Slice& key, const Slice& value) {
+    if (value.size() == sizeof(uint64_t) + sizeof(uint32_t) &&
+        !vlog_->Contains(DecodeFixed64(value.data()),
+                         DecodeFixed32(value.data() + sizeof(uint64_t)))) {
+      dropped_++;
+      return;
+    }
+    batch_.Put(key, value);
+  }
+  virtual void Delete(const Slice& key) {
+    batch_.Delete(key);
+  }
+
+ private:
+  VlogRecoveryFilter(const VlogRecoveryFilter&);
+  VlogRecoveryFilter& operator = (const VlogRecoveryFilter&);
+};
+}  // namespace
+
 Status DBImpl::RecoverLogFile(uint64_t log_number,
                               VersionEdit* edit,
                               SequenceNumber* max_sequence) {
@@ -547,19 +631,34 @@ Status DBImpl::RecoverLogFile(uint64_t log_number,
       continue;
     }
     WriteBatchInternal::SetContents(&batch, record);
+    const SequenceNumber last_seq =
+        WriteBatchInternal::Sequence(&batch) +
+        WriteBatchInternal::Count(&batch) - 1;
+
+    // Without options.sync the log record may have made it to disk while
+    // the values it points to were still in the value log's buffers.  The
+    // later entries of the batch keep their order in its sequence range.
+    VlogRecoveryFilter filter(vlog);
+    status = batch.Iterate(&filter);
+    if (status.ok() && filter.dropped_ > 0) {
+      Log(options_.info_log, "%s: dropping %d entries past the value log",
+          fname.c_str(), filter.dropped_);
+      WriteBatchInternal::SetSequence(&filter.batch_,
+                                      WriteBatchInternal::Sequence(&batch));
+      batch = filter.batch_;
+    }
 
     if (mem == NULL) {
       mem = new MemTable(internal_comparator_);
       mem->Ref();
     }
-    status = WriteBatchInternal::InsertInto(&batch, mem);
+    if (status.ok()) {
+      status = WriteBatchInternal::InsertInto(&batch, mem);
+    }
     MaybeIgnoreError(&status);
     if (!status.ok()) {
       break;
     }
-    const SequenceNumber last_seq =
-        WriteBatchInternal::Sequence(&batch) +
-        WriteBatchInternal::Count(&batch) - 1;
     if (last_seq > *max_sequence) {
       *max_sequence = last_seq;
     }
@@ -601,10 +700,17 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
   Log(options_.info_log, "Level-0 table #%llu: started",
       (unsigned long long) meta.number);
 
+  koo::LearnedIndexData* model = NULL;
+  if (koo::online_learning) {
+    // the output level is only picked once the table is written, so it
+    // gets the kind of model chosen for level 0
+    model = new koo::LearnedIndexData(koo::file_allowed_seek, false, meta.number);
+  }
+
   Status s;
   {
     mutex_.Unlock();
-    s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta);
+    s = BuildTable(dbname_, env_, options_, table_cache_, iter, &meta, model);
     mutex_.Lock();
   }
 
@@ -634,7 +740,13 @@ Status DBImpl::WriteLevel0Table(MemTable* mem, VersionEdit* edit,
 			koo::file_stats.insert({meta.number, koo::FileStats(level, meta.file_size)});
 			koo::file_stats_mutex.Unlock();
 		}
+		if (model != NULL && model->Learned()) {
+			model->level = level;
+			koo::file_data->InstallModel(meta.number, model);
+			model = NULL;
+		}
   }
+  delete model;
 
   CompactionStats stats;
   stats.micros = env_->NowMicros() - start_micros;
@@ -671,6 +783,14 @@ void DBImpl::CompactMemTableThread() {
       s = Status::IOError("Deleting DB during memtable compaction");
     }
 
+    // The values of the table must be on disk before the log that could
+    // recover them is dropped
+    if (s.ok()) {
+      mutex_.Unlock();
+      s = vlog->Sync();
+      mutex_.Lock();
+    }
+
     // Replace immutable memtable with the generated Table
     if (s.ok()) {
       edit.SetPrevLogNumber(0);
@@ -695,9 +815,13 @@ void DBImpl::CompactMemTableThread() {
     }
 
 		auto time = instance->PauseTimer(time_started, 16, true);
-		int level = edit.new_files_[0].first;
 
-		env_->PrepareLearning(time.second, level, new FileMetaData(edit.new_files_[0].second));
+		// an empty memtable leaves no file
+		if (!koo::online_learning && !edit.new_files_.empty()) {
+			int level = edit.new_files_[0].first;
+			OfferForLearning(time.second, level, edit.new_files_[0].second);
+		}
+		MaybeSaveLearningStats();
 
     if (!shutting_down_.Acquire_Load() && !s.ok()) {
       // Wait a little bit before retrying background compaction in
@@ -774,6 +898,10 @@ void DBImpl::TEST_CompactRange(unsigned level, const Slice* begin,const Slice* e
 }
 
 Status DBImpl::TEST_CompactMemTable() {
+  return FlushMemTable();
+}
+
+Status DBImpl::FlushMemTable() {
   // NULL batch means just wait for earlier writes to be done
   Status s = Write(WriteOptions(), NULL);
   if (s.ok()) {
@@ -804,7 +932,7 @@ void DBImpl::CompactLevelThread() {
       break;
     }
 
-    assert(manual_compaction_ == NULL || num_bg_threads_ == 2);
+    assert(manual_compaction_ == NULL || num_bg_threads_ >= 2);
     Status s = BackgroundCompaction();
     bg_fg_cv_.SignalAll(); // before the backoff In case a waiter
                            // can proceed despite the error
@@ -831,6 +959,142 @@ void DBImpl::CompactLevelThread() {
   bg_fg_cv_.SignalAll();
 }
 
+void DBImpl::VlogGCThread() {
+  // The segment being emptied, and how far it is
+  uint64_t segment = 0;
+  uint64_t segment_size = 0;
+  uint64_t offset = 0;
+  // Once it is empty, the log and the read epoch it waits out
+  bool emptied = false;
+  uint64_t emptied_log = 0;
+  int emptied_epoch = 0;
+  // Time owed for the bytes scanned so far, to keep to koo::vlog_gc_rate
+  uint64_t throttle_micros = 0;
+
+  MutexLock l(&mutex_);
+  while (!shutting_down_.Acquire_Load()) {
+    mutex_.Unlock();
+    env_->SleepForMicroseconds(kVlogGCPollMicros);
+    mutex_.Lock();
+    if (throttle_micros > kVlogGCPollMicros) {
+      throttle_micros -= kVlogGCPollMicros;
+      continue;
+    }
+    throttle_micros = 0;
+    // A snapshot may still see older versions of the keys, whose records
+    // are not live as far as the collector can tell
+    if (!allow_background_activity_ || !snapshots_.empty()) {
+      continue;
+    }
+
+    if (emptied) {
+      // Until the memtable that holds the moved pointers is in a table file,
+      // the old records are the only durable copies; RemoveSegment syncs
+      // the moved records, which may be in any partition.  Gets from before
+      // the move may also still read them, and a live backup may be linking
+      // the segment.
+      if (versions_->LogNumber() <= emptied_log ||
+          vlog_reads_[emptied_epoch] != 0 ||
+          backup_in_progress_.Acquire_Load() != NULL) {
+        continue;
+      }
+      Status s = vlog->RemoveSegment(segment);
+      if (!s.ok()) {
+        // The segment is left in place, and removed on a later pass
+        Log(options_.info_log, "Value log segment removal error: %s",
+            s.ToString().c_str());
+        throttle_micros = 1000000;
+        continue;
+      }
+      emptied = false;
+      segment = 0;
+    }
+
+    if (segment == 0) {
+      if (!vlog->PickSegment(kVlogGCMinGarbage, &segment, &segment_size)) {
+        continue;
+      }
+      offset = 0;
+    }
+    const uint64_t start = offset;
+    mutex_.Unlock();
+    Status s = CollectVlogGarbage(segment, segment_size, &offset);
+    mutex_.Lock();
+    if (!s.ok()) {
+      Log(options_.info_log, "Value log garbage collection error: %s",
+          s.ToString().c_str());
+      throttle_micros = 1000000;
+      continue;
+    }
+    const uint64_t rate = koo::vlog_gc_rate > 0 ? koo::vlog_gc_rate : 1;
+    throttle_micros = (offset - start) * 1000000 / rate;
+    if (offset == segment_size) {
+      emptied = true;
+      emptied_log = logfile_number_;
+      emptied_epoch = vlog_read_epoch_;
+      vlog_read_epoch_ ^= 1;
+    }
+  }
+  Log(options_.info_log, "cleaning up VlogGCThread");
+  num_bg_threads_ -= 1;
+  bg_fg_cv_.SignalAll();
+}
+
+Status DBImpl::CollectVlogGarbage(uint64_t segment, uint64_t segment_size,
+                                  uint64_t* offset) {
+  // A sealed segment holds whole records only, but a batch may end within
+  // one; read more if it does not hold a single one
+  const uint64_t left = segment_size - *offset;
+  uint64_t n = std::min(kVlogGCBatch, left);
+  std::string batch;
+  Slice input;
+  Status s;
+  while (true) {
+    s = vlog->ReadRaw(segment, *offset, n, &batch);
+    if (!s.ok()) {
+      return s;
+    }
+    input = batch;
+    Slice key, value;
+    if (koo::VLog::ParseRecord(&input, &key, &value) || n == left) {
+      break;
+    }
+    n = std::min(2 * n, left);
+  }
+
+  input = batch;
+  Slice key, value;
+  while (koo::VLog::ParseRecord(&input, &key, &value)) {
+    const uint64_t value_address =
+        koo::VLog::Address(segment, *offset + (value.data() - batch.data()));
+
+    MutexLock l(VlogKeyLock(key));
+    std::string pointer;
+    s = GetInternal(ReadOptions(), key, &pointer, true);
+    if (s.IsNotFound()) {
+      s = Status::OK();
+    } else if (s.ok() &&
+               pointer.size() == kVlogPointerSize &&
+               DecodeFixed64(pointer.data()) == value_address) {
+      char moved[kVlogPointerSize];
+      s = AppendToVlog(WriteOptions(), key, value, moved);
+      if (s.ok()) {
+        s = DB::Put(WriteOptions(), key, Slice(moved, sizeof(moved)));
+      }
+    }
+    if (!s.ok()) {
+      // The records moved so far are moved again next time, which is
+      // harmless: the pointers go to the new copies
+      return s;
+    }
+  }
+  if (input.size() == batch.size()) {
+    return Status::Corruption("unreadable value log record");
+  }
+  *offset += input.data() - batch.data();
+  return Status::OK();
+}
+
 void DBImpl::RecordBackgroundError(const Status& s) {
   mutex_.AssertHeld();
   if (bg_error_.ok()) {
@@ -963,6 +1227,7 @@ void DBImpl::CleanupCompaction(CompactionState* compact) {
   } else {
     assert(compact->outfile == NULL);
   }
+  delete compact->model;
   delete compact->outfile;
   for (size_t i = 0; i < compact->outputs.size(); i++) {
     const CompactionState::Output& out = compact->outputs[i];
@@ -992,10 +1257,107 @@ Status DBImpl::OpenCompactionOutputFile(CompactionState* compact) {
   Status s = env_->NewWritableFile(fname, &compact->outfile);
   if (s.ok()) {
     compact->builder = new TableBuilder(options_, compact->outfile);
+    if (koo::online_learning) {
+      // Every output key lies within the range of the inputs
+      const Comparator* ucmp = user_comparator();
+      Slice smallest, largest;
+      bool first = true;
+      for (int which = 0; which < 2; which++) {
+        for (size_t i = 0; i < compact->compaction->num_input_files(which); i++) {
+          FileMetaData* f = compact->compaction->input(which, i);
+          if (first || ucmp->Compare(f->smallest.user_key(), smallest) < 0) {
+            smallest = f->smallest.user_key();
+          }
+          if (first || ucmp->Compare(f->largest.user_key(), largest) > 0) {
+            largest = f->largest.user_key();
+          }
+          first = false;
+        }
+      }
+      compact->model = new koo::LearnedIndexData(koo::file_allowed_seek, false, file_number);
+      compact->model->level = compact->compaction->level() + 1;
+      compact->model->SetKeyRange(smallest, largest);
+      TableBuilderInternal::SetLearnedIndex(compact->builder, compact->model);
+    }
   }
   return s;
 }
 
+// Lookups per nanosecond and byte the inputs of the compaction served,
+// negative if none of them has stats. file_stats_mutex must be held.
+static double KeyRangeLookupDensity(Compaction* c, uint64_t now) {
+  double rate = 0;
+  uint64_t bytes = 0;
+  bool found = false;
+  for (int which = 0; which < 2; which++) {
+    for (size_t i = 0; i < c->num_input_files(which); i++) {
+      FileMetaData* f = c->input(which, i);
+      auto iter = koo::file_stats.find(f->number);
+      if (iter == koo::file_stats.end() || now <= iter->second.start) continue;
+      const koo::FileStats& stats = iter->second;
+      rate += (double) (stats.num_lookup_pos + stats.num_lookup_neg) / (now - stats.start);
+      bytes += f->file_size;
+      found = true;
+    }
+  }
+  return found && bytes > 0 ? rate / bytes : -1;
+}
+
+void DBImpl::OfferForLearning(uint64_t time_start, int level, const FileMetaData& meta) {
+  LearningPolicy::Action action = options_.learning_policy->OnFileCreated(level, meta.number, meta.file_size);
+  if (action != LearningPolicy::kSkip) {
+    env_->PrepareLearning(time_start, level, new FileMetaData(meta), action == LearningPolicy::kLearnNow);
+  }
+}
+
+// Interval between two saves of the learning statistics, in micros
+static const uint64_t kLearningStatsInterval = 60 * 1000000;
+
+void DBImpl::LoadLearningStats() {
+  mutex_.AssertHeld();
+  std::string contents;
+  Status s = ReadFileToString(env_, LearningStatsFileName(dbname_), &contents);
+  if (s.ok() && !koo::learn_cb_model->DecodeFrom(contents)) {
+    Log(options_.info_log, "Ignoring corrupt learning statistics");
+  }
+  learning_stats_saved_ = env_->NowMicros();
+
+  // Count the lookups of the files from before the open too, so that the
+  // learning policy hears of them
+  Version* current = versions_->current();
+  MutexLock l(&koo::file_stats_mutex);
+  for (unsigned level = 0; level < config::kNumLevels; level++) {
+    std::vector<FileMetaData*> files;
+    current->GetOverlappingInputs(level, NULL, NULL, &files);
+    for (size_t i = 0; i < files.size(); i++) {
+      koo::FileStats stats(level, files[i]->file_size);
+      stats.recovered = true;
+      koo::file_stats.insert({files[i]->number, stats});
+    }
+  }
+}
+
+void DBImpl::SaveLearningStats() {
+  std::string contents;
+  koo::learn_cb_model->EncodeTo(&contents);
+  Status s = SetLearningStatsFile(env_, dbname_, contents);
+  if (!s.ok()) {
+    Log(options_.info_log, "Saving learning statistics: %s", s.ToString().c_str());
+  }
+}
+
+void DBImpl::MaybeSaveLearningStats() {
+  mutex_.AssertHeld();
+  const uint64_t now = env_->NowMicros();
+  if (learning_stats_saved_ == 0 || now < learning_stats_saved_ + kLearningStatsInterval) {
+    return;
+  }
+  learning_stats_saved_ = now;
+  mutex_.Unlock();
+  SaveLearningStats();
+  mutex_.Lock();
+}
+
 Status DBImpl::FinishCompactionOutputFile(CompactionState* compact,
                                           Iterator* input) {
   assert(compact != NULL);
@@ -1032,21 +1394,35 @@ Status DBImpl::FinishCompactionOutputFile(CompactionState* compact,
 	if (!koo::fresh_write) {
 		koo::file_stats_mutex.Lock();
 		assert(koo::file_stats.find(output_number) == koo::file_stats.end());
-		koo::file_stats.insert({output_number, koo::FileStats(compact->compaction->level() + 1, current_bytes)});
+		koo::FileStats stats(compact->compaction->level() + 1, current_bytes);
+		double density = KeyRangeLookupDensity(compact->compaction, stats.start);
+		if (density >= 0) stats.inherited_rate = density * current_bytes;
+		koo::file_stats.insert({output_number, stats});
 		koo::file_stats_mutex.Unlock();
 	}
 	int level = compact->compaction->level() + 1;
 	CompactionState::Output* output = compact->current_output();
 
-	uint32_t dummy;
-	koo::Stats* instance = koo::Stats::GetInstance();
-	FileMetaData* meta = new FileMetaData();
-	meta->number = output->number;
-	meta->file_size = output->file_size;
-	meta->smallest = output->smallest;
-	meta->largest = output->largest;
+	if (compact->model != NULL) {
+		// Trained while the table was written; nothing is left to learn
+		if (s.ok() && compact->model->Learned()) {
+			compact->model->level = level;
+			koo::file_data->InstallModel(output_number, compact->model);
+		} else {
+			delete compact->model;
+		}
+		compact->model = NULL;
+	} else {
+		uint32_t dummy;
+		koo::Stats* instance = koo::Stats::GetInstance();
+		FileMetaData meta;
+		meta.number = output->number;
+		meta.file_size = output->file_size;
+		meta.smallest = output->smallest;
+		meta.largest = output->largest;
 
-	env_->PrepareLearning((__rdtscp(&dummy) - instance->initial_time) / koo::reference_frequency, level, meta);
+		OfferForLearning((__rdtscp(&dummy) - instance->initial_time) / koo::reference_frequency, level, meta);
+	}
 
   if (s.ok() && current_entries > 0) {
     // Verify that the table is usable
@@ -1178,6 +1554,10 @@ Status DBImpl::DoCompactionWork(CompactionState* compact) {
       }
 
       last_sequence_for_key = ikey.sequence;
+      if (drop && ikey.type == kTypeValue) {
+        // No key points to the record of the value any more
+        vlog->AddGarbage(ikey.user_key.size(), input->value());
+      }
     }
 
     if (!drop) {
@@ -1314,6 +1694,11 @@ int64_t DBImpl::TEST_MaxNextLevelOverlappingBytes() {
 Status DBImpl::Get(const ReadOptions& options,
                    const Slice& key,
                    std::string* value) {
+  return GetInternal(options, key, value, false);
+}
+
+Status DBImpl::GetInternal(const ReadOptions& options, const Slice& key,
+                           std::string* value, bool value_pointer) {
   Status s;
   MutexLock l(&mutex_);
   SequenceNumber snapshot;
@@ -1332,6 +1717,8 @@ Status DBImpl::Get(const ReadOptions& options,
 
   bool have_stat_update = false;
   Version::GetStats stats;
+  const int epoch = vlog_read_epoch_;
+  ++vlog_reads_[epoch];
 
   // Unlock while reading from files and memtables
   {
@@ -1346,7 +1733,7 @@ Status DBImpl::Get(const ReadOptions& options,
       s = current->Get(options, lkey, value, &stats);
       have_stat_update = true;
     }
-		if (s.ok()) {
+		if (s.ok() && !value_pointer) {
 			uint64_t value_address = DecodeFixed64(value->c_str());
 			uint32_t value_size = DecodeFixed32(value->c_str() + sizeof(uint64_t));
 			*value = std::move(koo::db->vlog->ReadRecord(value_address, value_size));
@@ -1357,6 +1744,7 @@ Status DBImpl::Get(const ReadOptions& options,
   if (have_stat_update && current->UpdateStats(stats)) {
     bg_compaction_cv_.Signal();
   }
+  --vlog_reads_[epoch];
   ++straight_reads_;
   mem->Unref();
   if (imm != NULL) imm->Unref();
@@ -1551,17 +1939,47 @@ void DBImpl::ReleaseSnapshot(const Snapshot* s) {
 
 // Convenience methods
 Status DBImpl::Put(const WriteOptions& o, const Slice& key, const Slice& val) {
+  char pointer[kVlogPointerSize];
+  Status s = AppendToVlog(o, key, val, pointer);
+  if (!s.ok()) {
+    return s;
+  }
+  // The record may be appended before one the collector moves for the key,
+  // as long as the pointer to it is put after the moved one
+  if (!vlog_gc_) {
+    return DB::Put(o, key, Slice(pointer, sizeof(pointer)));
+  }
+  MutexLock l(VlogKeyLock(key));
+  return DB::Put(o, key, Slice(pointer, sizeof(pointer)));
+}
+
+Status DBImpl::AppendToVlog(const WriteOptions& o, const Slice& key,
+                            const Slice& val, char* pointer) {
 	uint64_t value_address = koo::db->vlog->AddRecord(key, val);
-	char buffer[sizeof(uint64_t) + sizeof(uint32_t)];
-	EncodeFixed64(buffer, value_address);
-	EncodeFixed32(buffer + sizeof(uint64_t), val.size());
-	return DB::Put(o, key, (Slice) {buffer, sizeof(uint64_t) + sizeof(uint32_t)});
+	if (o.sync) {
+		// the value must be durable before the pointer to it
+		Status s = koo::db->vlog->SyncTo(value_address + val.size());
+		if (!s.ok()) {
+			return s;
+		}
+	}
+	EncodeFixed64(pointer, value_address);
+	EncodeFixed32(pointer + sizeof(uint64_t), val.size());
+	return Status::OK();
 }
 
 Status DBImpl::Delete(const WriteOptions& options, const Slice& key) {
+  if (!vlog_gc_) {
+    return DB::Delete(options, key);
+  }
+  MutexLock l(VlogKeyLock(key));
   return DB::Delete(options, key);
 }
 
+port::Mutex* DBImpl::VlogKeyLock(const Slice& key) {
+  return &vlog_key_locks_[Hash(key.data(), key.size(), 0) % kVlogKeyLocks];
+}
+
 Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
   Writer w(&writers_mutex_);
   Status s;
@@ -1570,6 +1988,15 @@ Status DBImpl::Write(const WriteOptions& options, WriteBatch* updates) {
   if (s.ok() && updates != NULL) { // NULL batch is for compactions
     WriteBatchInternal::SetSequence(updates, w.start_sequence_);
 
+    // The values of the batch are in the value log already, and synced
+    // before it if options.sync; recovery drops the pointers to the ones
+    // that did not make it to disk
+    if (options_.write_ahead_log) {
+      s = w.log_->AddRecord(WriteBatchInternal::Contents(updates));
+      if (s.ok() && options.sync) {
+        s = w.logfile_->Sync();
+      }
+    }
     if (s.ok()) {
       s = WriteBatchInternal::InsertInto(updates, w.mem_);
     }
@@ -1848,6 +2275,8 @@ Status DBImpl::LiveBackup(const Slice& _name) {
 
   name = Slice(name.data(), name_sz);
   std::set<uint64_t> live;
+  std::vector<uint64_t> vlog_segments;
+  std::vector<uint64_t> vlog_heads;
 
   {
     MutexLock l(&writers_mutex_);
@@ -1895,6 +2324,9 @@ Status DBImpl::LiveBackup(const Slice& _name) {
     // release mutex_, you'll need to add some sort of synchronization in place
     // of this text block.
     versions_->AddLiveFiles(&live);
+    // The value log garbage collector does not remove segments while
+    // backup_in_progress_ is set
+    vlog->Segments(&vlog_segments, &vlog_heads);
   }
 
   Status s;
@@ -1952,6 +2384,17 @@ Status DBImpl::LiveBackup(const Slice& _name) {
     }
   }
 
+  // Sealed value log segments are never written again and can be shared;
+  // the heads of the partitions are still appended to
+  for (size_t i = 0; s.ok() && i < vlog_segments.size(); i++) {
+    std::string src = vlog->SegmentFileName(vlog_segments[i]);
+    s = env_->LinkFile(src, backup_dir + src.substr(src.rfind('/')));
+  }
+  for (size_t i = 0; s.ok() && i < vlog_heads.size(); i++) {
+    std::string src = vlog->SegmentFileName(vlog_heads[i]);
+    s = env_->CopyFile(src, backup_dir + src.substr(src.rfind('/')));
+  }
+
   {
     MutexLock l(&mutex_);
     if (s.ok() && backup_deferred_delete_) {
@@ -2008,6 +2451,7 @@ Status DB::Open(const Options& options, const std::string& dbname,
   VersionEdit edit;
   Status s = impl->Recover(&edit); // Handles create_if_missing, error_if_exists
   if (s.ok()) {
+    impl->LoadLearningStats();
     uint64_t new_log_number = impl->versions_->NewFileNumber();
     ConcurrentWritableFile* lfile;
     s = options.env->NewConcurrentWritableFile(LogFileName(dbname, new_log_number),
@@ -2021,7 +2465,6 @@ Status DB::Open(const Options& options, const std::string& dbname,
     }
     if (s.ok()) {
       impl->DeleteObsoleteFiles();
-			//impl->versions_->current()->ReadModel();
       impl->bg_compaction_cv_.Signal();
       impl->bg_memtable_cv_.Signal();
     }
@@ -2090,4 +2533,9 @@ void DBImpl::ReturnCurrentVersion(Version* version) {
 	MutexLock l(&mutex_);
 	version->Unref();
 }
+
+bool DBImpl::IsLiveFile(uint64_t number) {
+	MutexLock l(&mutex_);
+	return pending_outputs_.count(number) != 0 || versions_->current()->HasFile(number);
+}
 }  // namespace leveldb
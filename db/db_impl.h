@@ -97,6 +97,9 @@ class DBImpl : public DB {
 	koo::VLog* vlog;
 	Version* GetCurrentVersion();
 	void ReturnCurrentVersion(Version* version);
+	// Whether the table file is being written or is part of the current
+	// version; a file in neither is on its way to deletion
+	bool IsLiveFile(uint64_t number);
 
  private:
   friend class DB;
@@ -119,6 +122,18 @@ class DBImpl : public DB {
   // Delete any unneeded files and stale in-memory entries.
   void DeleteObsoleteFiles();
 
+  // Tell the learning policy about a new table file created at time_start,
+  // and hand the file to the learning workers if the policy wants a model.
+  void OfferForLearning(uint64_t time_start, int level, const FileMetaData& meta);
+
+  // Warm-start the cost-benefit model with the statistics of the previous
+  // run, so that learning decisions need no new lookups after a restart,
+  // and start counting the lookups of the files the DB was opened with.
+  void LoadLearningStats() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void SaveLearningStats();
+  // Save the statistics if they were last saved long enough ago.
+  void MaybeSaveLearningStats() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   // A background thread to compact the in-memory write buffer to disk.
   // Switches to a new log-file/memtable and writes a new descriptor iff
   // successful.
@@ -146,7 +161,35 @@ class DBImpl : public DB {
   void CompactLevelThread();
   Status BackgroundCompaction() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+  // A background thread, started iff koo::vlog_gc_rate is set, that empties
+  // the value log segments with the most garbage: it moves the records that
+  // the LSM still points to to the head, and deletes the segment once the
+  // moved pointers are in a table file.
+  static void VlogGCWrapper(void* db)
+  { reinterpret_cast<DBImpl*>(db)->VlogGCThread(); }
+  void VlogGCThread();
+  // Move the live records of the next batch of "segment" from *offset, and
+  // advance *offset past it.
+  Status CollectVlogGarbage(uint64_t segment, uint64_t segment_size,
+                            uint64_t* offset);
+
+  // Like Get(), but with value_pointer the vlog address and size that the
+  // LSM holds for the key are returned instead of the value
+  Status GetInternal(const ReadOptions& options, const Slice& key,
+                     std::string* value, bool value_pointer);
+  // While the garbage collector runs, the pointers it moves and the ones
+  // that writers put for a key are serialized, so that it never moves a
+  // record that was just overwritten
+  port::Mutex* VlogKeyLock(const Slice& key);
+  // Append the value to the value log, durably if o.sync, and encode the
+  // address and size that the LSM points the key to into pointer.
+  enum { kVlogPointerSize = sizeof(uint64_t) + sizeof(uint32_t) };
+  Status AppendToVlog(const WriteOptions& o, const Slice& key,
+                      const Slice& val, char* pointer);
+
   void RecordBackgroundError(const Status& s);
+  // Switch to a new memtable and wait until the current one is in a table
+  Status FlushMemTable();
 
   void CleanupCompaction(CompactionState* compact)
       EXCLUSIVE_LOCKS_REQUIRED(mutex_);
@@ -164,6 +207,7 @@ class DBImpl : public DB {
   const Options options_;  // options_.comparator == &internal_comparator_
   bool owns_info_log_;
   bool owns_cache_;
+  bool owns_learning_policy_;
   const std::string dbname_;
 
   // table_cache_ provides its own synchronization
@@ -236,6 +280,20 @@ class DBImpl : public DB {
   // how many reads have we done in a row, uninterrupted by writes
   uint64_t straight_reads_;
 
+  enum { kVlogKeyLocks = 64 };
+  port::Mutex vlog_key_locks_[kVlogKeyLocks];
+  // Whether the garbage collector runs, and writers take VlogKeyLock()
+  const bool vlog_gc_;
+  // The gets that may still read the value log at an address they looked
+  // up, by epoch: a batch of the value log is freed only once the gets of
+  // the epoch before it was moved are done
+  int vlog_read_epoch_;
+  int vlog_reads_[2];
+
+  // when the learning statistics were last loaded or saved, in micros;
+  // 0 until the DB is open, so that a failed open leaves the file alone
+  uint64_t learning_stats_saved_;
+
   VersionSet* versions_;
 
   // Information for ongoing backup processes
@@ -70,11 +70,17 @@ std::string OldInfoLogFileName(const std::string& dbname) {
 }
 
 
+std::string LearningStatsFileName(const std::string& dbname) {
+  return dbname + "/LEARNSTATS";
+}
+
 // Owned filenames have the form:
 //    dbname/CURRENT
 //    dbname/LOCK
 //    dbname/LOG
 //    dbname/LOG.old
+//    dbname/LEARNSTATS
+//    dbname/LEARNSTATS.tmp
 //    dbname/MANIFEST-[0-9]+
 //    dbname/[0-9]+.(log|sst|ldb)
 bool ParseFileName(const std::string& fname,
@@ -90,6 +96,9 @@ bool ParseFileName(const std::string& fname,
   } else if (rest == "LOG" || rest == "LOG.old") {
     *number = 0;
     *type = kInfoLogFile;
+  } else if (rest == "LEARNSTATS" || rest == "LEARNSTATS.tmp") {
+    *number = 0;
+    *type = kLearningStatsFile;
   } else if (rest.starts_with("MANIFEST-")) {
     rest.remove_prefix(strlen("MANIFEST-"));
     uint64_t num;
@@ -141,4 +150,19 @@ Status SetCurrentFile(Env* env, const std::string& dbname,
   return s;
 }
 
+Status SetLearningStatsFile(Env* env, const std::string& dbname,
+                            const Slice& contents) {
+  // Renamed over the old file so that a crash never leaves half of one
+  std::string fname = LearningStatsFileName(dbname);
+  std::string tmp = fname + ".tmp";
+  Status s = WriteStringToFileSync(env, contents, tmp);
+  if (s.ok()) {
+    s = env->RenameFile(tmp, fname);
+  }
+  if (!s.ok()) {
+    env->DeleteFile(tmp);
+  }
+  return s;
+}
+
 }  // namespace leveldb
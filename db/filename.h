@@ -24,7 +24,8 @@ enum FileType {
   kDescriptorFile,
   kCurrentFile,
   kTempFile,
-  kInfoLogFile  // Either the current one, or an old one
+  kInfoLogFile,  // Either the current one, or an old one
+  kLearningStatsFile
 };
 
 // Return the name of the log file with the specified number
@@ -67,6 +68,10 @@ extern std::string InfoLogFileName(const std::string& dbname);
 // Return the name of the old info log file for "dbname".
 extern std::string OldInfoLogFileName(const std::string& dbname);
 
+// Return the name of the file keeping the statistics that learning
+// decisions are based on across restarts.
+extern std::string LearningStatsFileName(const std::string& dbname);
+
 // If filename is a leveldb file, store the type of the file in *type.
 // The number encoded in the filename is stored in *number.  If the
 // filename was successfully parsed, returns true.  Else return false.
@@ -79,6 +84,10 @@ extern bool ParseFileName(const std::string& filename,
 extern Status SetCurrentFile(Env* env, const std::string& dbname,
                              uint64_t descriptor_number);
 
+// Replace the learning statistics file with one holding "contents".
+extern Status SetLearningStatsFile(Env* env, const std::string& dbname,
+                                   const Slice& contents);
+
 
 }  // namespace leveldb
 
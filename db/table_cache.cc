@@ -4,13 +4,15 @@
 
 #include "db/table_cache.h"
 
+#include <algorithm>
+
 #include "db/filename.h"
 #include "hyperleveldb/env.h"
 #include "hyperleveldb/table.h"
 #include "util/coding.h"
-#include "util/coding.h"
 #include "table/filter_block.h"
 #include "table/block.h"
+#include "koo/epoch.h"
 #include "koo/stats.h"
 #include "koo/koo.h"
 
@@ -19,6 +21,8 @@ namespace leveldb {
 struct TableAndFile {
   RandomAccessFile* file;
   Table* table;
+  // Reads of the file point into a mapping instead of filling the scratch
+  bool mmapped;
 };
 
 static void DeleteEntry(const Slice& /*key*/, void* value) {
@@ -28,6 +32,24 @@ static void DeleteEntry(const Slice& /*key*/, void* value) {
   delete tf;
 }
 
+// Buffers model-guided reads reuse: the parts of blocks read from files
+// that are not mmapped, and the key rebuilt from prefix-compressed entries.
+// Kept per thread so concurrent lookups never share one.
+struct LevelReadBuffers {
+  std::string restarts;
+  std::string entries;
+  std::string key;
+};
+
+static thread_local LevelReadBuffers level_read_buffers;
+
+static char* ReserveScratch(std::string* buffer, size_t n) {
+  if (buffer->size() < n) {
+    buffer->resize(n);
+  }
+  return &(*buffer)[0];
+}
+
 static void UnrefEntry(void* arg1, void* arg2) {
   Cache* cache = reinterpret_cast<Cache*>(arg1);
   Cache::Handle* h = reinterpret_cast<Cache::Handle*>(arg2);
@@ -75,15 +97,31 @@ Status TableCache::FindTable(uint64_t file_number, uint64_t file_size,
       // We do not cache error results so that if the error is transient,
       // or somebody repairs the file, we recover automatically.
     } else {
+      LoadModel(table, file_number);
+
       TableAndFile* tf = new TableAndFile;
       tf->file = file;
       tf->table = table;
+      char probe;
+      Slice probed;
+      tf->mmapped = file->Read(0, 1, &probed, &probe).ok() &&
+                    probed.data() != &probe;
       *handle = cache_->Insert(key, tf, 1, &DeleteEntry);
     }
   }
   return s;
 }
 
+void TableCache::LoadModel(Table* table, uint64_t file_number) {
+  if (koo::file_data == nullptr || koo::file_data->HasModel(file_number)) return;
+  koo::LearnedIndexData* model = new koo::LearnedIndexData(koo::file_allowed_seek, false, file_number);
+  if (table->ReadLearnedIndex(model)) {
+    koo::file_data->InstallModel(file_number, model);
+  } else {
+    delete model;
+  }
+}
+
 Iterator* TableCache::NewIterator(const ReadOptions& options,
                                   uint64_t file_number,
                                   uint64_t file_size,
@@ -111,29 +149,53 @@ Status TableCache::Get(const ReadOptions& options, uint64_t file_number,
                        uint64_t file_size, const Slice& k, void* arg,
                        void (*handle_result)(void*, const Slice&, const Slice&), int level,
                        FileMetaData* meta, uint64_t lower, uint64_t upper,
-                       bool learned, Version* version,
-                       koo::LearnedIndexData** model, bool* file_learned) {
+                       bool learned, Version* version, bool* file_learned) {
   Cache::Handle* handle = NULL;
   koo::Stats* instance = koo::Stats::GetInstance();
 
-#if BOURBON_PLUS
-	koo::LearnedIndexData* model_ = koo::file_data->GetModelForLookup(meta->number);
-	if (model_ != nullptr) {
-		*model = model_;
-#else
-  	*model = koo::file_data->GetModel(meta->number);
-  	assert(file_learned != nullptr);
-#endif
-  	*file_learned = (*model)->Learned();
+  if (learned) {
+    // the level model already gave the position within this file
+    *file_learned = true;
+    LevelRead(options, file_number, file_size, k, arg, handle_result, level,
+              meta, lower, upper, learned, version);
+    return Status::OK();
+  }
 
-  	if (learned || *file_learned) {
-  		LevelRead(options, file_number, file_size, k, arg, handle_result, level,
-								meta, lower, upper, learned, version);
-			return Status::OK();
-		}
+  if (file_learned != nullptr) {
 #if BOURBON_PLUS
-	}
+    // the model is neither locked nor referenced, the guard keeps it alive
+    koo::EpochGuard guard;
+    bool reload;
+    koo::LearnedIndexData* model = koo::file_data->GetModelForLookup(meta->number, &reload);
+    if (reload) {
+      // the model was evicted to save memory: read it back from the table
+      Status s = FindTable(file_number, file_size, &handle);
+      if (!s.ok()) return s;
+      LoadModel(reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table, file_number);
+      cache_->Release(handle);
+      handle = NULL;
+      model = koo::file_data->GetModelForLookup(meta->number, &reload);
+    }
+    if (model != nullptr) {
+      // a model slower than the index block for this file is skipped
+      *file_learned = model->Learned() && !model->Bypassed();
+      if (*file_learned) {
+        LevelRead(options, file_number, file_size, k, arg, handle_result, level,
+                  meta, lower, upper, learned, version, model);
+        return Status::OK();
+      }
+    }
+#else
+    koo::LearnedIndexData* model = koo::file_data->GetModel(meta->number);
+    *file_learned = model->Learned() && !model->Bypassed();
+    if (*file_learned) {
+      LevelRead(options, file_number, file_size, k, arg, handle_result, level,
+                meta, lower, upper, learned, version, model);
+    }
+    model->Unref();
+    if (*file_learned) return Status::OK();
 #endif
+  }
 
   Status s = FindTable(file_number, file_size, &handle);
   if (s.ok()) {
@@ -144,6 +206,79 @@ Status TableCache::Get(const ReadOptions& options, uint64_t file_number,
   return s;
 }
 
+namespace {
+struct ShadowResult {
+  Slice user_key;
+  bool found;
+};
+}
+
+static void RecordShadowResult(void* arg, const Slice& found_key, const Slice& value) {
+  ShadowResult* result = reinterpret_cast<ShadowResult*>(arg);
+  if (ExtractUserKey(found_key) == result->user_key) result->found = true;
+}
+
+void TableCache::ShadowLookup(const ReadOptions& options, uint64_t file_number,
+                              uint64_t file_size, const Slice& k, int level,
+                              FileMetaData* meta, Version* version) {
+#if BOURBON_PLUS
+  koo::EpochGuard guard;
+  bool reload;
+  koo::LearnedIndexData* model = koo::file_data->GetModelForLookup(file_number, &reload);
+  if (model == nullptr || !model->Learned()) return;
+#else
+  koo::LearnedIndexData* model = koo::file_data->GetModel(file_number);
+  if (!model->Learned()) {
+    model->Unref();
+    return;
+  }
+#endif
+  Cache::Handle* handle = NULL;
+  Status s = FindTable(file_number, file_size, &handle);
+  if (!s.ok()) {
+#if !BOURBON_PLUS
+    model->Unref();
+#endif
+    return;
+  }
+  Table* table = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
+
+  // The first lookup warms the caches for the second: take turns
+  static thread_local bool model_first = false;
+  model_first = !model_first;
+  ShadowResult result{ExtractUserKey(k), false};
+  ShadowResult model_result{ExtractUserKey(k), false};
+  uint64_t baseline_time = 0, model_time = 0;
+  bool migrated = false;
+  for (int pass = 0; pass < 2; ++pass) {
+    const bool through_model = (pass == 0) == model_first;
+    uint32_t cpu_start, cpu_end;
+    const uint64_t start = __rdtscp(&cpu_start);
+    if (through_model) {
+      LevelRead(options, file_number, file_size, k, &model_result, RecordShadowResult,
+                level, meta, 0, 0, false, version, model);
+    } else {
+      table->InternalGet(options, k, &result, RecordShadowResult, level, meta);
+    }
+    const uint64_t time = (__rdtscp(&cpu_end) - start) / koo::reference_frequency;
+    (through_model ? model_time : baseline_time) = time;
+    migrated = migrated || cpu_start != cpu_end;
+  }
+  cache_->Release(handle);
+
+  // Both ways read the same block: one far slower than the other was most
+  // likely descheduled, and would swamp the averages
+  const uint64_t fast = std::min(baseline_time, model_time);
+  const uint64_t slow = std::max(baseline_time, model_time);
+  if (!migrated && slow <= 16 * std::max<uint64_t>(fast, 1)) {
+    model->AddShadowSample(baseline_time, model_time);
+    koo::learn_cb_model->AddShadowData(level, result.found, baseline_time, model_time);
+  }
+#if !BOURBON_PLUS
+  model->Unref();
+#endif
+}
+
 void TableCache::Evict(uint64_t file_number) {
   char buf[sizeof(file_number)];
   EncodeFixed64(buf, file_number);
@@ -154,20 +289,23 @@ void TableCache::LevelRead(const ReadOptions& options, uint64_t file_number,
 														uint64_t file_size, const Slice& k, void* arg, 
 														void (*handle_result)(void*, const Slice&, const Slice&), int level,
 														FileMetaData* meta, uint64_t lower, uint64_t upper,
-														bool learned, Version* version) {
+														bool learned, Version* version,
+														koo::LearnedIndexData* model) {
 	koo::Stats* instance = koo::Stats::GetInstance();
 
 	// Find table
   Cache::Handle* handle = NULL;
   Status s = FindTable(file_number, file_size, &handle);
+  if (!s.ok()) return;
   TableAndFile* tf = reinterpret_cast<TableAndFile*>(cache_->Value(handle));
   RandomAccessFile* file = tf->file;
-  FilterBlockReader* filter = tf->table->rep_->filter;
+  Table::Rep* rep = tf->table->rep_;
+  FilterBlockReader* filter = rep->filter;
+  const Comparator* comparator = rep->options.comparator;
 
 	if (!learned) {
 		ParsedInternalKey parsed_key;
 	  ParseInternalKey(k, &parsed_key);
-	  koo::LearnedIndexData* model = koo::file_data->GetModel(meta->number);
 		auto bounds = model->GetPosition(parsed_key.user_key);
 		lower = bounds.first;
 	  upper = bounds.second;
@@ -177,67 +315,183 @@ void TableCache::LevelRead(const ReadOptions& options, uint64_t file_number,
 		}
 	}
 
-  // Get the position we want to read
-  // Get the data block index
-  size_t index_lower = lower / koo::block_num_entries;
-  size_t index_upper = upper / koo::block_num_entries;
-
-  // if the given interval overlaps two data block, consult the index block to get
-  // the largest key in the first data block and compare it with the target key
-  // to decide which data block the key is in
-  uint64_t i = index_lower;
-  if (index_lower != index_upper) {
-    Block* index_block = tf->table->rep_->index_block;
-    uint32_t mid_index_entry = DecodeFixed32(index_block->data_ + index_block->restart_offset_ + index_lower * sizeof(uint32_t));
+  // Without the entry count of each data block a position cannot be
+  // mapped to a block; go through the index block instead
+  const std::vector<uint64_t>& accumulated = rep->accumulated_block_entries;
+  if (accumulated.empty()) {
+    tf->table->InternalGet(options, k, arg, handle_result, level, meta);
+    cache_->Release(handle);
+    return;
+  }
+  if (lower >= accumulated.back()) {
+    cache_->Release(handle);
+    return;
+  }
+  if (upper >= accumulated.back()) upper = accumulated.back() - 1;
+
+  // Get the data blocks holding both ends of the interval
+  size_t index_lower = std::upper_bound(accumulated.begin(), accumulated.end(), lower) - accumulated.begin();
+  size_t index_upper = std::upper_bound(accumulated.begin() + index_lower, accumulated.end(), upper) - accumulated.begin();
+
+  // if the given interval spans several data blocks, the key is in the first
+  // one whose index entry (a key >= all keys of its block) is >= the target
+  Block* index_block = rep->index_block;
+  const char* index_limit = index_block->data_ + index_block->restart_offset_;
+  size_t i = index_lower;
+  Slice handle_value;
+  for (;;) {
+    uint32_t index_entry = DecodeFixed32(index_limit + i * sizeof(uint32_t));
     uint32_t shared, non_shared, value_length;
-    const char* key_ptr = DecodeEntry(index_block->data_ + mid_index_entry,
-                                      index_block->data_ + index_block->restart_offset_, &shared, &non_shared, &value_length);
+    const char* key_ptr = DecodeEntry(index_block->data_ + index_entry, index_limit,
+                                      &shared, &non_shared, &value_length);
     assert(key_ptr != nullptr && shared == 0 && "Index Entry Corruption");
-    Slice mid_key(key_ptr, non_shared);
-    int comp = tf->table->rep_->options.comparator->Compare(mid_key, k);
-    i = comp < 0 ? index_upper : index_lower;
+    handle_value = Slice(key_ptr + non_shared, value_length);
+    if (i == index_upper || comparator->Compare(Slice(key_ptr, non_shared), k) >= 0) break;
+    ++i;
   }
+  BlockHandle block_handle;
+  Slice handle_input = handle_value;
+  s = block_handle.DecodeFrom(&handle_input);
+  assert(s.ok() && "Index Entry Corruption");
 
   // Check Filter Block
-  uint64_t block_offset = i * koo::block_size;
-  if (filter != nullptr && !filter->KeyMayMatch(block_offset, k)) {
+  if (filter != nullptr && !filter->KeyMayMatch(block_handle.offset(), k)) {
+    cache_->Release(handle);
+    return;
+  }
+
+  // Look for a cached copy of the block before touching the file
+  Cache* block_cache = rep->options.block_cache;
+  Cache::Handle* block_cache_handle = NULL;
+  if (block_cache != NULL) {
+    char cache_key_buffer[16];
+    EncodeFixed64(cache_key_buffer, rep->cache_id);
+    EncodeFixed64(cache_key_buffer+8, block_handle.offset());
+    block_cache_handle = block_cache->Lookup(Slice(cache_key_buffer, sizeof(cache_key_buffer)));
+  }
+
+  // A compressed block has to be read whole; the model still saved the
+  // index block search
+  if (block_cache_handle == NULL && rep->compressed_blocks[i]) {
+    Iterator* block_iter = Table::BlockReader(tf->table, options, handle_value);
+    block_iter->Seek(k);
+    if (block_iter->Valid()) {
+      handle_result(arg, block_iter->key(), block_iter->value());
+    } else if (block_iter->status().ok() && model != NULL && model->has_ties) {
+      tf->table->InternalGet(options, k, arg, handle_result, level, meta);
+    }
+    delete block_iter;
     cache_->Release(handle);
     return;
   }
 
   // Get the interval within the data block that the target key may lie in
-  size_t pos_block_lower = i == index_lower ? lower % koo::block_num_entries : 0;
-  size_t pos_block_upper = i == index_upper ? upper % koo::block_num_entries : koo::block_num_entries - 1;
-
-  // Read corresponding entries
-  size_t read_size = (pos_block_upper - pos_block_lower + 1) * koo::entry_size;
-  static char scratch[4096];
-  Slice entries;
-  s = file->Read(block_offset + pos_block_lower * koo::entry_size, read_size, &entries, scratch);
-  assert(s.ok());
-
-  // Binary Search within the interval
-  uint64_t left = pos_block_lower, right = pos_block_upper;
+  uint64_t block_start = i == 0 ? 0 : accumulated[i - 1];
+  uint64_t block_entries = accumulated[i] - block_start;
+  uint64_t pos_block_lower = i == index_lower ? lower - block_start : 0;
+  uint64_t pos_block_upper = i == index_upper ? upper - block_start : block_entries - 1;
+
+  // Locate the restart points of the groups covering the interval, plus the
+  // start of the next group which bounds the entries to search
+  const uint64_t interval = rep->restart_interval;
+  const uint64_t num_restarts = (block_entries + interval - 1) / interval;
+  const uint64_t restarts_offset = block_handle.size() - (num_restarts + 1) * sizeof(uint32_t);
+  uint64_t group_lower = pos_block_lower / interval;
+  uint64_t group_upper = pos_block_upper / interval;
+  const char* restarts;
+  const char* entries;
+  const char* limit;
+  uint32_t entries_begin;
+  if (block_cache_handle != NULL) {
+    Block* block = reinterpret_cast<Block*>(block_cache->Value(block_cache_handle));
+    restarts = block->data_ + block->restart_offset_ + group_lower * sizeof(uint32_t);
+    entries = block->data_;
+    limit = block->data_ + block->restart_offset_;
+    entries_begin = 0;
+  } else {
+    // Reads from an mmapped file point straight into the mapping and leave
+    // this thread's buffers alone; others land in them
+    uint64_t num_bounds = std::min(group_upper + 2, num_restarts) - group_lower;
+    Slice restart_contents;
+    s = file->Read(block_handle.offset() + restarts_offset + group_lower * sizeof(uint32_t),
+                   num_bounds * sizeof(uint32_t), &restart_contents,
+                   tf->mmapped ? NULL : ReserveScratch(&level_read_buffers.restarts,
+                                                       num_bounds * sizeof(uint32_t)));
+    if (!s.ok() || restart_contents.size() != num_bounds * sizeof(uint32_t)) {
+      cache_->Release(handle);
+      return;
+    }
+    restarts = restart_contents.data();
+    entries_begin = DecodeFixed32(restarts);
+    uint32_t entries_end = group_upper + 1 < num_restarts
+                           ? DecodeFixed32(restarts + (group_upper + 1 - group_lower) * sizeof(uint32_t))
+                           : restarts_offset;
+
+    // Read corresponding entries
+    Slice entry_contents;
+    s = file->Read(block_handle.offset() + entries_begin, entries_end - entries_begin,
+                   &entry_contents,
+                   tf->mmapped ? NULL : ReserveScratch(&level_read_buffers.entries,
+                                                       entries_end - entries_begin));
+    if (!s.ok() || entry_contents.size() != entries_end - entries_begin) {
+      cache_->Release(handle);
+      return;
+    }
+    entries = entry_contents.data();
+    limit = entries + entry_contents.size();
+  }
+
+  // Binary Search for the last group starting before the target; the first
+  // entry of a group never shares a prefix with its predecessor
+  uint64_t left = group_lower, right = group_upper;
   while (left < right) {
-    uint32_t mid = (left + right) / 2;
+    uint64_t mid = (left + right + 1) / 2;
+    uint32_t offset = DecodeFixed32(restarts + (mid - group_lower) * sizeof(uint32_t));
     uint32_t shared, non_shared, value_length;
-    const char* key_ptr = DecodeEntry(entries.data() + (mid - pos_block_lower) * koo::entry_size,
-            entries.data() + read_size, &shared, &non_shared, &value_length);
+    const char* key_ptr = DecodeEntry(entries + offset - entries_begin, limit,
+                                      &shared, &non_shared, &value_length);
     assert(key_ptr != nullptr && shared == 0 && "Entry Corruption");
-    Slice mid_key(key_ptr, non_shared);
-    int comp = tf->table->rep_->options.comparator->Compare(mid_key, k);
-    if (comp < 0) left = mid + 1;
-    else right = mid;
+    if (comparator->Compare(Slice(key_ptr, non_shared), k) < 0) left = mid;
+    else right = mid - 1;
   }
 
-  // decode the target entry to get the key and value (actually value_addr)
-  uint32_t shared, non_shared, value_length;
-  const char* key_ptr = DecodeEntry(entries.data() + (left - pos_block_lower) * koo::entry_size,
-          entries.data() + read_size, &shared, &non_shared, &value_length);
-  assert(key_ptr != nullptr && shared == 0 && "Entry Corruption");
-  Slice key(key_ptr, non_shared), value(key_ptr + non_shared, value_length);
-  handle_result(arg, key, value);
+  // Scan the group for the first entry at or after the target
+  uint32_t offset = DecodeFixed32(restarts + (left - group_lower) * sizeof(uint32_t));
+  const char* p = entries + offset - entries_begin;
+  std::string& key_buffer = level_read_buffers.key;
+  Slice key, value;
+  bool found = false;
+  while (p < limit) {
+    uint32_t shared, non_shared, value_length;
+    const char* key_ptr = DecodeEntry(p, limit, &shared, &non_shared, &value_length);
+    if (key_ptr == nullptr || shared > key.size()) break;
+    if (shared == 0) {
+      key = Slice(key_ptr, non_shared);
+    } else {
+      if (key.data() != key_buffer.data()) key_buffer.assign(key.data(), shared);
+      else key_buffer.resize(shared);
+      key_buffer.append(key_ptr, non_shared);
+      key = Slice(key_buffer);
+    }
+    value = Slice(key_ptr + non_shared, value_length);
+    if (comparator->Compare(key, k) >= 0) {
+      found = true;
+      break;
+    }
+    p = key_ptr + non_shared + value_length;
+  }
+
+  if (found) {
+    handle_result(arg, key, value);
+  } else if (model != NULL && model->has_ties) {
+    // The target may sit past the predicted interval among keys that share
+    // its integer mapping; let the index block find it.
+    tf->table->InternalGet(options, k, arg, handle_result, level, meta);
+  }
 
+  if (block_cache_handle != NULL) {
+    block_cache->Release(block_cache_handle);
+  }
 	cache_->Release(handle);
 }
 
@@ -247,9 +501,9 @@ bool TableCache::FillData(const ReadOptions& options, FileMetaData* meta, koo::L
 
 	if (s.ok()) {
 		Table* table = reinterpret_cast<TableAndFile*>(cache_->Value(handle))->table;
-		table->FillData(options, data);
+		bool ok = table->FillData(options, data);
 		cache_->Release(handle);
-		return true;
+		return ok;
 	} else return false;
 }
 
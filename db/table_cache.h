@@ -45,7 +45,7 @@ class TableCache {
              void (*handle_result)(void*, const Slice&, const Slice&), int level,
              FileMetaData* meta = nullptr, uint64_t lower = 0, uint64_t upper = 0,
              bool learned = false, Version* version = nullptr,
-             koo::LearnedIndexData** model = nullptr, bool* file_learned = nullptr);
+             bool* file_learned = nullptr);
 
   // Evict any entry for the specified file number
   void Evict(uint64_t file_number);
@@ -55,7 +55,17 @@ class TableCache {
 								uint64_t file_size, const Slice& k, void* arg,
 								void (*handle_result)(void*, const Slice&, const Slice&), int level,
 								FileMetaData* meta = nullptr, uint64_t lower = 0, uint64_t upper = 0,
-								bool learned = false, Version* version = nullptr);
+								bool learned = false, Version* version = nullptr,
+								koo::LearnedIndexData* model = nullptr);
+
+  // Time a lookup of internal key "k" in a learned file both through its
+  // model and through the index block of the table, without handing either
+  // result on, and record what the model saved. Does nothing if the file
+  // has no learned model. A model that keeps losing is bypassed by Get()
+  // until it wins again here.
+  void ShadowLookup(const ReadOptions& options, uint64_t file_number,
+                    uint64_t file_size, const Slice& k, int level,
+                    FileMetaData* meta, Version* version);
 
  private:
   TableCache(const TableCache&);
@@ -66,6 +76,8 @@ class TableCache {
   Cache* cache_;
 
   Status FindTable(uint64_t file_number, uint64_t file_size, Cache::Handle**);
+  // Pick up the model stored with the table unless one is already served
+  static void LoadModel(Table* table, uint64_t file_number);
 };
 
 }  // namespace leveldb
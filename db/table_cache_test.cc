@@ -0,0 +1,434 @@
+// Checks that the model a table is trained on while it is written serves
+// lookups through TableCache, and that they find the same entries as the
+// index block of the table, whatever the layout of the table and however
+// its blocks are read.
+
+#include "db/table_cache.h"
+
+#include <set>
+#include <thread>
+
+#include "db/db_impl.h"
+#include "db/dbformat.h"
+#include "db/filename.h"
+#include "db/version_edit.h"
+#include "hyperleveldb/cache.h"
+#include "hyperleveldb/db.h"
+#include "hyperleveldb/env.h"
+#include "hyperleveldb/learning_policy.h"
+#include "hyperleveldb/table_builder.h"
+#include "koo/learned_index.h"
+#include "koo/util.h"
+#include "port/port.h"
+#include "table/table_builder_internal.h"
+#include "util/random.h"
+#include "util/testharness.h"
+#include "util/testutil.h"
+
+namespace leveldb {
+
+namespace {
+struct LookupResult {
+  bool found;
+  std::string key;
+  std::string value;
+};
+}
+
+// Reads into the scratch buffer, as files that are not mmapped do
+class PreadFile : public RandomAccessFile {
+ public:
+  explicit PreadFile(RandomAccessFile* target) : target_(target) { }
+  virtual ~PreadFile() { delete target_; }
+  virtual Status Read(uint64_t offset, size_t n, Slice* result,
+                      char* scratch) const {
+    Status s = target_->Read(offset, n, result, scratch);
+    if (s.ok() && result->data() != scratch) {
+      memcpy(scratch, result->data(), result->size());
+      *result = Slice(scratch, result->size());
+    }
+    return s;
+  }
+
+ private:
+  RandomAccessFile* target_;
+};
+
+class PreadEnv : public EnvWrapper {
+ public:
+  PreadEnv() : EnvWrapper(Env::Default()) { }
+  virtual Status NewRandomAccessFile(const std::string& fname,
+                                     RandomAccessFile** result) {
+    Status s = target()->NewRandomAccessFile(fname, result);
+    if (s.ok()) {
+      *result = new PreadFile(*result);
+    }
+    return s;
+  }
+};
+
+static bool SnappyCompressionSupported() {
+  std::string out;
+  Slice in = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+  return port::Snappy_Compress(in.data(), in.size(), &out);
+}
+
+static void SaveResult(void* arg, const Slice& found_key, const Slice& value) {
+  LookupResult* result = reinterpret_cast<LookupResult*>(arg);
+  result->found = true;
+  result->key = ExtractUserKey(found_key).ToString();
+  result->value = value.ToString();
+}
+
+class TableCacheTest {
+ public:
+  std::string dbname_;
+  InternalKeyComparator icmp_;
+  PreadEnv pread_env_;
+  // As the DB sanitizes them: tables hold internal keys
+  Options options_;
+  TableCache* cache_;
+
+  TableCacheTest() : icmp_(BytewiseComparator()), cache_(NULL) {
+    options_.comparator = &icmp_;
+    dbname_ = test::TmpDir() + "/table_cache_test";
+    DestroyDB(dbname_, Options());
+    options_.env->CreateDir(dbname_);
+    koo::file_data = new koo::FileLearnedIndexData();
+  }
+
+  ~TableCacheTest() {
+    koo::online_learning = false;
+    delete cache_;
+    delete options_.block_cache;
+    delete koo::file_data;
+    koo::file_data = NULL;
+    DestroyDB(dbname_, Options());
+  }
+
+  // Write table "number" with keys[i] -> values[i], training its model as
+  // BuildTable() does, and install the model.  Returns the file size.
+  uint64_t Build(uint64_t number, const std::vector<std::string>& keys,
+                 const std::vector<std::string>& values) {
+    WritableFile* file;
+    ASSERT_OK(options_.env->NewWritableFile(TableFileName(dbname_, number),
+                                            &file));
+    TableBuilder builder(options_, file);
+    koo::LearnedIndexData* model =
+        new koo::LearnedIndexData(koo::file_allowed_seek, false, number);
+    model->SetKeyRange(keys.front(), keys.back());
+    TableBuilderInternal::SetLearnedIndex(&builder, model);
+    for (size_t i = 0; i < keys.size(); i++) {
+      InternalKey ikey(keys[i], i + 1, kTypeValue);
+      builder.Add(ikey.Encode(), values[i]);
+    }
+    ASSERT_OK(builder.Finish());
+    ASSERT_OK(file->Sync());
+    ASSERT_OK(file->Close());
+    delete file;
+    ASSERT_TRUE(model->Learned());
+    koo::file_data->InstallModel(number, model);
+    return builder.FileSize();
+  }
+
+  // Tables are opened again, with the current options_
+  void Reopen() {
+    delete cache_;
+    cache_ = NULL;
+  }
+
+  // Look "key" up in the table; returns whether the lookup went through
+  // the model of the table
+  bool Lookup(uint64_t number, uint64_t size, const Slice& key,
+              LookupResult* result) {
+    if (cache_ == NULL) {
+      cache_ = new TableCache(dbname_, &options_, 100);
+    }
+    FileMetaData meta;
+    meta.number = number;
+    meta.file_size = size;
+    LookupKey lkey(key, kMaxSequenceNumber);
+    result->found = false;
+    bool learned = false;
+    ASSERT_OK(cache_->Get(ReadOptions(), number, size, lkey.internal_key(),
+                          result, SaveResult, 0, &meta, 0, 0, false, NULL,
+                          &learned));
+    return learned;
+  }
+
+  // Every key is found through the model, and the keys in between are not
+  void Check(uint64_t number, uint64_t size,
+             const std::vector<std::string>& keys,
+             const std::vector<std::string>& values) {
+    for (size_t i = 0; i < keys.size(); i++) {
+      LookupResult result;
+      ASSERT_TRUE(Lookup(number, size, keys[i], &result));
+      ASSERT_TRUE(result.found);
+      ASSERT_EQ(result.key, keys[i]);
+      ASSERT_EQ(result.value, values[i]);
+
+      std::string absent = keys[i] + '\0';
+      if (i + 1 < keys.size() && keys[i + 1] == absent) continue;
+      Lookup(number, size, absent, &result);
+      ASSERT_TRUE(!result.found || result.key != absent);
+    }
+  }
+};
+
+TEST(TableCacheTest, OnlineTrainedModel) {
+  Random rnd(301);
+  std::vector<std::string> keys, values;
+  for (int i = 0; i < 10000; i++) {
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%012d", i * 7);
+    keys.push_back(buf);
+    std::string value;
+    test::RandomString(&rnd, 100, &value);
+    values.push_back(value);
+  }
+  uint64_t size = Build(7, keys, values);
+  ASSERT_TRUE(koo::file_data->HasModel(7));
+  Check(7, size, keys, values);
+}
+
+// Keys of 1 to 40 bytes, many of them binary and sharing long prefixes,
+// and values of 0 to 300 bytes, compressible if "compressible"
+static void RandomEntries(Random* rnd, int n, bool compressible,
+                          std::vector<std::string>* keys,
+                          std::vector<std::string>* values) {
+  std::set<std::string> unique;
+  while (unique.size() < static_cast<size_t>(n)) {
+    std::string key;
+    if (rnd->OneIn(2)) {
+      key = "shared/prefix/longer/than/eight/bytes/";
+    }
+    const int length = 1 + rnd->Uniform(rnd->OneIn(4) ? 40 : 10);
+    for (int i = 0; i < length; i++) {
+      key.push_back(rnd->OneIn(3) ? static_cast<char>(rnd->Uniform(256))
+                                  : static_cast<char>('a' + rnd->Uniform(26)));
+    }
+    unique.insert(key);
+  }
+  keys->assign(unique.begin(), unique.end());
+  values->clear();
+  for (size_t i = 0; i < keys->size(); i++) {
+    std::string value;
+    const int length = rnd->Skewed(8) % 301;
+    if (compressible) {
+      test::CompressibleString(rnd, 0.25, length, &value);
+    } else {
+      test::RandomString(rnd, length, &value);
+    }
+    values->push_back(value);
+  }
+}
+
+// Block sizes from a few entries per block to a single block, with an
+// entry count that leaves the last block short, read from mmapped files
+// and into scratch buffers, with compressed blocks and from the block cache
+TEST(TableCacheTest, Layouts) {
+  const bool snappy = SnappyCompressionSupported();
+  if (!snappy) {
+    fprintf(stderr, "skipping compression tests\n");
+  }
+  Random rnd(302);
+  uint64_t number = 100;
+  static const size_t kBlockSizes[] = { 256, 4096, 1 << 20 };
+  for (size_t b = 0; b < sizeof(kBlockSizes) / sizeof(kBlockSizes[0]); b++) {
+    for (int compressed = 0; compressed < 2; compressed++) {
+      if (compressed && !snappy) continue;
+      for (int cached = 0; cached < 2; cached++) {
+        for (int pread = 0; pread < 2; pread++) {
+          std::vector<std::string> keys, values;
+          RandomEntries(&rnd, 3001, compressed, &keys, &values);
+          options_.block_size = kBlockSizes[b];
+          options_.block_restart_interval = 1 + rnd.Uniform(32);
+          options_.compression =
+              compressed ? kSnappyCompression : kNoCompression;
+          Reopen();
+          delete options_.block_cache;
+          options_.block_cache = cached ? NewLRUCache(8 << 20) : NULL;
+          options_.env = pread ? &pread_env_ : Env::Default();
+          uint64_t size = Build(++number, keys, values);
+
+          if (cached) {
+            // Scan the table into the block cache
+            LookupResult result;
+            Lookup(number, size, keys[0], &result);
+            Iterator* iter = cache_->NewIterator(ReadOptions(), number, size);
+            int entries = 0;
+            for (iter->SeekToFirst(); iter->Valid(); iter->Next()) entries++;
+            ASSERT_OK(iter->status());
+            ASSERT_EQ(entries, static_cast<int>(keys.size()));
+            delete iter;
+          }
+          Check(number, size, keys, values);
+        }
+      }
+    }
+  }
+}
+
+// Lookups of a table from several threads at once, which share the table
+// and the block cache but not the buffers that pread lookups read into
+TEST(TableCacheTest, ConcurrentReaders) {
+  const int kThreads = 4;
+  Random rnd(303);
+  std::vector<std::string> keys, values;
+  RandomEntries(&rnd, 5000, false, &keys, &values);
+  options_.block_size = 1024;
+  for (int cached = 0; cached < 2; cached++) {
+    Reopen();
+    delete options_.block_cache;
+    options_.block_cache = cached ? NewLRUCache(1 << 20) : NULL;
+    options_.env = &pread_env_;
+    const uint64_t number = 200 + cached;
+    uint64_t size = Build(number, keys, values);
+    LookupResult result;
+    Lookup(number, size, keys[0], &result);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.push_back(std::thread([&, t]() {
+        Random thread_rnd(t + 1);
+        for (int i = 0; i < 20000; i++) {
+          const size_t k = thread_rnd.Uniform(keys.size());
+          LookupResult result;
+          ASSERT_TRUE(Lookup(number, size, keys[k], &result));
+          ASSERT_TRUE(result.found);
+          ASSERT_EQ(result.key, keys[k]);
+          ASSERT_EQ(result.value, values[k]);
+        }
+      }));
+    }
+    for (int t = 0; t < kThreads; t++) {
+      threads[t].join();
+    }
+  }
+}
+
+// A table keeps the model it was trained with while it was written: after
+// a restart the model is read back from its learned_index block, without
+// learning the file again
+TEST(TableCacheTest, ModelsSurviveReopen) {
+  std::vector<std::string> keys, values;
+  for (int i = 0; i < 2000; i++) {
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%08d", i * 3);
+    keys.push_back(buf);
+    values.push_back(std::string(buf) + "-value");
+  }
+  uint64_t size = Build(9, keys, values);
+  delete cache_;
+  cache_ = NULL;
+  delete koo::file_data;
+  koo::file_data = new koo::FileLearnedIndexData();
+  // Opening the table for the first lookup loads the model for the next
+  ASSERT_TRUE(!koo::file_data->HasModel(9));
+  LookupResult result;
+  ASSERT_TRUE(!Lookup(9, size, keys[0], &result));
+  ASSERT_EQ(result.value, values[0]);
+  ASSERT_TRUE(koo::file_data->HasModel(9));
+  Check(9, size, keys, values);
+
+  // The same through a DB, with no learning after the reopen
+  delete koo::file_data;
+  koo::file_data = NULL;  // DB::Open sets up its own
+  const LearningPolicy* no_learning = NewNoLearningPolicy();
+  Options options;
+  options.create_if_missing = true;
+  options.learning_policy = no_learning;
+  koo::online_learning = true;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname_, &db));
+  for (size_t i = 0; i < keys.size(); i++) {
+    ASSERT_OK(db->Put(WriteOptions(), keys[i], values[i]));
+  }
+  reinterpret_cast<DBImpl*>(db)->TEST_CompactMemTable();
+  delete db;
+
+  koo::online_learning = false;
+  ASSERT_OK(DB::Open(options, dbname_, &db));
+  for (size_t i = 0; i < keys.size(); i++) {
+    std::string value;
+    ASSERT_OK(db->Get(ReadOptions(), keys[i], &value));
+    ASSERT_EQ(value, values[i]);
+  }
+  std::vector<std::string> filenames;
+  ASSERT_OK(options.env->GetChildren(dbname_, &filenames));
+  int tables = 0;
+  for (size_t i = 0; i < filenames.size(); i++) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(filenames[i], &number, &type) && type == kTableFile &&
+        number != 9) {
+      ASSERT_TRUE(koo::file_data->HasModel(number));
+      tables++;
+    }
+  }
+  ASSERT_GT(tables, 0);
+  delete db;
+  delete no_learning;
+}
+
+// Files from before a restart have their lookups counted like new ones,
+// so that the learning policy still has them learned
+TEST(TableCacheTest, LookupsLearnAfterReopen) {
+  delete koo::file_data;
+  koo::file_data = NULL;  // DB::Open sets up its own
+  const LearningPolicy* no_learning = NewNoLearningPolicy();
+  Options options;
+  options.create_if_missing = true;
+  options.learning_policy = no_learning;
+  DB* db;
+  ASSERT_OK(DB::Open(options, dbname_, &db));
+  for (int i = 0; i < 2000; i++) {
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%08d", i);
+    ASSERT_OK(db->Put(WriteOptions(), buf, buf));
+  }
+  reinterpret_cast<DBImpl*>(db)->TEST_CompactMemTable();
+  delete db;
+
+  const LearningPolicy* seek = NewSeekLearningPolicy(3);
+  options.learning_policy = seek;
+  ASSERT_OK(DB::Open(options, dbname_, &db));
+  std::vector<uint64_t> tables;
+  std::vector<std::string> filenames;
+  ASSERT_OK(options.env->GetChildren(dbname_, &filenames));
+  for (size_t i = 0; i < filenames.size(); i++) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(filenames[i], &number, &type) && type == kTableFile) {
+      ASSERT_TRUE(!koo::file_data->HasModel(number));
+      tables.push_back(number);
+    }
+  }
+  ASSERT_GT(tables.size(), 0u);
+  for (int round = 0; round < 3; round++) {
+    std::string value;
+    ASSERT_OK(db->Get(ReadOptions(), "00000000", &value));
+    ASSERT_OK(db->Get(ReadOptions(), "00001999", &value));
+  }
+  // Learning runs in the background
+  bool learned = false;
+  for (int i = 0; i < 3000 && !learned; i++) {
+    learned = true;
+    for (size_t t = 0; t < tables.size(); t++) {
+      learned = learned && koo::file_data->HasModel(tables[t]);
+    }
+    if (!learned) {
+      Env::Default()->SleepForMicroseconds(10000);
+    }
+  }
+  ASSERT_TRUE(learned);
+  delete db;
+  delete seek;
+  delete no_learning;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -15,6 +15,7 @@
 #include "db/memtable.h"
 #include "db/table_cache.h"
 #include "hyperleveldb/env.h"
+#include "hyperleveldb/learning_policy.h"
 #include "hyperleveldb/table_builder.h"
 #include "table/merger.h"
 #include "table/two_level_iterator.h"
@@ -427,7 +428,22 @@ Status Version::Get(const ReadOptions& options,
       files = &tmp[0];
       num_files = tmp.size();
     } else {
-    	if (koo::MOD == 9) {
+			koo::LearnedIndexData* level_model = level_models_[level].get();
+    	if (koo::MOD == 9 && level_model != nullptr && level_model->Learned(this, koo::db->version_count, level)) {
+				// One inference over the whole level gives the file and the position in it
+				auto bounds = level_model->GetPosition(user_key);
+				size_t index;
+				if (bounds.first > level_model->MaxPosition() ||
+				    !level_model->num_entries_accumulated.Search(user_key, bounds.first, bounds.second,
+				                                                 &index, &position_lower, &position_upper)) {
+					files = NULL;
+					num_files = 0;
+				} else {
+					tmp2 = files[index];
+					files = &tmp2;
+					num_files = 1;
+					learned = true;
+				}
 			} else {
 		    // Binary search to find earliest index whose largest key >= ikey.
 			  uint32_t index = FindFile(vset_->icmp_, files_[level], ikey);
@@ -466,44 +482,51 @@ Status Version::Get(const ReadOptions& options,
       saver.user_key = user_key;
       saver.value = value;
 
-			koo::LearnedIndexData* model = nullptr;
 			bool file_learned = false;
 			uint64_t time_started2 = instance->StartTimer(6);
-			if (koo::MOD == 0 || koo::MOD == 8) {
-				s = vset_->table_cache_->Get(options, f->number, f->file_size,
-					                           ikey, &saver, SaveValue, level, f);
-			} else {
-				s = vset_->table_cache_->Get(options, f->number, f->file_size,
-					                           ikey, &saver, SaveValue, level, f,
-					                           position_lower, position_upper, false,
-					                           this, &model, &file_learned);
-			}
+			s = vset_->table_cache_->Get(options, f->number, f->file_size,
+				                           ikey, &saver, SaveValue, level, f,
+				                           position_lower, position_upper, learned,
+				                           this, &file_learned);
 			auto temp = instance->PauseTimer(time_started2, 6, true);
       if (!s.ok()) {
         return s;
       }
+			// outside the timed lookup, which would otherwise include it; files
+			// whose model is bypassed are sampled too, to notice it got faster
+			if (!learned && koo::SampleShadowLookup()) {
+				vset_->table_cache_->ShadowLookup(options, f->number, f->file_size,
+				                                  ikey, level, f, this);
+			}
 
 			koo::learn_cb_model->AddLookupData(level, saver.state == kFound, file_learned, temp.second - temp.first);
+			if (!koo::fresh_write && (saver.state == kNotFound || saver.state == kFound)) {
+				uint64_t lookups = 0;
+				koo::file_stats_mutex.Lock();
+				auto iter = koo::file_stats.find(f->number);
+				if (iter != koo::file_stats.end()) {
+					koo::FileStats& file_stat = iter->second;
+					if (saver.state == kFound) {
+						file_stat.num_lookup_pos += 1;
+					} else {
+						file_stat.num_lookup_neg += 1;
+					}
+					lookups = file_stat.num_lookup_pos + file_stat.num_lookup_neg;
+				}
+				koo::file_stats_mutex.Unlock();
+
+				const LearningPolicy* policy = vset_->options_->learning_policy;
+				if (!file_learned && lookups > 0 && policy != NULL &&
+				    policy->OnLookup(level, f->number, lookups)) {
+					uint32_t dummy;
+					const uint64_t now = (__rdtscp(&dummy) - instance->initial_time) / koo::reference_frequency;
+					vset_->env_->PrepareLearning(now, level, new FileMetaData(*f), true);
+				}
+			}
       switch (saver.state) {
         case kNotFound:
-					if (!koo::fresh_write) {
-						koo::file_stats_mutex.Lock();
-						auto iter = koo::file_stats.find(f->number);
-						if (iter != koo::file_stats.end()) {
-							iter->second.num_lookup_neg += 1;
-						}
-						koo::file_stats_mutex.Unlock();
-					}
           break;      // Keep searching in other files
         case kFound:
-					if (!koo::fresh_write) {
-						koo::file_stats_mutex.Lock();
-						auto iter = koo::file_stats.find(f->number);
-						if (iter != koo::file_stats.end()) {
-							iter->second.num_lookup_pos += 1;
-						}
-						koo::file_stats_mutex.Unlock();
-					}
           return s;
         case kDeleted:
           s = Status::NotFound(Slice());  // Use empty error message for speed
@@ -888,8 +911,23 @@ void VersionSet::AppendVersion(Version* v) {
   assert(v->refs_ == 0);
   assert(v != current_);
   if (current_ != NULL) {
+    // Keep the level models of unchanged levels, start afresh elsewhere
+    for (unsigned level = 1; level < config::kNumLevels; ++level) {
+      if (v->files_[level] == current_->files_[level]) {
+        v->level_models_[level] = current_->level_models_[level];
+      }
+    }
     current_->Unref();
   }
+  if (koo::MOD == 9) {
+    for (unsigned level = 1; level < config::kNumLevels; ++level) {
+      if (v->level_models_[level] == nullptr && !v->files_[level].empty()) {
+        v->level_models_[level] = std::make_shared<koo::LearnedIndexData>(koo::level_allowed_seek, true);
+      }
+    }
+  }
+  if (koo::db != NULL) ++koo::db->version_count;
+
   current_ = v;
   v->Ref();
 
@@ -1698,29 +1736,48 @@ void Compaction::ReleaseInputs() {
   }
 }
 
+bool Version::HasFile(uint64_t number) const {
+  for (unsigned level = 0; level < config::kNumLevels; level++) {
+    for (size_t i = 0; i < files_[level].size(); i++) {
+      if (files_[level][i]->number == number) return true;
+    }
+  }
+  return false;
+}
+
 bool Version::FillData(const ReadOptions& options, FileMetaData* meta, koo::LearnedIndexData* data) {
 	return vset_->table_cache_->FillData(options, meta, data);
 }
 
-void Version::WriteModel() {
-	printf("WriteModel()\n");
-	for (int i=0; i<config::kNumLevels; ++i) {
-		for (auto* meta : files_[i]) {
-			koo::file_data->GetModel(meta->number)->WriteModel(
-						vset_->dbname_ + "/" + std::to_string(meta->number) + ".model");
-		}
-	}
-}
+bool Version::LearnLevel(unsigned level, koo::LearnedIndexData* model, int v_count) {
+  const std::vector<FileMetaData*>& files = files_[level];
+  if (files.empty()) return false;
 
-void Version::ReadModel() {
-	printf("ReadModel()\n");
-	for (int i=0; i<config::kNumLevels; ++i) {
-		for (auto* meta : files_[i]) {
-			koo::file_data->GetModel(meta->number)->ReadModel(
-						vset_->dbname_ + "/" + std::to_string(meta->number) + ".model");
-		}
-	}
-}
+  ReadOptions options;
+  options.fill_cache = false;
+  model->SetKeyRange(files.front()->smallest.user_key(), files.back()->largest.user_key());
+  uint64_t num_entries = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (koo::db->version_count.load() != v_count) {
+      // Something changed; stop if it was this level
+      v_count = koo::db->version_count.load();
+      Version* c = koo::db->GetCurrentVersion();
+      bool retired = c->level_models_[level].get() != model;
+      koo::db->ReturnCurrentVersion(c);
+      if (retired) return false;
+    }
 
+    Iterator* iter = vset_->table_cache_->NewIterator(options, files[i]->number, files[i]->file_size);
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+      model->AddKey(ExtractUserKey(iter->key()));
+      ++num_entries;
+    }
+    bool ok = iter->status().ok();
+    delete iter;
+    if (!ok) return false;
+    model->num_entries_accumulated.Add(num_entries, files[i]->largest.user_key().ToString());
+  }
+  return model->FinishOnlineLearn();
+}
 
 }  // namespace leveldb
@@ -16,6 +16,7 @@
 #define STORAGE_LEVELDB_DB_VERSION_SET_H_
 
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 #include "db/dbformat.h"
@@ -122,13 +123,19 @@ class Version {
                                  const Slice& largest_user_key);
 
   size_t NumFiles(unsigned level) const { return files_[level].size(); }
+  double CompactionScore(unsigned level) const { return compaction_scores_[level]; }
+
+  // Whether the table file is part of this version, at any level
+  bool HasFile(uint64_t number) const;
 
   // Return a human readable string that describes this version's contents.
   std::string DebugString() const;
 
 	bool FillData(const ReadOptions& options, FileMetaData* meta, koo::LearnedIndexData* data);
-	void WriteModel();
-	void ReadModel();
+
+  // Train the model of a level from all of its files in order. Gives up if
+  // the level is replaced in the meantime.
+  bool LearnLevel(unsigned level, koo::LearnedIndexData* model, int v_count);
 
  private:
   friend class Compaction;
@@ -164,6 +171,10 @@ class Version {
   // are initialized by Finalize().
   double compaction_scores_[config::kNumLevels];
 
+  // Level models (koo::MOD == 9), shared with the versions before and after
+  // this one as long as they have the same files in that level.
+  std::shared_ptr<koo::LearnedIndexData> level_models_[config::kNumLevels];
+
   explicit Version(VersionSet* vset)
       : vset_(vset), next_(this), prev_(this), refs_(0),
         file_to_compact_(NULL),
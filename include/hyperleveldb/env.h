@@ -158,7 +158,11 @@ class Env {
   // Sleep/delay the thread for the perscribed number of micro-seconds.
   virtual void SleepForMicroseconds(int micros) = 0;
 
-	virtual void PrepareLearning(uint64_t time_start, int level, FileMetaData* meta) {};
+	// Queue a new table file for learning: at once if learn_now, otherwise
+	// once the cost-benefit model expects it to pay off
+	virtual void PrepareLearning(uint64_t time_start, int level, FileMetaData* meta, bool learn_now) {};
+	// Drop the learning jobs prepared so far and wait for the one running
+	virtual void StopLearning() {};
 
  private:
   // No copying allowed
@@ -0,0 +1,71 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+//
+// A database can be configured with a custom LearningPolicy object. It
+// decides which table files get a learned index model and when: it is told
+// when a file is created, looked up and deleted, and the background
+// learning workers train the files it asks for.
+//
+// The builtin policies are returned by the New*LearningPolicy() functions
+// below. The default is NewCostBenefitLearningPolicy().
+
+#ifndef STORAGE_LEVELDB_INCLUDE_LEARNING_POLICY_H_
+#define STORAGE_LEVELDB_INCLUDE_LEARNING_POLICY_H_
+
+#include <stdint.h>
+
+namespace leveldb {
+
+class LearningPolicy {
+ public:
+  virtual ~LearningPolicy();
+
+  // What to do with a new table file
+  enum Action {
+    kSkip,          // no model, unless OnLookup() asks for one later
+    kLearnNow,      // learn it as soon as a learning worker is free
+    kCostBenefit    // learn it once the cost-benefit model expects it to pay
+  };
+
+  // Return the name of this policy.
+  virtual const char* Name() const = 0;
+
+  // Table file "number" of "file_size" bytes was written to "level".
+  virtual Action OnFileCreated(int level, uint64_t number,
+                               uint64_t file_size) const = 0;
+
+  // Table file "number" of "level" served a lookup without a model, and
+  // has served "lookups" lookups so far. Return true to learn it now.
+  // Called on the read path, so it must be cheap.
+  virtual bool OnLookup(int level, uint64_t number, uint64_t lookups) const = 0;
+
+  // Table file "number" of "level" was deleted "lifetime" nanoseconds after
+  // it was created.
+  virtual void OnFileDeleted(int level, uint64_t number,
+                             uint64_t lifetime) const = 0;
+};
+
+// Return a new policy that learns every file as soon as it is written.
+extern const LearningPolicy* NewEagerLearningPolicy();
+
+// Return a new policy that never learns: lookups always use the index
+// blocks of the tables.
+extern const LearningPolicy* NewNoLearningPolicy();
+
+// Return a new policy that learns a file once it has served "lookups"
+// lookups. Short-lived and cold files are never learned.
+extern const LearningPolicy* NewSeekLearningPolicy(int lookups);
+
+// Return a new policy that learns a file once the time its model is
+// expected to save over the rest of the file's life exceeds the time
+// learning costs, as estimated from the lookups, learning costs and file
+// lifetimes observed so far.
+//
+// Callers must delete the result of any of these functions after any
+// database that is using the result has been closed.
+extern const LearningPolicy* NewCostBenefitLearningPolicy();
+
+}
+
+#endif  // STORAGE_LEVELDB_INCLUDE_LEARNING_POLICY_H_
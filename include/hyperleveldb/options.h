@@ -15,6 +15,7 @@ class Cache;
 class Comparator;
 class Env;
 class FilterPolicy;
+class LearningPolicy;
 class Logger;
 class Snapshot;
 
@@ -140,6 +141,18 @@ struct Options {
   //const FilterPolicy* filter_policy = NewBloomFilterPolicy(10);
   const FilterPolicy* filter_policy;
 
+  // Decides which table files get a learned index model and when (see
+  // learning_policy.h).  Files trained while they are written, with
+  // koo::online_learning, do not go through the policy.
+  // Only those models are stored in their table and read back after a
+  // restart: a table is not written again once finished, so the models the
+  // policy learns later are lost on close and learned again.
+  // If NULL, files are learned by cost-benefit, as with
+  // NewCostBenefitLearningPolicy().
+  //
+  // Default: NULL
+  const LearningPolicy* learning_policy;
+
   // Is the database used with the Replay mechanism?  If yes, the lower bound on
   // values to compact is (somewhat) left up to the application; if no, then
   // LevelDB functions as usual, and uses snapshots to determine the lower
@@ -151,6 +164,23 @@ struct Options {
   // Default: false/no.
   bool manual_garbage_collection;
 
+  // If true, every write is appended to a write-ahead log before it goes
+  // to the memtable, so that the writes not yet in a table file are
+  // recovered after a crash.  Values are in the value log, so the log only
+  // holds the keys and the pointers to the values, but appending to it
+  // still costs about a third of the write throughput.  On recovery, the
+  // pointers to values that did not reach the value log before the crash
+  // are dropped, so the recovered writes are the ones up to the first such
+  // value.
+  //
+  // If false, nothing is appended to the log: the memtable is written to a
+  // table file when the database is closed, but a crash loses the writes
+  // since the last memtable was written, whatever WriteOptions::sync was.
+  // Their values stay in the value log as garbage.
+  //
+  // Default: false
+  bool write_ahead_log;
+
   // Create an Options object with default values for all fields.
   Options();
 };
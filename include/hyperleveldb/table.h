@@ -6,6 +6,7 @@
 #define STORAGE_LEVELDB_INCLUDE_TABLE_H_
 
 #include <stdint.h>
+#include <vector>
 #include "db/version_edit.h"
 #include "table/format.h"
 #include "hyperleveldb/iterator.h"
@@ -70,7 +71,12 @@ class Table {
       filter(),
       filter_data(),
       metaindex_handle(),
-      index_block() {
+      index_block(),
+      has_learned_index(false),
+      learned_index_handle(),
+      restart_interval(0),
+      accumulated_block_entries(),
+      compressed_blocks() {
 		}
 	  ~Rep();
 
@@ -84,6 +90,16 @@ class Table {
 	  BlockHandle metaindex_handle;  // Handle to metaindex_block: saved from footer
 		Block* index_block;
 
+	  bool has_learned_index;
+	  BlockHandle learned_index_handle;  // Valid iff has_learned_index
+
+	  // Data block layout for model-guided reads.  Entry i of
+	  // accumulated_block_entries is the number of entries in data blocks
+	  // 0..i; empty if the table does not record it.
+	  uint32_t restart_interval;
+	  std::vector<uint64_t> accumulated_block_entries;
+	  std::vector<bool> compressed_blocks;
+
 	 private:
 	  Rep(const Rep&);
 		Rep& operator = (const Rep&);
@@ -103,8 +119,15 @@ class Table {
 
   void ReadMeta(const Footer& footer);
   void ReadFilter(const Slice& filter_handle_value);
+  void ReadBlockEntries(const Slice& block_entries_handle_value);
+
+  // Feed every user key of the table, in order, to data->AddKey(). Gives up,
+  // returning false, once the model is aborted.
+  bool FillData(const ReadOptions& options, koo::LearnedIndexData* data);
 
-  void FillData(const ReadOptions& options, koo::LearnedIndexData* data);
+  // Decode the model stored in the table into "data". Returns false if the
+  // table carries no model or it cannot be read.
+  bool ReadLearnedIndex(koo::LearnedIndexData* data);
 
   // No copying allowed
   Table(const Table&);
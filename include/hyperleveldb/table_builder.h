@@ -75,6 +75,8 @@ class TableBuilder {
   uint64_t FileSize() const;
 
  private:
+  friend class TableBuilderInternal;
+
   bool ok() const { return status().ok(); }
   void WriteBlock(BlockBuilder* block, BlockHandle* handle);
   void WriteRawBlock(const Slice& data, CompressionType, BlockHandle* handle);
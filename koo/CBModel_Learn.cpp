@@ -3,9 +3,21 @@
 #include "learned_index.h"
 #include "koo/koo.h"
 #include "db/version_set.h"
-
-
-CBModel_Learn::CBModel_Learn() : negative_lookups_time(2), positive_lookups_time(2) {};
+#include "util/coding.h"
+#include "util/crc32c.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+
+CBModel_Learn::CBModel_Learn() : negative_lookups_time(2), positive_lookups_time(2), rate_time(0) {
+    memset(lifetimes, 0, sizeof(lifetimes));
+    memset(num_lifetimes, 0, sizeof(num_lifetimes));
+    memset(lookup_rates, 0, sizeof(lookup_rates));
+    memset(rate_lookups, 0, sizeof(rate_lookups));
+    memset(shadow_gains, 0, sizeof(shadow_gains));
+    memset(shadow_nums, 0, sizeof(shadow_nums));
+};
 
 void CBModel_Learn::AddLookupData(int level, bool positive, bool model, uint64_t value) {
     leveldb::MutexLock guard(&lookup_mutex);
@@ -13,126 +25,174 @@ void CBModel_Learn::AddLookupData(int level, bool positive, bool model, uint64_t
     target[model].Increment(level, value);
 }
 
-void CBModel_Learn::AddFileData(int level, uint64_t num_negative, uint64_t num_positive, uint64_t size) {
-    leveldb::MutexLock guard(&file_mutex);
-    num_negative_lookups_file.Increment(level, num_negative);
-    num_positive_lookups_file.Increment(level, num_positive);
-    file_sizes.Increment(level, size);
+void CBModel_Learn::AddShadowData(int level, bool positive, uint64_t baseline_time, uint64_t model_time) {
+    leveldb::MutexLock guard(&lookup_mutex);
+    // old samples fade out, so that a model turning slow shows soon
+    if (shadow_nums[positive][level] >= 65536) {
+        shadow_gains[positive][level] /= 2;
+        shadow_nums[positive][level] /= 2;
+    }
+    shadow_gains[positive][level] += (double) baseline_time - (double) model_time;
+    shadow_nums[positive][level] += 1;
 }
 
 void CBModel_Learn::AddLearnCost(int level, uint64_t cost, uint64_t size) {
+    leveldb::MutexLock guard(&file_mutex);
     learn_costs.Increment(level, cost);
     learn_sizes.Increment(level, size);
 }
 
-double CBModel_Learn::CalculateCB(int level, uint64_t file_size) {
-    // used for simple testing different learning policies, not used now
-    if (koo::policy == 2) return 0;
+void CBModel_Learn::AddFileLifetime(int level, uint64_t lifetime) {
+    int bucket = lifetime == 0 ? 0 : 63 - __builtin_clzll(lifetime);
+    if (bucket >= kLifetimeBuckets) bucket = kLifetimeBuckets - 1;
+    leveldb::MutexLock guard(&lifetime_mutex);
+    if (num_lifetimes[level] >= 1024) {
+        for (int i = 0; i < kLifetimeBuckets; ++i) lifetimes[level][i] /= 2;
+        num_lifetimes[level] /= 2;
+    }
+    lifetimes[level][bucket] += 1;
+    num_lifetimes[level] += 1;
+}
 
-    int num_pos[2] = {0, 0}, num_neg[2] = {0, 0}, num_files = 0, num_learn = 0;
-    uint64_t time_pos[2] = {0, 0}, time_neg[2] = {0, 0}, num_neg_lookups_file, num_pos_lookups_file, size_sum, cost_sum, learn_size_sum;
+void CBModel_Learn::UpdateLookupRates(uint64_t now, const size_t* num_files) {
+    uint64_t lookups[leveldb::config::kNumLevels];
     {
         leveldb::MutexLock guard(&lookup_mutex);
+        for (unsigned level = 0; level < leveldb::config::kNumLevels; ++level) {
+            lookups[level] = 0;
+            for (int i = 0; i < 2; ++i) {
+                lookups[level] += positive_lookups_time[i].nums[level] + negative_lookups_time[i].nums[level];
+            }
+        }
+    }
+
+    leveldb::MutexLock guard(&lifetime_mutex);
+    // sample every 100ms at most so that the rates are not all noise
+    if (rate_time != 0 && now < rate_time + 100000000) return;
+    for (unsigned level = 0; level < leveldb::config::kNumLevels; ++level) {
+        if (rate_time != 0 && num_files[level] > 0) {
+            double rate = (double) (lookups[level] - rate_lookups[level]) / (now - rate_time) / num_files[level];
+            lookup_rates[level] = (lookup_rates[level] + rate) / 2;
+        }
+        rate_lookups[level] = lookups[level];
+    }
+    rate_time = now;
+}
+
+double CBModel_Learn::RemainingLifetime(int level, double age) {
+    lifetime_mutex.AssertHeld();
+    // the lifetimes of a bucket are taken as spread evenly over it
+    double weight = 0, remaining = 0;
+    for (int i = 0; i < kLifetimeBuckets; ++i) {
+        double low = i == 0 ? 0 : std::ldexp(1.0, i), high = std::ldexp(1.0, i + 1);
+        if (lifetimes[level][i] == 0 || high <= age) continue;
+        double from = std::max(low, age);
+        double w = lifetimes[level][i] * (high - from) / (high - low);
+        weight += w;
+        remaining += w * ((from + high) / 2 - age);
+    }
+    // no file seen this old: expect it to live about as long again
+    if (weight < 1) return age;
+    return remaining / weight;
+}
+
+uint64_t CBModel_Learn::LearnAge(int level, uint64_t file_size, double compaction_score) {
+    {
+        leveldb::MutexLock guard(&lifetime_mutex);
+        if (num_lifetimes[level] < 16) return koo::learn_trigger_time;
+    }
+    double gain, cost_per_byte;
+    {
+        leveldb::MutexLock guard(&lookup_mutex);
+        uint64_t num[2], time[2];
+        for (int i = 0; i < 2; ++i) {
+            num[i] = positive_lookups_time[i].nums[level] + negative_lookups_time[i].nums[level];
+            time[i] = positive_lookups_time[i].counts[level] + negative_lookups_time[i].counts[level];
+        }
+        if (num[0] < lookup_average_limit || num[1] < lookup_average_limit) return koo::learn_trigger_time;
+        gain = (double) time[0] / num[0] - (double) time[1] / num[1];
+        // shadow lookups compare both ways on the same files at the same time
+        const double shadow_num = shadow_nums[0][level] + shadow_nums[1][level];
+        if (shadow_num >= shadow_average_limit) {
+            gain = (shadow_gains[0][level] + shadow_gains[1][level]) / shadow_num;
+        }
+    }
+    if (gain <= 0) return kNeverLearn;
+    {
+        leveldb::MutexLock guard(&file_mutex);
+        uint64_t num = learn_costs.nums[level], cost = learn_costs.counts[level], size = learn_sizes.counts[level];
+        if (num < 3) {
+            // few files of the level learned yet: all levels train alike
+            num = cost = size = 0;
+            for (unsigned i = 0; i < leveldb::config::kNumLevels; ++i) {
+                num += learn_costs.nums[i];
+                cost += learn_costs.counts[i];
+                size += learn_sizes.counts[i];
+            }
+        }
+        if (num < 3 || size == 0) return koo::learn_trigger_time;
+        cost_per_byte = (double) cost / size;
+    }
+
+    leveldb::MutexLock guard(&lifetime_mutex);
+    const double cost = cost_per_byte * file_size;
+    const double rate = lookup_rates[level] * gain / std::max(1.0, compaction_score);
+    // the expected remaining life grows with the age for most files, so try
+    // ages in the same buckets as the lifetimes
+    for (int i = 0; i < kLifetimeBuckets; ++i) {
+        double age = i == 0 ? 0 : std::ldexp(1.0, i);
+        if (RemainingLifetime(level, age) * rate > cost) return (uint64_t) age;
+    }
+    return kNeverLearn;
+}
+
+double CBModel_Learn::CalculateCB(const koo::FileStats& file, uint64_t now) {
+    const int level = file.level;
+    double gain_pos = 0, gain_neg = 0;
+    {
+        leveldb::MutexLock guard(&lookup_mutex);
+        uint64_t num_pos[2], num_neg[2], time_pos[2], time_neg[2];
         for (int i = 0; i < 2; ++i) {
             num_pos[i] = positive_lookups_time[i].nums[level];
             num_neg[i] = negative_lookups_time[i].nums[level];
             time_pos[i] = positive_lookups_time[i].counts[level];
             time_neg[i] = negative_lookups_time[i].counts[level];
         }
+        // learn until both ways of searching the level were measured
+        if (num_pos[0] + num_neg[0] < lookup_average_limit || num_pos[1] + num_neg[1] < lookup_average_limit) {
+            return const_size_to_cost + 1;
+        }
+        // 0: index block search, 1: model search
+        if (num_pos[0] >= 500 && num_pos[1] >= 500) {
+            gain_pos = (double) time_pos[0] / num_pos[0] - (double) time_pos[1] / num_pos[1];
+        }
+        if (num_neg[0] >= 500 && num_neg[1] >= 500) {
+            gain_neg = (double) time_neg[0] / num_neg[0] - (double) time_neg[1] / num_neg[1];
+        }
+        if (shadow_nums[1][level] >= shadow_average_limit) {
+            gain_pos = shadow_gains[1][level] / shadow_nums[1][level];
+        }
+        if (shadow_nums[0][level] >= shadow_average_limit) {
+            gain_neg = shadow_gains[0][level] / shadow_nums[0][level];
+        }
     }
+
+    const double age = now > file.start ? now - file.start : 0;
+    double prior_rate, remaining;
     {
-        leveldb::MutexLock guard(&file_mutex);
-        num_files = num_negative_lookups_file.nums[level];
-        num_neg_lookups_file = num_negative_lookups_file.counts[level];
-        num_pos_lookups_file = num_positive_lookups_file.counts[level];
-        size_sum = file_sizes.counts[level];
-    }
-
-		// scale 맞추기
-		double tmp = MaxBytesForLevel(0);
-		double d_size_sum = (double)size_sum;
-		double d_num_files = (double)num_files;
-		if (level == 0) { 
-			d_size_sum *= (10*1048576.0/MaxBytesForLevel(0)); 
-			d_num_files *= ((10*1048576.0/2*1048576.0)/(MaxBytesForLevel(0)/(double)MaxFileSizeForLevel(0)));
-		} else if (level == 1) {
-			d_size_sum *= (10*1048576.0/MaxBytesForLevel(1)); 
-			d_num_files *= ((10*1048576.0/2*1048576.0)/(MaxBytesForLevel(1)/(double)MaxFileSizeForLevel(1)));
-		} else if (level == 2) {
-			d_size_sum *= (100*1048576.0/MaxBytesForLevel(2)); 
-			d_num_files *= ((100*1048576.0/2*1048576.0)/(MaxBytesForLevel(2)/(double)MaxFileSizeForLevel(2)));
-		} else if (level == 3) {
-			d_size_sum *= (1000*1048576.0/MaxBytesForLevel(3)); 
-			d_num_files *= ((1000*1048576.0/2*1048576.0)/(MaxBytesForLevel(3)/(double)MaxFileSizeForLevel(3)));
-		} else if (level == 4) {
-			d_size_sum *= (10000*1048576.0/MaxBytesForLevel(4)); 
-			d_num_files *= ((10000*1048576.0/2*1048576.0)/(MaxBytesForLevel(4)/(double)MaxFileSizeForLevel(4)));
-		} else if (level == 5) {
-			d_size_sum *= (100000*1048576.0/MaxBytesForLevel(5)); 
-			d_num_files *= ((100000*1048576.0/2*1048576.0)/(MaxBytesForLevel(5)/(double)MaxFileSizeForLevel(5)));
-		} else if (level == 6) {
-			d_size_sum *= (1000000*1048576.0/MaxBytesForLevel(6)); 
-			d_num_files *= ((1000000*1048576.0/2*1048576.0)/(MaxBytesForLevel(6)/(double)MaxFileSizeForLevel(6)));
-		} else std::cout << "Level error\n";
-
-		size_sum = (uint64_t)(std::round(d_size_sum));
-		num_files = (int)(std::round(d_num_files));
-//    num_learn = learn_costs.nums[level];
-//    cost_sum = learn_costs.counts[level];
-//    learn_size_sum = learn_sizes.counts[level];
-
-    if (num_files < file_average_limit[level]) return const_size_to_cost + 1;
-    double average_pos_lookups = (double) num_pos_lookups_file / num_files;
-    double average_neg_lookups = (double) num_neg_lookups_file / num_files;
-    double average_pos_time[2] = {0, 0}, average_neg_time[2] = {0, 0};
-
-    //for (int i = 0; i < 2; ++i) {
-    for (int i = 1; i > -1; --i) {		// model부터
-        if (num_pos[i] + num_neg[i] < lookup_average_limit) {		// index block, model search 둘 다 lookup_average_limit 이상이어야 학습
-					//if (i) continue;	// model search 0일때는 continue하면?
-					continue;
-          return 0;
-        }
-
-        if (num_pos[i] < 500) {
-            average_pos_lookups = 0;
-            average_pos_time[i] = 0;
-        } else {
-            average_pos_time[i] = (double) time_pos[i] / num_pos[i];
-        }
-
-        if (num_neg[i] < 500) {
-            average_neg_lookups = 0;
-            average_neg_time[i] = 0;
-        } else {
-            average_neg_time[i] = (double) time_neg[i] / num_neg[i];
-        }
-    }
-
-    double pos_gain = (average_pos_time[0] - average_pos_time[1]) * average_pos_lookups;
-    double neg_gain = (average_neg_time[0] - average_neg_time[1]) * average_neg_lookups;
-    // 0: non-model search Get time, 1: model search Get time
-
-//    model->num_pos_baseline_p = num_pos[0];
-//    model->num_pos_model_p = num_pos[1];
-//    model->num_neg_baseline_p = num_neg[0];
-//    model->num_neg_model_p = num_neg[1];
-//    model->time_pos_baseline_p = time_pos[0];
-//    model->time_pos_model_p = time_pos[1];
-//    model->time_neg_baseline_p = time_neg[0];
-//    model->time_neg_model_p = time_neg[1];
-//    model->file_size = file_size;
-//    model->gain_p = pos_gain + neg_gain;
-//    //std::cout << model->gain_p << std::endl;
-//    model->num_files_p = num_files;
-
-    // used for simple testing different learning policies, not used now
-    if (koo::policy == 1) return const_size_to_cost + 1;
-    if (koo::policy == 2) return 0;
-
-//    fprintf(stdout, "%f %lu %d %f %f %f %f %f %f\n", pos_gain + neg_gain, file_size * const_size_to_cost, level,
-//             average_pos_time[0], average_pos_time[1], average_pos_lookups, average_neg_time[0], average_neg_time[1], average_neg_lookups);
-    return (pos_gain + neg_gain) / size_sum * num_files;//(num_learn >= 20 ? (double) cost_sum / learn_size_sum : const_size_to_cost);
+        leveldb::MutexLock guard(&lifetime_mutex);
+        prior_rate = file.inherited_rate >= 0 ? file.inherited_rate : lookup_rates[level];
+        remaining = num_lifetimes[level] >= 16 ? RemainingLifetime(level, age)
+                                               : std::max(age, (double) koo::learn_trigger_time);
+    }
+    // A young file has served too few lookups to tell: its own rate takes
+    // over from the rate of its key range as it ages past a second.
+    const double prior_time = 1e9;
+    const double pos = file.num_lookup_pos, neg = file.num_lookup_neg;
+    const double rate = (pos + neg + prior_rate * prior_time) / (age + prior_time);
+    const double positive_share = (pos + 1) / (pos + neg + 2);
+    const double gain = positive_share * gain_pos + (1 - positive_share) * gain_neg;
+    return rate * gain * remaining / std::max<uint64_t>(file.size, 1);
 }
 
 
@@ -149,6 +209,140 @@ void CBModel_Learn::Report() {
     positive_lookups_time[1].Report();
 }
 
+namespace {
+
+// bump when the encoding changes: older files are then ignored
+const uint32_t kStatsFormat = 2;
+
+void PutDouble(std::string* dst, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    leveldb::PutFixed64(dst, bits);
+}
+
+bool GetDouble(leveldb::Slice* input, double* value) {
+    if (input->size() < sizeof(uint64_t)) return false;
+    uint64_t bits = leveldb::DecodeFixed64(input->data());
+    memcpy(value, &bits, sizeof(bits));
+    input->remove_prefix(sizeof(uint64_t));
+    return true;
+}
+
+}
+
+void CBModel_Learn::EncodeTo(std::string* dst) {
+    const size_t start = dst->size();
+    leveldb::PutVarint32(dst, kStatsFormat);
+    leveldb::PutVarint32(dst, leveldb::config::kNumLevels);
+    leveldb::PutVarint32(dst, kLifetimeBuckets);
+
+    auto put_counter = [dst](const Counter& counter) {
+        for (uint64_t count : counter.counts) leveldb::PutVarint64(dst, count);
+        for (uint64_t num : counter.nums) leveldb::PutVarint64(dst, num);
+    };
+    {
+        leveldb::MutexLock guard(&lookup_mutex);
+        for (int i = 0; i < 2; ++i) {
+            put_counter(negative_lookups_time[i]);
+            put_counter(positive_lookups_time[i]);
+        }
+        for (int i = 0; i < 2; ++i) {
+            for (unsigned level = 0; level < leveldb::config::kNumLevels; ++level) {
+                PutDouble(dst, shadow_gains[i][level]);
+                PutDouble(dst, shadow_nums[i][level]);
+            }
+        }
+    }
+    {
+        leveldb::MutexLock guard(&file_mutex);
+        put_counter(learn_costs);
+        put_counter(learn_sizes);
+    }
+    {
+        leveldb::MutexLock guard(&lifetime_mutex);
+        for (unsigned level = 0; level < leveldb::config::kNumLevels; ++level) {
+            PutDouble(dst, num_lifetimes[level]);
+            for (int i = 0; i < kLifetimeBuckets; ++i) PutDouble(dst, lifetimes[level][i]);
+            PutDouble(dst, lookup_rates[level]);
+        }
+    }
+    uint32_t crc = leveldb::crc32c::Value(dst->data() + start, dst->size() - start);
+    leveldb::PutFixed32(dst, leveldb::crc32c::Mask(crc));
+}
+
+bool CBModel_Learn::DecodeFrom(const leveldb::Slice& src) {
+    if (src.size() < sizeof(uint32_t)) return false;
+    leveldb::Slice input(src.data(), src.size() - sizeof(uint32_t));
+    uint32_t crc = leveldb::crc32c::Unmask(leveldb::DecodeFixed32(input.data() + input.size()));
+    if (crc != leveldb::crc32c::Value(input.data(), input.size())) return false;
+
+    uint32_t format, levels, buckets;
+    if (!leveldb::GetVarint32(&input, &format) || format != kStatsFormat ||
+        !leveldb::GetVarint32(&input, &levels) || levels != leveldb::config::kNumLevels ||
+        !leveldb::GetVarint32(&input, &buckets) || buckets != kLifetimeBuckets) {
+        return false;
+    }
+
+    auto get_counter = [&input](Counter* counter) {
+        for (uint64_t& count : counter->counts) {
+            if (!leveldb::GetVarint64(&input, &count)) return false;
+        }
+        for (uint64_t& num : counter->nums) {
+            if (!leveldb::GetVarint64(&input, &num)) return false;
+        }
+        return true;
+    };
+    // negative and positive for index block search, then for model search
+    Counter lookups[4], costs, sizes;
+    for (Counter& counter : lookups) {
+        if (!get_counter(&counter)) return false;
+    }
+    double new_shadow_gains[2][leveldb::config::kNumLevels], new_shadow_nums[2][leveldb::config::kNumLevels];
+    for (int i = 0; i < 2; ++i) {
+        for (unsigned level = 0; level < leveldb::config::kNumLevels; ++level) {
+            if (!GetDouble(&input, &new_shadow_gains[i][level]) ||
+                !GetDouble(&input, &new_shadow_nums[i][level])) {
+                return false;
+            }
+        }
+    }
+    if (!get_counter(&costs) || !get_counter(&sizes)) return false;
+    double new_lifetimes[leveldb::config::kNumLevels][kLifetimeBuckets];
+    double new_num_lifetimes[leveldb::config::kNumLevels], new_rates[leveldb::config::kNumLevels];
+    for (unsigned level = 0; level < leveldb::config::kNumLevels; ++level) {
+        if (!GetDouble(&input, &new_num_lifetimes[level])) return false;
+        for (int i = 0; i < kLifetimeBuckets; ++i) {
+            if (!GetDouble(&input, &new_lifetimes[level][i])) return false;
+        }
+        if (!GetDouble(&input, &new_rates[level])) return false;
+    }
+    if (!input.empty()) return false;
+
+    {
+        leveldb::MutexLock guard(&lookup_mutex);
+        for (int i = 0; i < 2; ++i) {
+            negative_lookups_time[i] = lookups[2 * i];
+            positive_lookups_time[i] = lookups[2 * i + 1];
+        }
+        memcpy(shadow_gains, new_shadow_gains, sizeof(shadow_gains));
+        memcpy(shadow_nums, new_shadow_nums, sizeof(shadow_nums));
+    }
+    {
+        leveldb::MutexLock guard(&file_mutex);
+        learn_costs = costs;
+        learn_sizes = sizes;
+    }
+    {
+        leveldb::MutexLock guard(&lifetime_mutex);
+        memcpy(lifetimes, new_lifetimes, sizeof(lifetimes));
+        memcpy(num_lifetimes, new_num_lifetimes, sizeof(num_lifetimes));
+        memcpy(lookup_rates, new_rates, sizeof(lookup_rates));
+        // the next sample only sets the baseline for the loaded lookups
+        rate_time = 0;
+    }
+    return true;
+}
+
 
 
 
@@ -9,10 +9,9 @@
 #include <queue>
 #include "koo/koo.h"
 
-static const int file_average_limit[7] = {10, 20, 20, 20, 20, 500, 500};
-
 namespace koo {
     class LearnedIndexData;
+    class FileStats;
 }
 
 
@@ -21,35 +20,75 @@ private:
     std::vector<Counter> negative_lookups_time;		// 길이 2인 vector. 0: index block search, 1: model search
     std::vector<Counter> positive_lookups_time;
 
-//    std::queue<int> num_positive_lookups_file;
-//    std::queue<int> num_negative_lookups_file;
-
-    Counter num_positive_lookups_file;
-    Counter num_negative_lookups_file;
-    Counter file_sizes;
-
     Counter learn_costs;
     Counter learn_sizes;
 
+    // Shadow lookups per level, negative then positive: the nanoseconds
+    // models saved over the index blocks in them, and their number
+    double shadow_gains[2][leveldb::config::kNumLevels];
+    double shadow_nums[2][leveldb::config::kNumLevels];
+
     leveldb::port::Mutex lookup_mutex;
     leveldb::port::Mutex file_mutex;
+
+    // Lifetimes of deleted files per level, in buckets of powers of two
+    // nanoseconds. Old samples fade out so that the model follows the
+    // workload from ingestion to read-heavy phases and back.
+    static const int kLifetimeBuckets = 48;
+    double lifetimes[leveldb::config::kNumLevels][kLifetimeBuckets];
+    double num_lifetimes[leveldb::config::kNumLevels];
+    // Lookups per nanosecond served by each file of a level, recently
+    double lookup_rates[leveldb::config::kNumLevels];
+    uint64_t rate_time;
+    uint64_t rate_lookups[leveldb::config::kNumLevels];
+    leveldb::port::Mutex lifetime_mutex;
+
+    // Expected nanoseconds a file of the level still lives at the given age
+    double RemainingLifetime(int level, double age);
 public:
     static const int const_size_to_cost = 10;
+    static const uint64_t kNeverLearn = ~0ull;
     //static constexpr double const_size_to_cost = 0;
     static const int lookup_average_limit = 10000;
+    // shadow lookups of a level needed before they replace the estimate from
+    // lookups of different files
+    static const int shadow_average_limit = 100;
     //static const int lookup_average_limit = 0;
 
     CBModel_Learn();
     // functions that record data during runtime
     void AddLookupData(int level, bool positive, bool model, uint64_t value);
-    void AddFileData(int level, uint64_t num_negative, uint64_t num_positive, uint64_t size);
+    // A lookup of a learned file of the level that took baseline_time through
+    // the index block and model_time through the model
+    void AddShadowData(int level, bool positive, uint64_t baseline_time, uint64_t model_time);
     void AddLearnCost(int level, uint64_t cost, uint64_t size);
+    // Time a file of the level lived from its creation to its deletion
+    void AddFileLifetime(int level, uint64_t lifetime);
+    // Refresh the lookup rate of the files of each level from the lookups
+    // recorded since the previous call; num_files has the files per level
+    void UpdateLookupRates(uint64_t now, const size_t* num_files);
+
+    // Age from which learning a file of the level pays off: the lookups it is
+    // expected to serve for the rest of its life, which compactions of the
+    // level shorten, save more time than training it costs. kNeverLearn if
+    // no age does, learn_trigger_time until there is enough to tell.
+    uint64_t LearnAge(int level, uint64_t file_size, double compaction_score);
     
-    // check if a model is benefitial to learn
-    double CalculateCB(int level, uint64_t file_size);
+    // Check if a model is benefitial to learn: the time it is expected to save
+    // per byte of the file over the rest of its life, from the lookups the
+    // file served so far, or its key range served before it, and the
+    // measured gain of a model per positive and negative lookup.
+    double CalculateCB(const koo::FileStats& file, uint64_t now);
     // report collected stats
     void Report();
 
+    // Append the statistics that stay valid across restarts: lookup times,
+    // shadow lookups, learning costs, file lifetimes and lookup rates
+    void EncodeTo(std::string* dst);
+    // Replace the statistics with ones appended by EncodeTo(); false, with
+    // the statistics left alone, if src is corrupt or of another format
+    bool DecodeFrom(const leveldb::Slice& src);
+
 };
 
 #endif //LEVELDB_CBMODE_LEARN_H
@@ -1,102 +1,683 @@
-//
-// Created by daiyi on 2020/03/23.
-//
-
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <cstring>
-#include "koo/Vlog.h"
-#include "koo/util.h"
-//#include "util/coding.h"
-
-using std::string;
-
-
-
-const int buffer_size_max = 240 * 1024;
-const int V_BUFFER_SIZE = 256 * 1024;
-
-namespace koo {
-
-VLog::VLog(const std::string& vlog_name) : writer(nullptr), reader(nullptr), current_pos(0), count_pos(0) {
-  koo::env->NewWritableFile(vlog_name, &writer);
-  koo::env->NewRandomAccessFile(vlog_name, &reader);
-  struct ::stat file_stat;
-  ::stat(vlog_name.c_str(), &file_stat);
-  buffer = (char*)calloc(V_BUFFER_SIZE, sizeof(char));
-  vlog_size = file_stat.st_size;
-  vlog_flushed = file_stat.st_size;
-}
-
-/*void PrintString(std::string s){
-  for(size_t i = 0; i < s.size(); i++)
-    if((s.data()[i] <= 'z' && s.data()[i] >= 'a') || s.data()[i] <= 'Z' && s.data()[i] >= 'A')
-      fprintf(stderr, "%c", s.data()[i]);
-    else
-      fprintf(stderr, " |%d| ", s.data()[i]);
-  fprintf(stderr, "\n");
-}*/
-
-uint64_t VLog::AddRecord(const Slice& key, const Slice& value) {
-  std::string buf;
-  PutLengthPrefixedSlice(&buf, key);
-  PutVarint32(&buf, value.size());
-  size_t tmp_size = buf.size();
-  buf.append(value.data(), value.size());
-
-  uint64_t pos = current_pos.fetch_add(buf.size());
-  while(pos > buffer_size_max) {
-  	while (current_pos > buffer_size_max) { }
-    pos = current_pos.fetch_add(buf.size());
-  }
- 
-  uint64_t result = vlog_size + pos + tmp_size;
-
-  std::memcpy(buffer + pos, buf.data(), buf.size());
-
-
-  if (pos + buf.size() > buffer_size_max) {
-    while (count_pos != pos) {}
-    Flush(pos + buf.size());
-    std::memset(buffer, 0, V_BUFFER_SIZE);
-    count_pos = 0;
-    current_pos = 0;
-  } else {
-    count_pos.fetch_add(buf.size());
-  }
-  return result;
-}
-
-string VLog::ReadRecord(uint64_t address, uint32_t size) {
-  if (address >= vlog_size.load(std::memory_order_relaxed)) {
-    std::unique_lock<SpinLock> lock(s_mu_);
-    if (address >= vlog_size)
-      return string(buffer + address - vlog_size, size);
-  }
-
-  char* scratch = new char[size];
-  Slice value;
-  reader->Read(address, size, &value, scratch);
-  string result(value.data(), value.size());
-  delete[] scratch;
-  return result;
-}
-
-void VLog::Flush(uint64_t s) {
-  std::unique_lock<SpinLock> lock(s_mu_);
-  vlog_size += s;
-  Slice buf(buffer, s);
-  writer->Append(buf);
-  writer->Flush();
-}
-
-void VLog::Sync() {
-  //need to write buffer
-  writer->Sync();
-}
-
-VLog::~VLog() {
-  Sync();
-}
-
-}
+//
+// Created by daiyi on 2020/03/23.
+//
+
+#include <fcntl.h>
+#include <algorithm>
+#include <sys/stat.h>
+#include <cstring>
+#include "koo/Vlog.h"
+#include "koo/util.h"
+#include "util/crc32c.h"
+#include "util/logging.h"
+#include "util/mutexlock.h"
+//#include "util/coding.h"
+
+using std::string;
+
+namespace leveldb {
+extern Status WriteStringToFileSync(Env* env, const Slice& data,
+                                    const std::string& fname);
+}
+
+
+
+// A buffer is flushed once this full; a larger record gets a buffer of its own
+const uint64_t kBufferSize = 256 * 1024;
+// The head is read this much at a time to find its torn record on open
+const uint64_t kRecoveryBatch = 1 << 20;
+
+namespace koo {
+
+VLog::Partition::Partition()
+    : writer(nullptr), head(0), cv_(&mu_), flush_cv_(&mu_), sync_end(0),
+      synced_end(0), shutting_down(false) {
+  for (int i = 0; i < kNumBuffers; i++) {
+    buffers[i].data = (char*)malloc(kBufferSize);
+    buffers[i].capacity = kBufferSize;
+    buffers[i].base = 0;
+    buffers[i].reserved = 0;
+    buffers[i].written = 0;
+    buffers[i].size = 0;
+    buffers[i].state = Buffer::kFree;
+    buffers[i].readers = 0;
+  }
+}
+
+VLog::VLog(const std::string& dbname) : dbname(dbname) {
+  koo::env->CreateDir(dbname);  // the DB may not have been created yet
+  std::vector<std::string> children;
+  koo::env->GetChildren(dbname, &children);
+  uint64_t num_partitions = std::max(1, std::min<int>(vlog_partitions, kMaxPartitions));
+  for (size_t i = 0; i < children.size(); i++) {
+    Slice name(children[i]);
+    uint64_t number;
+    if (!ConsumeDecimalNumber(&name, &number) || name != Slice(".vlog") ||
+        PartitionOf(number) >= kMaxPartitions) {
+      continue;
+    }
+    Segment segment = {nullptr, 0, 0, true};
+    koo::env->NewRandomAccessFile(SegmentFileName(number), &segment.reader);
+    koo::env->GetFileSize(SegmentFileName(number), &segment.size);
+    segments[number] = segment;
+    // Records written with more partitions stay readable with fewer
+    num_partitions = std::max(num_partitions, PartitionOf(number) + 1);
+  }
+
+  bool repaired = false;
+  for (uint64_t i = 0; i < num_partitions; i++) {
+    Partition* p = new Partition;
+    p->head = SegmentId(i, 1);
+    std::map<uint64_t, Segment>::iterator it =
+        segments.lower_bound(SegmentId(i + 1, 0));
+    if (it != segments.begin() && PartitionOf((--it)->first) == i) {
+      p->head = it->first;
+      // A crash may have torn the last record of the head.  The records
+      // appended after it could not be told apart from it, so they go to
+      // the next segment.
+      const uint64_t whole = WholeRecords(it->second.reader, it->second.size);
+      if (whole < it->second.size) {
+        it->second.size = whole;
+        p->head++;
+        repaired = true;
+      } else {
+        it->second.sealed = false;
+      }
+    }
+    Status s = koo::env->NewWritableFile(SegmentFileName(p->head), &p->writer);
+    if (!s.ok()) {
+      p->writer = nullptr;
+      p->sync_status = s;
+    }
+    if (segments.find(p->head) == segments.end()) {
+      Segment segment = {nullptr, 0, 0, false};
+      koo::env->NewRandomAccessFile(SegmentFileName(p->head), &segment.reader);
+      segments[p->head] = segment;
+    }
+    p->flushed_end = Address(p->head, segments[p->head].size);
+    p->synced_end = p->flushed_end;
+    p->buffers[0].base = p->flushed_end;
+    if (OffsetOf(p->flushed_end) >= vlog_segment_size) {
+      p->buffers[0].base = Address(p->head + 1, 0);
+    }
+    p->buffers[0].state = Buffer::kActive;
+    p->active = &p->buffers[0];
+    partitions.push_back(p);
+  }
+  LoadGarbage();
+  if (repaired) {
+    SaveGarbage();  // the sizes of the repaired segments
+  }
+  for (size_t i = 0; i < partitions.size(); i++) {
+    partitions[i]->flusher = std::thread(&VLog::FlushThread, this, partitions[i]);
+  }
+}
+
+// The length of the whole records at the start of the size bytes that
+// reader reads
+uint64_t VLog::WholeRecords(RandomAccessFile* reader, uint64_t size) {
+  if (reader == nullptr) {
+    return size;
+  }
+  std::string scratch;
+  uint64_t offset = 0;
+  uint64_t n = kRecoveryBatch;
+  while (offset < size) {
+    n = std::min(n, size - offset);
+    scratch.resize(n);
+    Slice data;
+    if (!reader->Read(offset, n, &data, &scratch[0]).ok() ||
+        data.size() != n) {
+      break;
+    }
+    Slice input = data;
+    Slice key, value;
+    while (ParseRecord(&input, &key, &value)) {
+    }
+    if (input.size() < data.size()) {
+      offset += data.size() - input.size();
+      n = kRecoveryBatch;
+    } else if (n < size - offset) {
+      n *= 2;  // a record larger than the batch
+    } else {
+      break;  // a torn record
+    }
+  }
+  return offset;
+}
+
+bool VLog::ParseRecord(Slice* input, Slice* key, Slice* value) {
+  if (input->size() < kRecordHeader) {
+    return false;
+  }
+  Slice record(input->data() + kRecordHeader, input->size() - kRecordHeader);
+  uint32_t value_size;
+  if (!GetLengthPrefixedSlice(&record, key) ||
+      !GetVarint32(&record, &value_size) || record.size() < value_size) {
+    return false;
+  }
+  *value = Slice(record.data(), value_size);
+  const char* end = value->data() + value_size;
+  const char* start = input->data() + kRecordHeader;
+  if (crc32c::Unmask(DecodeFixed32(input->data())) !=
+      crc32c::Value(start, end - start)) {
+    return false;
+  }
+  input->remove_prefix(end - input->data());
+  return true;
+}
+
+std::string VLog::SegmentFileName(uint64_t segment) const {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "/%06llu.vlog",
+           static_cast<unsigned long long>(segment));
+  return dbname + buf;
+}
+
+/*void PrintString(std::string s){
+  for(size_t i = 0; i < s.size(); i++)
+    if((s.data()[i] <= 'z' && s.data()[i] >= 'a') || s.data()[i] <= 'Z' && s.data()[i] >= 'A')
+      fprintf(stderr, "%c", s.data()[i]);
+    else
+      fprintf(stderr, " |%d| ", s.data()[i]);
+  fprintf(stderr, "\n");
+}*/
+
+// Each writer thread sticks to one partition, so that its records stay in
+// order in one file
+VLog::Partition* VLog::WriterPartition() {
+  if (partitions.size() == 1) {
+    return partitions[0];
+  }
+  static std::atomic<unsigned> next_writer(0);
+  thread_local unsigned writer = next_writer++;
+  return partitions[writer % partitions.size()];
+}
+
+uint64_t VLog::AddRecord(const Slice& key, const Slice& value) {
+  Partition* p = WriterPartition();
+  const uint64_t n = RecordSize(key.size(), value.size());
+  while (true) {
+    Buffer* b = p->active.load(std::memory_order_acquire);
+    const uint64_t pos = b->reserved.fetch_add(n);
+    if (pos + n <= b->capacity) {
+      uint64_t address = Copy(b, pos, key, value);
+      b->written.fetch_add(n, std::memory_order_release);
+      return address;
+    }
+    if (pos <= b->capacity) {
+      // The first record that does not fit seals the buffer and goes
+      // first in the next one
+      Buffer* next;
+      {
+        MutexLock l(&p->mu_);
+        next = Seal(p, b, pos, n);
+      }
+      uint64_t address = Copy(next, 0, key, value);
+      next->written.fetch_add(n, std::memory_order_release);
+      return address;
+    }
+    MutexLock l(&p->mu_);
+    while (p->active.load(std::memory_order_relaxed) == b) {
+      p->cv_.Wait();
+    }
+  }
+}
+
+// Copy the record into b at pos and return the address of its value
+uint64_t VLog::Copy(Buffer* b, uint64_t pos, const Slice& key,
+                    const Slice& value) {
+  char* const start = b->data + pos;
+  char* p = EncodeVarint32(start + kRecordHeader, key.size());
+  std::memcpy(p, key.data(), key.size());
+  p = EncodeVarint32(p + key.size(), value.size());
+  std::memcpy(p, value.data(), value.size());
+  const uint32_t crc = crc32c::Value(start + kRecordHeader,
+                                     p + value.size() - (start + kRecordHeader));
+  EncodeFixed32(start, crc32c::Mask(crc));
+  return b->base + (p - b->data);
+}
+
+// Hand b, which holds size bytes, to the flush thread, and make a free
+// buffer with the first bytes reserved the active one.
+// REQUIRES: p->mu_ held, and b's reservation taken past its capacity
+VLog::Buffer* VLog::Seal(Partition* p, Buffer* b, uint64_t size,
+                         uint64_t first) {
+  b->size = size;
+  {
+    std::unique_lock<SpinLock> lock(p->buffers_mu_);
+    b->state = Buffer::kSealed;
+  }
+  p->sealed.push_back(b);
+  p->flush_cv_.Signal();
+
+  Buffer* next = nullptr;
+  while (next == nullptr) {
+    for (int i = 0; i < kNumBuffers && next == nullptr; i++) {
+      if (p->buffers[i].state == Buffer::kFree) next = &p->buffers[i];
+    }
+    if (next == nullptr) p->cv_.Wait();
+  }
+  if (next->capacity < first) {
+    free(next->data);
+    next->data = (char*)malloc(first);
+    next->capacity = first;
+  } else if (next->capacity > kBufferSize && first <= kBufferSize) {
+    free(next->data);
+    next->data = (char*)malloc(kBufferSize);
+    next->capacity = kBufferSize;
+  }
+  uint64_t base = b->base + size;
+  if (OffsetOf(base) >= vlog_segment_size) {
+    base = Address(SegmentOf(base) + 1, 0);
+  }
+  next->reserved = first;
+  next->written = 0;
+  {
+    std::unique_lock<SpinLock> lock(p->buffers_mu_);
+    next->base = base;
+    next->state = Buffer::kActive;
+  }
+  p->active.store(next, std::memory_order_release);
+  p->cv_.SignalAll();
+  return next;
+}
+
+string VLog::ReadRecord(uint64_t address, uint32_t size) {
+  const uint64_t partition = PartitionOf(SegmentOf(address));
+  if (partition >= partitions.size()) {
+    return string();
+  }
+  Partition* p = partitions[partition];
+  Buffer* pinned = nullptr;
+  if (address >= p->flushed_end.load(std::memory_order_acquire)) {
+    std::unique_lock<SpinLock> lock(p->buffers_mu_);
+    if (address >= p->flushed_end) {
+      for (int i = 0; i < kNumBuffers && pinned == nullptr; i++) {
+        Buffer* b = &p->buffers[i];
+        const uint64_t end = b->base + (b->state == Buffer::kSealed ? b->size
+                                                                    : b->capacity);
+        if (b->state != Buffer::kFree && address >= b->base &&
+            address + size <= end) {
+          b->readers.fetch_add(1, std::memory_order_relaxed);
+          pinned = b;
+        }
+      }
+    }
+  }
+  if (pinned != nullptr) {
+    // Values may be large: copy without holding up the other readers
+    string result(pinned->data + (address - pinned->base), size);
+    pinned->readers.fetch_sub(1, std::memory_order_release);
+    return result;
+  }
+
+  RandomAccessFile* reader = Reader(SegmentOf(address));
+  if (reader == nullptr) {
+    return string();
+  }
+  char* scratch = new char[size];
+  Slice value;
+  reader->Read(OffsetOf(address), size, &value, scratch);
+  string result(value.data(), value.size());
+  delete[] scratch;
+  return result;
+}
+
+RandomAccessFile* VLog::Reader(uint64_t segment) {
+  std::unique_lock<SpinLock> lock(segments_mu_);
+  std::map<uint64_t, Segment>::iterator it = segments.find(segment);
+  return it != segments.end() ? it->second.reader : nullptr;
+}
+
+void VLog::FlushThread(Partition* p) {
+  MutexLock l(&p->mu_);
+  while (true) {
+    if (!p->sealed.empty()) {
+      Buffer* b = p->sealed.front();
+      p->mu_.Unlock();
+      Append(p, b);
+      {
+        std::unique_lock<SpinLock> lock(p->buffers_mu_);
+        p->flushed_end = b->base + b->size;
+      }
+      // No reader pins b any more, but the ones that did may be copying
+      while (b->readers.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+      }
+      p->mu_.Lock();
+      {
+        std::unique_lock<SpinLock> lock(p->buffers_mu_);
+        b->state = Buffer::kFree;
+      }
+      p->sealed.pop_front();
+      p->cv_.SignalAll();
+      continue;
+    }
+
+    // The records to sync, or the last ones on close, may still be in the
+    // active buffer
+    Buffer* b = p->active.load(std::memory_order_relaxed);
+    if ((p->sync_end > p->flushed_end || p->shutting_down) &&
+        b->reserved > 0) {
+      const uint64_t pos = b->reserved.fetch_add(b->capacity + 1);
+      if (pos <= b->capacity) {
+        Seal(p, b, pos, 0);
+      } else {
+        // A writer is sealing it
+        p->flush_cv_.Wait();
+      }
+      continue;
+    }
+    if (p->sync_end > p->synced_end && p->flushed_end >= p->sync_end) {
+      const uint64_t end = p->flushed_end;
+      p->mu_.Unlock();
+      Status s;
+      if (p->writer != nullptr) {
+        s = p->writer->Sync();
+      }
+      p->mu_.Lock();
+      if (!s.ok() && p->sync_status.ok()) {
+        p->sync_status = s;
+      }
+      p->synced_end = end;
+      p->cv_.SignalAll();
+      continue;
+    }
+    if (p->shutting_down) {
+      break;
+    }
+    p->flush_cv_.Wait();
+  }
+}
+
+// Append the sealed buffer b to the head of p
+void VLog::Append(Partition* p, Buffer* b) {
+  // Writers that took their space before the buffer was sealed may still
+  // be copying
+  while (b->written.load(std::memory_order_acquire) != b->size) {
+    std::this_thread::yield();
+  }
+  Status s;
+  if (SegmentOf(b->base) != p->head) {
+    s = Rotate(p, SegmentOf(b->base));
+  }
+  if (s.ok() && p->writer == nullptr) {
+    s = Status::IOError("no value log segment to write to",
+                        SegmentFileName(p->head));
+  }
+  if (s.ok()) {
+    s = p->writer->Append(Slice(b->data, b->size));
+  }
+  if (s.ok()) {
+    s = p->writer->Flush();
+  }
+  if (!s.ok()) {
+    MutexLock l(&p->mu_);
+    if (p->sync_status.ok()) p->sync_status = s;
+  }
+}
+
+// Seal the head of p and start the given segment
+Status VLog::Rotate(Partition* p, uint64_t segment) {
+  Status s;
+  if (p->writer != nullptr) {
+    s = p->writer->Sync();
+    p->writer->Close();
+    delete p->writer;
+  }
+  Status open = koo::env->NewWritableFile(SegmentFileName(segment), &p->writer);
+  if (!open.ok()) {
+    p->writer = nullptr;
+    if (s.ok()) s = open;
+  }
+  Segment next = {nullptr, 0, 0, false};
+  koo::env->NewRandomAccessFile(SegmentFileName(segment), &next.reader);
+  std::unique_lock<SpinLock> lock(segments_mu_);
+  segments[p->head].size = OffsetOf(p->flushed_end);
+  segments[p->head].sealed = true;
+  segments[segment] = next;
+  p->head = segment;
+  return s;
+}
+
+bool VLog::Contains(uint64_t address, uint32_t size) {
+  const uint64_t partition = PartitionOf(SegmentOf(address));
+  if (partition >= partitions.size()) {
+    return false;
+  }
+  Partition* p = partitions[partition];
+  std::unique_lock<SpinLock> lock(segments_mu_);
+  std::map<uint64_t, Segment>::iterator it = segments.find(SegmentOf(address));
+  if (it == segments.end()) {
+    return false;
+  }
+  if (it->second.sealed) {
+    return OffsetOf(address) + size <= it->second.size;
+  }
+  return address + size <= p->flushed_end.load(std::memory_order_acquire);
+}
+
+Status VLog::SyncTo(uint64_t end) {
+  const uint64_t partition = PartitionOf(SegmentOf(end));
+  if (partition >= partitions.size()) {
+    return Status::InvalidArgument("no such value log partition");
+  }
+  return SyncTo(partitions[partition], end);
+}
+
+Status VLog::SyncTo(Partition* p, uint64_t end) {
+  MutexLock l(&p->mu_);
+  if (p->sync_end < end) {
+    p->sync_end = end;
+    p->flush_cv_.Signal();
+  }
+  while (p->synced_end < end && p->sync_status.ok()) {
+    p->cv_.Wait();
+  }
+  return p->sync_status;
+}
+
+Status VLog::Sync() {
+  // Ask every partition before waiting for any, so that they sync together
+  std::vector<uint64_t> ends(partitions.size());
+  for (size_t i = 0; i < partitions.size(); i++) {
+    Partition* p = partitions[i];
+    MutexLock l(&p->mu_);
+    Buffer* b = p->active.load(std::memory_order_relaxed);
+    // Writers keep reserving: the end must be the one the decision to wait
+    // was made on, and the flush thread seals the buffer at or after it
+    uint64_t reserved = b->reserved;
+    // Until a buffer taken past its capacity is sealed, its size is unknown
+    while (reserved > b->capacity) {
+      p->cv_.Wait();
+      b = p->active.load(std::memory_order_relaxed);
+      reserved = b->reserved;
+    }
+    if (reserved > 0) {
+      ends[i] = b->base + reserved;
+    } else if (!p->sealed.empty()) {
+      ends[i] = p->sealed.back()->base + p->sealed.back()->size;
+    } else {
+      // An empty buffer may start the next segment
+      ends[i] = p->flushed_end;
+    }
+    if (p->sync_end < ends[i]) {
+      p->sync_end = ends[i];
+      p->flush_cv_.Signal();
+    }
+  }
+  Status s;
+  for (size_t i = 0; i < partitions.size(); i++) {
+    Status r = SyncTo(partitions[i], ends[i]);
+    if (s.ok()) s = r;
+  }
+  return s;
+}
+
+void VLog::AddGarbage(size_t key_size, const Slice& pointer) {
+  if (pointer.size() != sizeof(uint64_t) + sizeof(uint32_t)) {
+    return;
+  }
+  const uint64_t address = DecodeFixed64(pointer.data());
+  const uint32_t value_size = DecodeFixed32(pointer.data() + sizeof(uint64_t));
+  const uint64_t record_size = RecordSize(key_size, value_size);
+  std::unique_lock<SpinLock> lock(segments_mu_);
+  std::map<uint64_t, Segment>::iterator it = segments.find(SegmentOf(address));
+  // The segment was collected already
+  if (it != segments.end()) {
+    it->second.garbage += record_size;
+  }
+}
+
+bool VLog::PickSegment(double min_garbage, uint64_t* segment, uint64_t* size) {
+  std::unique_lock<SpinLock> lock(segments_mu_);
+  double best = 0;
+  bool found = false;
+  for (std::map<uint64_t, Segment>::iterator it = segments.begin();
+       it != segments.end(); ++it) {
+    if (!it->second.sealed || it->second.size == 0) continue;
+    // A compaction that failed and was redone counts its garbage twice
+    double garbage = std::min(1.0, 1.0 * it->second.garbage / it->second.size);
+    // The oldest segment first among equals
+    if (garbage >= min_garbage && (!found || garbage > best)) {
+      best = garbage;
+      *segment = it->first;
+      *size = it->second.size;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void VLog::Segments(std::vector<uint64_t>* sealed,
+                    std::vector<uint64_t>* heads) {
+  std::unique_lock<SpinLock> lock(segments_mu_);
+  sealed->clear();
+  heads->clear();
+  for (std::map<uint64_t, Segment>::iterator it = segments.begin();
+       it != segments.end(); ++it) {
+    (it->second.sealed ? sealed : heads)->push_back(it->first);
+  }
+}
+
+Status VLog::ReadRaw(uint64_t segment, uint64_t offset, size_t n,
+                     std::string* result) {
+  RandomAccessFile* reader = Reader(segment);
+  if (reader == nullptr) {
+    return Status::NotFound("value log segment", SegmentFileName(segment));
+  }
+  result->resize(n);
+  Slice data;
+  Status s = reader->Read(offset, n, &data, &(*result)[0]);
+  if (s.ok() && data.size() != n) {
+    s = Status::Corruption("truncated value log", SegmentFileName(segment));
+  }
+  if (s.ok() && data.data() != result->data()) {
+    result->assign(data.data(), data.size());
+  }
+  return s;
+}
+
+Status VLog::RemoveSegment(uint64_t segment) {
+  // The moved copies of the live records must be on disk before the
+  // originals go; if they cannot be synced, the segment stays
+  Status s = Sync();
+  if (!s.ok()) {
+    return s;
+  }
+  RandomAccessFile* reader = nullptr;
+  {
+    std::unique_lock<SpinLock> lock(segments_mu_);
+    std::map<uint64_t, Segment>::iterator it = segments.find(segment);
+    if (it == segments.end()) {
+      return Status::OK();
+    }
+    reader = it->second.reader;
+    segments.erase(it);
+  }
+  delete reader;
+  s = koo::env->DeleteFile(SegmentFileName(segment));
+  if (s.ok()) {
+    s = SaveGarbage();
+  }
+  return s;
+}
+
+// The garbage of each segment, and the size of the sealed ones, is saved
+// when a segment is removed or repaired and on close.  After a crash the
+// garbage counted since is forgotten, which only delays the collection of
+// the segments it is in.
+void VLog::LoadGarbage() {
+  std::string contents;
+  if (!ReadFileToString(koo::env, dbname + "/vlog.garbage", &contents).ok()) {
+    return;
+  }
+  Slice input(contents);
+  uint64_t segment, garbage, size;
+  while (GetVarint64(&input, &segment) && GetVarint64(&input, &garbage) &&
+         GetVarint64(&input, &size)) {
+    std::map<uint64_t, Segment>::iterator it = segments.find(segment);
+    if (it != segments.end()) {
+      it->second.garbage = garbage;
+      // A segment repaired after a crash is shorter than its file
+      if (it->second.sealed && size != 0 && size < it->second.size) {
+        it->second.size = size;
+      }
+    }
+  }
+}
+
+Status VLog::SaveGarbage() {
+  std::string contents;
+  {
+    std::unique_lock<SpinLock> lock(segments_mu_);
+    for (std::map<uint64_t, Segment>::iterator it = segments.begin();
+         it != segments.end(); ++it) {
+      PutVarint64(&contents, it->first);
+      PutVarint64(&contents, it->second.garbage);
+      PutVarint64(&contents, it->second.sealed ? it->second.size : 0);
+    }
+  }
+  std::string fname = dbname + "/vlog.garbage";
+  std::string tmp = fname + ".tmp";
+  koo::env->DeleteFile(tmp);  // vlog files are opened for appending
+  Status s = WriteStringToFileSync(koo::env, contents, tmp);
+  if (s.ok()) {
+    s = koo::env->RenameFile(tmp, fname);
+  }
+  if (!s.ok()) {
+    koo::env->DeleteFile(tmp);
+  }
+  return s;
+}
+
+VLog::~VLog() {
+  for (size_t i = 0; i < partitions.size(); i++) {
+    Partition* p = partitions[i];
+    {
+      MutexLock l(&p->mu_);
+      p->shutting_down = true;
+      p->flush_cv_.Signal();
+    }
+    p->flusher.join();
+    if (p->writer != nullptr) {
+      p->writer->Sync();
+    }
+  }
+  SaveGarbage();
+  for (size_t i = 0; i < partitions.size(); i++) {
+    Partition* p = partitions[i];
+    delete p->writer;
+    for (int j = 0; j < kNumBuffers; j++) {
+      free(p->buffers[j].data);
+    }
+    delete p;
+  }
+  for (std::map<uint64_t, Segment>::iterator it = segments.begin();
+       it != segments.end(); ++it) {
+    delete it->second.reader;
+  }
+}
+
+}
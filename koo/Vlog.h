@@ -1,51 +1,157 @@
-//
-// Created by daiyi on 2020/03/23.
-// A very simple implementation of Wisckey's Value Log
-// Since Bourbon doesn't test on deletion, Vlog garbage collection is not ported
-
-#ifndef LEVELDB_VLOG_H
-#define LEVELDB_VLOG_H
-
-#include "hyperleveldb/env.h"
-#include "port/port.h"
-#include <atomic>
-#include <mutex>
-#include "koo/koo.h"
-
-using namespace leveldb;
-
-namespace koo {
-
-class VLog {
-private:
-    WritableFile* writer;
-    RandomAccessFile* reader;
-    std::atomic<uint64_t> vlog_size;
-#if BOURBON_PLUS
-    uint64_t vlog_flushed;
-    SpinLock s_mu_;
-#endif
-
-    char* buffer;
-    std::atomic<uint64_t> current_pos;
-    std::atomic<uint64_t> count_pos;
-    void Flush(uint64_t s);
-
-public:
-    explicit VLog(const std::string& vlog_name);
-    uint64_t AddRecord(const Slice& key, const Slice& value);
-    std::string ReadRecord(uint64_t address, uint32_t size);
-    void Sync();
-    ~VLog();
-};
-
-
-
-
-
-}
-
-
-
-
-#endif //LEVELDB_VLOG_H
+//
+// Created by daiyi on 2020/03/23.
+// A very simple implementation of Wisckey's Value Log
+// The log is split into vlog_partitions partitions, and each writer thread
+// appends to one of them.  A partition is a series of numbered segment files
+// of about vlog_segment_size bytes each.  Writers copy their records into the
+// active one of a few buffers of their partition, and a background thread
+// appends the full buffers to the newest segment, the head.  DBImpl's
+// garbage collector moves the live records out of the segments that are
+// mostly garbage and deletes them.
+// A record is a masked crc32c of the rest of it, then the length-prefixed
+// key and the length-prefixed value.  Addresses point to the value.
+
+#ifndef LEVELDB_VLOG_H
+#define LEVELDB_VLOG_H
+
+#include "hyperleveldb/env.h"
+#include "port/port.h"
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "koo/koo.h"
+#include "util/coding.h"
+
+using namespace leveldb;
+
+namespace koo {
+
+class VLog {
+private:
+    struct Segment {
+        RandomAccessFile* reader;
+        uint64_t size;      // bytes in the file, known once sealed
+        uint64_t garbage;   // bytes of the records no key points to any more
+        bool sealed;        // no longer the head of its partition
+    };
+
+    struct Buffer {
+        enum State { kFree, kActive, kSealed };
+        char* data;
+        uint64_t capacity;
+        uint64_t base;                    // address of data[0]
+        // Bytes handed out to writers; the writer that takes it past
+        // capacity seals the buffer
+        std::atomic<uint64_t> reserved;
+        std::atomic<uint64_t> written;    // bytes copied in
+        uint64_t size;                    // bytes in it, once sealed
+        State state;
+        // Readers copying a record out of it, which keep it from being
+        // freed
+        std::atomic<int> readers;
+    };
+    enum { kNumBuffers = 4 };
+
+    struct Partition {
+        Partition();
+        // Only the flush thread uses the writer and the head
+        WritableFile* writer;
+        uint64_t head;
+
+        Buffer buffers[kNumBuffers];
+        std::atomic<Buffer*> active;
+        // Readers look for records in the buffers, and pin the one they
+        // find, under buffers_mu_; a buffer is freed and flushed_end
+        // advanced under it too
+        SpinLock buffers_mu_;
+        std::atomic<uint64_t> flushed_end;
+
+        // State below is protected by mu_
+        port::Mutex mu_;
+        port::CondVar cv_;          // a buffer was switched, flushed or synced
+        port::CondVar flush_cv_;    // work for the flush thread
+        std::deque<Buffer*> sealed;
+        uint64_t sync_end;          // the records up to here are to be synced
+        uint64_t synced_end;
+        Status sync_status;
+        bool shutting_down;
+        std::thread flusher;
+    };
+
+    const std::string dbname;
+    std::vector<Partition*> partitions;
+    SpinLock segments_mu_;
+    std::map<uint64_t, Segment> segments;
+
+    Partition* WriterPartition();
+    Buffer* Seal(Partition* p, Buffer* b, uint64_t size, uint64_t first);
+    static uint64_t Copy(Buffer* b, uint64_t pos, const Slice& key,
+                         const Slice& value);
+    void FlushThread(Partition* p);
+    void Append(Partition* p, Buffer* b);
+    Status Rotate(Partition* p, uint64_t segment);
+    Status SyncTo(Partition* p, uint64_t end);
+    RandomAccessFile* Reader(uint64_t segment);
+    static uint64_t WholeRecords(RandomAccessFile* reader, uint64_t size);
+    void LoadGarbage();
+    Status SaveGarbage();
+
+public:
+    enum { kMaxPartitions = 256 };
+    enum { kRecordHeader = 4 };     // the checksum
+
+    explicit VLog(const std::string& dbname);
+    uint64_t AddRecord(const Slice& key, const Slice& value);
+    std::string ReadRecord(uint64_t address, uint32_t size);
+    // Wait until the records before address "end" are on disk.  The flush
+    // thread of the partition syncs once for all the waiters.
+    Status SyncTo(uint64_t end);
+    // Wait until the records added so far are on disk.  Also returns the
+    // error of a segment file that could not be opened.
+    Status Sync();
+    // Whether the value of size bytes at address was written to the log
+    // file.  Recovery drops the pointers to values that were lost in a
+    // crash, and a torn record at the end of a head is cut off on open.
+    bool Contains(uint64_t address, uint32_t size);
+
+    // Addresses hold the segment above the offset in the segment, and
+    // segments the partition above the number of the segment in it
+    static uint64_t Address(uint64_t segment, uint64_t offset) {
+        return (segment << 32) | offset;
+    }
+    static uint64_t SegmentOf(uint64_t address) { return address >> 32; }
+    static uint64_t OffsetOf(uint64_t address) { return address & 0xffffffffu; }
+    static uint64_t RecordSize(size_t key_size, size_t value_size) {
+        return kRecordHeader + VarintLength(key_size) + key_size +
+               VarintLength(value_size) + value_size;
+    }
+    // Take the record at the start of *input.  Returns false if input cuts
+    // it short or its checksum does not match.
+    static bool ParseRecord(Slice* input, Slice* key, Slice* value);
+    static uint64_t SegmentId(uint64_t partition, uint64_t number) {
+        return (partition << 24) | number;
+    }
+    static uint64_t PartitionOf(uint64_t segment) { return segment >> 24; }
+    std::string SegmentFileName(uint64_t segment) const;
+
+    // The record of the key of key_size bytes that "pointer" points to was
+    // dropped from the LSM
+    void AddGarbage(size_t key_size, const Slice& pointer);
+    // Pick the sealed segment with the largest share of garbage, if that is
+    // at least min_garbage
+    bool PickSegment(double min_garbage, uint64_t* segment, uint64_t* size);
+    // The sealed segments, and the heads of the partitions
+    void Segments(std::vector<uint64_t>* sealed, std::vector<uint64_t>* heads);
+    // Read n bytes at offset of a sealed segment
+    Status ReadRaw(uint64_t segment, uint64_t offset, size_t n, std::string* result);
+    // Delete a sealed segment that no key points into any more
+    Status RemoveSegment(uint64_t segment);
+    ~VLog();
+};
+
+}
+
+#endif //LEVELDB_VLOG_H
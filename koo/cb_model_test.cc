@@ -0,0 +1,127 @@
+// Checks the file lifetime model CBModel_Learn uses to decide when a new
+// file is old enough to be worth learning, how it ranks files, and that its
+// statistics survive a restart.
+
+#include "koo/CBModel_Learn.h"
+
+#include "koo/util.h"
+#include "util/testharness.h"
+
+namespace koo {
+
+class CBModelTest {
+ public:
+  CBModel_Learn model;
+
+  // Lookups on level 1 taking 1000ns through the index block and 600ns
+  // through a model, files learned at 1ns per byte, and files of level 1
+  // living 1ms to 2ms.
+  void Observe() {
+    for (int i = 0; i < CBModel_Learn::lookup_average_limit; i++) {
+      model.AddLookupData(1, true, false, 1000);
+      model.AddLookupData(1, true, true, 600);
+    }
+    for (int i = 0; i < 3; i++) model.AddLearnCost(1, 1000000, 1000000);
+    for (int i = 0; i < 100; i++) model.AddFileLifetime(1, 1000000 + i * 10000);
+  }
+
+  // Record lookups over 100ms on 10 files of level 1
+  void Lookups(uint64_t now, int lookups) {
+    size_t num_files[leveldb::config::kNumLevels] = {0, 10, 0, 0, 0, 0, 0};
+    model.UpdateLookupRates(now, num_files);
+    for (int i = 0; i < lookups; i++) model.AddLookupData(1, false, false, 1000);
+    model.UpdateLookupRates(now + 100000000, num_files);
+  }
+};
+
+TEST(CBModelTest, WaitsForObservations) {
+  ASSERT_EQ(model.LearnAge(1, 1000, 0), learn_trigger_time);
+  model.AddFileLifetime(1, 1000000);
+  ASSERT_EQ(model.LearnAge(1, 1000, 0), learn_trigger_time);
+}
+
+TEST(CBModelTest, LearnsWhenLookupsPayOff) {
+  Observe();
+  Lookups(1, 1000000);
+  // Each file saves about 0.2ns per ns it lives: a 1000 byte file pays off
+  // at once, a 100MB one only once it outlived the lifetimes seen so far
+  ASSERT_EQ(model.LearnAge(1, 1000, 0), 0u);
+  uint64_t age = model.LearnAge(1, 100000000, 0);
+  ASSERT_TRUE(age > 0);
+  ASSERT_TRUE(age != CBModel_Learn::kNeverLearn);
+  // a level about to be compacted leaves less time to pay the training off
+  ASSERT_TRUE(model.LearnAge(1, 100000000, 4) > age);
+}
+
+TEST(CBModelTest, NoLookupsNoLearning) {
+  Observe();
+  Lookups(1, 0);
+  ASSERT_EQ(model.LearnAge(1, 1000000, 0), CBModel_Learn::kNeverLearn);
+}
+
+TEST(CBModelTest, ScoresHotFilesFirst) {
+  FileStats cold(1, 1 << 20), hot(1, 1 << 20), young(1, 1 << 20);
+  ASSERT_EQ(model.CalculateCB(cold, cold.start), CBModel_Learn::const_size_to_cost + 1);
+
+  Observe();
+  const uint64_t now = cold.start + 2000000000ull;
+  cold.start = hot.start = young.start = 0;
+  cold.num_lookup_neg = 10;
+  hot.num_lookup_pos = hot.num_lookup_neg = 1000000;
+  const double cold_score = model.CalculateCB(cold, now);
+  const double hot_score = model.CalculateCB(hot, now);
+  ASSERT_TRUE(hot_score > CBModel_Learn::const_size_to_cost);
+  ASSERT_TRUE(hot_score > 1000 * cold_score);
+
+  // a file too young to have its own lookups goes by its key range
+  young.start = now;
+  young.inherited_rate = 0.001;
+  ASSERT_TRUE(model.CalculateCB(young, now) > cold_score);
+  // and a large file takes longer to pay off than a small one
+  FileStats small = hot;
+  small.size = hot.size / 16;
+  ASSERT_TRUE(model.CalculateCB(small, now) > hot_score);
+}
+
+TEST(CBModelTest, ShadowLookupsOverrule) {
+  Observe();
+  Lookups(1, 1000000);
+  ASSERT_EQ(model.LearnAge(1, 1000, 0), 0u);
+  // timed on the same files, the models turn out slower than index blocks
+  for (int i = 0; i < 2 * CBModel_Learn::shadow_average_limit; i++) {
+    model.AddShadowData(1, i % 2 == 0, 500, 800);
+  }
+  ASSERT_EQ(model.LearnAge(1, 1000, 0), CBModel_Learn::kNeverLearn);
+  FileStats hot(1, 1 << 20);
+  hot.num_lookup_pos = hot.num_lookup_neg = 1000000;
+  ASSERT_TRUE(model.CalculateCB(hot, hot.start + 2000000000ull) < 0);
+}
+
+TEST(CBModelTest, WarmStart) {
+  Observe();
+  Lookups(1, 1000000);
+  std::string saved;
+  model.EncodeTo(&saved);
+
+  // a restarted model decides at once, like the one that saved the stats
+  CBModel_Learn restarted;
+  ASSERT_EQ(restarted.LearnAge(1, 100000000, 0), learn_trigger_time);
+  ASSERT_TRUE(restarted.DecodeFrom(saved));
+  ASSERT_EQ(restarted.LearnAge(1, 100000000, 0), model.LearnAge(1, 100000000, 0));
+  ASSERT_EQ(restarted.LearnAge(1, 1000, 0), 0u);
+
+  // a damaged or truncated file is ignored
+  CBModel_Learn fresh;
+  std::string corrupt = saved;
+  corrupt[corrupt.size() / 2] ^= 1;
+  ASSERT_TRUE(!fresh.DecodeFrom(corrupt));
+  ASSERT_TRUE(!fresh.DecodeFrom(Slice(saved.data(), saved.size() - 1)));
+  ASSERT_TRUE(!fresh.DecodeFrom(""));
+  ASSERT_EQ(fresh.LearnAge(1, 1000, 0), learn_trigger_time);
+}
+
+}  // namespace koo
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -0,0 +1,162 @@
+//
+// Epoch-based reclamation: every thread that ever entered an EpochGuard owns
+// a record announcing the global epoch it saw when it entered, or 0 while it
+// is outside any guard. An object retired at epoch e is freed once no record
+// announces an epoch at or below e.
+
+#include "koo/epoch.h"
+
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "port/port.h"
+#include "util/mutexlock.h"
+
+namespace koo {
+
+namespace {
+
+struct ThreadRecord {
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> in_use;
+    int nesting;
+    ThreadRecord* next;
+};
+
+// never 0, which marks a quiescent thread
+std::atomic<uint64_t> global_epoch(1);
+// records are never freed, only handed over once their thread exits
+std::atomic<ThreadRecord*> records(nullptr);
+
+struct Retired {
+    uint64_t epoch;
+    void (*deleter)(void*);
+    void* arg;
+};
+
+leveldb::port::Mutex* RetiredMutex() {
+    static leveldb::port::Mutex* mutex = new leveldb::port::Mutex;
+    return mutex;
+}
+
+std::vector<Retired>* RetiredList() {
+    static std::vector<Retired>* retired = new std::vector<Retired>;
+    return retired;
+}
+
+ThreadRecord* AcquireRecord() {
+    for (ThreadRecord* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        bool expected = false;
+        if (!r->in_use.load(std::memory_order_relaxed) &&
+            r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return r;
+        }
+    }
+    ThreadRecord* r = new ThreadRecord;
+    r->epoch.store(0, std::memory_order_relaxed);
+    r->in_use.store(true, std::memory_order_relaxed);
+    r->nesting = 0;
+    r->next = records.load(std::memory_order_relaxed);
+    while (!records.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                          std::memory_order_relaxed)) {
+    }
+    return r;
+}
+
+// Gives the record of a thread back when the thread exits
+struct LocalRecord {
+    ThreadRecord* record;
+    LocalRecord() : record(AcquireRecord()) {}
+    ~LocalRecord() { record->in_use.store(false, std::memory_order_release); }
+};
+
+ThreadRecord* Local() {
+    static thread_local LocalRecord local;
+    return local.record;
+}
+
+// Lowest epoch announced by a reader, UINT64_MAX if none is reading
+uint64_t MinActiveEpoch() {
+    // pairs with the fence in EpochGuard(): either the reader is seen here or
+    // it sees the unlink done before Retire()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t min = UINT64_MAX;
+    for (ThreadRecord* r = records.load(std::memory_order_acquire); r != nullptr; r = r->next) {
+        uint64_t e = r->epoch.load(std::memory_order_acquire);
+        if (e != 0 && e < min) min = e;
+    }
+    return min;
+}
+
+// Takes the entries that can be freed out of the list; the caller runs them
+// without the lock
+void CollectReclaimable(std::vector<Retired>* reclaimable) {
+    const uint64_t min = MinActiveEpoch();
+    std::vector<Retired>* retired = RetiredList();
+    size_t kept = 0;
+    for (size_t i = 0; i < retired->size(); ++i) {
+        if ((*retired)[i].epoch < min) {
+            reclaimable->push_back((*retired)[i]);
+        } else {
+            (*retired)[kept++] = (*retired)[i];
+        }
+    }
+    retired->resize(kept);
+}
+
+void Run(const std::vector<Retired>& reclaimable) {
+    for (const Retired& r : reclaimable) (*r.deleter)(r.arg);
+}
+
+}  // namespace
+
+EpochGuard::EpochGuard() {
+    ThreadRecord* r = Local();
+    if (r->nesting++ == 0) {
+        r->epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        // the announcement must be visible before any pointer is loaded
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+EpochGuard::~EpochGuard() {
+    ThreadRecord* r = Local();
+    if (--r->nesting == 0) {
+        r->epoch.store(0, std::memory_order_release);
+    }
+}
+
+void Retire(void (*deleter)(void*), void* arg) {
+    std::vector<Retired> reclaimable;
+    {
+        leveldb::MutexLock l(RetiredMutex());
+        // readers entering from now on announce a later epoch
+        RetiredList()->push_back(Retired{global_epoch.fetch_add(1), deleter, arg});
+        CollectReclaimable(&reclaimable);
+    }
+    Run(reclaimable);
+}
+
+void ReclaimRetired() {
+    std::vector<Retired> reclaimable;
+    {
+        leveldb::MutexLock l(RetiredMutex());
+        CollectReclaimable(&reclaimable);
+    }
+    Run(reclaimable);
+}
+
+void SynchronizeEpochs() {
+    while (NumRetired() != 0) {
+        ReclaimRetired();
+        if (NumRetired() != 0) std::this_thread::yield();
+    }
+}
+
+size_t NumRetired() {
+    leveldb::MutexLock l(RetiredMutex());
+    return RetiredList()->size();
+}
+
+}
@@ -0,0 +1,43 @@
+//
+// Epoch-based reclamation for the structures the Get path reads without
+// locks. A reader keeps an EpochGuard alive while it uses pointers loaded
+// from such a structure; a writer that unlinks an object hands it to
+// Retire(), which frees it only once every reader that could have seen it
+// has left its guard.
+
+#ifndef LEVELDB_EPOCH_H
+#define LEVELDB_EPOCH_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+namespace koo {
+
+    // Read-side critical section: cheap to enter and leave, may be nested
+    class EpochGuard {
+    public:
+        EpochGuard();
+        ~EpochGuard();
+
+    private:
+        EpochGuard(const EpochGuard&);
+        void operator=(const EpochGuard&);
+    };
+
+    // Call deleter(arg) once no reader may still use arg. Must be called
+    // after arg was unlinked from the structure readers go through.
+    void Retire(void (*deleter)(void*), void* arg);
+
+    // Free whatever can be freed now
+    void ReclaimRetired();
+
+    // Wait until everything retired so far is freed
+    void SynchronizeEpochs();
+
+    // Retired objects not freed yet
+    size_t NumRetired();
+
+}
+
+#endif //LEVELDB_EPOCH_H
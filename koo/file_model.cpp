@@ -0,0 +1,134 @@
+//
+// Models mapping the keys of a file or a level to their positions.
+
+#include "koo/file_model.h"
+
+#include <cstring>
+#include <vector>
+#include "koo/pgm.h"
+#include "koo/plr.h"
+#include "koo/radix_spline.h"
+#include "koo/segment_index.h"
+#include "util/coding.h"
+
+namespace koo {
+
+namespace {
+
+// Greedy PLR segments, searched through a frozen SegmentIndex
+class PLRModel : public FileModel {
+private:
+    double error;
+    // trainer, null once finished
+    PLR* plr;
+    uint64_t max_key;
+    std::vector<Segment> segments;
+    SegmentIndex segment_index;
+
+    void Freeze() {
+        segments.shrink_to_fit();
+        segment_index.Build(segments);
+    }
+
+public:
+    explicit PLRModel(double error) : error(error), plr(nullptr), max_key(0) {}
+    ~PLRModel() override { delete plr; }
+
+    ModelType Type() const override { return kPLRModel; }
+
+    void Add(uint64_t key) override {
+        if (plr == nullptr) plr = new PLR(error);
+        plr->Add(key);
+        max_key = key;
+    }
+
+    bool Finish() override {
+        if (plr == nullptr) return false;
+        std::vector<Segment> segs = std::move(plr->Finish());
+        delete plr;
+        plr = nullptr;
+        if (segs.empty()) return false;
+        // fill in a dummy last segment (used in segment binary search)
+        segs.push_back(Segment(max_key, 0, 0));
+        segments = std::move(segs);
+        Freeze();
+        return true;
+    }
+
+    void Predict(uint64_t x, double* lower, double* upper) const override {
+        double result = segment_index.Predict(x);
+        *lower = result - error;
+        *upper = result + error;
+    }
+
+    void EncodeTo(std::string* dst) const override {
+        leveldb::PutVarint64(dst, segments.size());
+        for (const Segment& s : segments) {
+            uint64_t k, b;
+            memcpy(&k, &s.k, sizeof(double));
+            memcpy(&b, &s.b, sizeof(double));
+            leveldb::PutVarint64(dst, s.x);
+            leveldb::PutFixed64(dst, k);
+            leveldb::PutFixed64(dst, b);
+        }
+    }
+
+    bool DecodeFrom(leveldb::Slice* input) override {
+        uint64_t num_segments;
+        if (!leveldb::GetVarint64(input, &num_segments) || num_segments < 2) return false;
+        std::vector<Segment> segs;
+        segs.reserve(num_segments);
+        for (uint64_t i = 0; i < num_segments; ++i) {
+            uint64_t x, k, b;
+            if (!leveldb::GetVarint64(input, &x) || input->size() < 2 * sizeof(uint64_t)) return false;
+            k = leveldb::DecodeFixed64(input->data());
+            b = leveldb::DecodeFixed64(input->data() + sizeof(uint64_t));
+            input->remove_prefix(2 * sizeof(uint64_t));
+            Segment s(x, 0, 0);
+            memcpy(&s.k, &k, sizeof(double));
+            memcpy(&s.b, &b, sizeof(double));
+            segs.push_back(s);
+        }
+        segments = std::move(segs);
+        Freeze();
+        return true;
+    }
+
+    size_t MemorySize() const override {
+        return segments.capacity() * sizeof(Segment) + segment_index.MemorySize();
+    }
+
+    size_t NumSegments() const override { return segment_index.NumSegments(); }
+};
+
+const char* const kModelTypeNames[kNumModelTypes] = {"plr", "rs", "pgm"};
+
+}  // namespace
+
+FileModel* NewFileModel(ModelType type, double error) {
+    switch (type) {
+        case kRadixSplineModel:
+            return new RadixSplineModel(error);
+        case kPGMModel:
+            return new PGMModel(error);
+        case kPLRModel:
+        default:
+            return new PLRModel(error);
+    }
+}
+
+const char* ModelTypeName(ModelType type) {
+    return type < kNumModelTypes ? kModelTypeNames[type] : "unknown";
+}
+
+bool ParseModelType(const std::string& name, ModelType* type) {
+    for (int i = 0; i < kNumModelTypes; ++i) {
+        if (name == kModelTypeNames[i]) {
+            *type = static_cast<ModelType>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+}
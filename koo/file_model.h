@@ -0,0 +1,63 @@
+//
+// Models mapping the keys of a file or a level to their positions.
+// LearnedIndexData turns keys into integers relative to the smallest one
+// and hands them to a FileModel, which only has to learn a monotone
+// function from those integers to positions.
+
+#ifndef LEVELDB_FILE_MODEL_H
+#define LEVELDB_FILE_MODEL_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "hyperleveldb/slice.h"
+
+namespace koo {
+
+    enum ModelType {
+        // greedy piecewise linear regression (the original model)
+        kPLRModel = 0,
+        // single pass spline with a radix table over the spline points
+        kRadixSplineModel = 1,
+        // optimal piecewise linear segments, indexed recursively
+        kPGMModel = 2,
+        kNumModelTypes
+    };
+
+    class FileModel {
+    public:
+        virtual ~FileModel() {}
+
+        virtual ModelType Type() const = 0;
+
+        // Training: one call per entry with keys in sorted order. A key equal
+        // to the previous one only takes up a position; models are fit to the
+        // first position of every distinct key. Finish() returns false if no
+        // usable model could be built.
+        virtual void Add(uint64_t key) = 0;
+        virtual bool Finish() = 0;
+
+        // Interval of positions holding x if x was trained on. The bounds may
+        // fall outside the positions seen during training.
+        // REQUIRES: Finish() or DecodeFrom() succeeded
+        virtual void Predict(uint64_t x, double* lower, double* upper) const = 0;
+
+        // Parameters only; the error bound and type are supplied by the owner.
+        virtual void EncodeTo(std::string* dst) const = 0;
+        virtual bool DecodeFrom(leveldb::Slice* input) = 0;
+
+        // Bytes used by the trained model and the number of pieces it has
+        virtual size_t MemorySize() const = 0;
+        virtual size_t NumSegments() const = 0;
+    };
+
+    // Untrained model of the given type with the given error bound
+    FileModel* NewFileModel(ModelType type, double error);
+    const char* ModelTypeName(ModelType type);
+    // Parses a name returned by ModelTypeName. Returns false if unknown.
+    bool ParseModelType(const std::string& name, ModelType* type);
+
+}
+
+#endif //LEVELDB_FILE_MODEL_H
@@ -0,0 +1,123 @@
+// Trains every kind of FileModel on a few key distributions and checks that
+// the predicted interval of each key holds its position.
+
+#include "koo/file_model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace koo {
+
+class FileModelTest { };
+
+// Sorted keys starting at 0; mode 0 dense, 1 uniform gaps, 2 skewed gaps,
+// 3 uniform gaps with runs of equal keys.
+static std::vector<uint64_t> MakeKeys(leveldb::Random* rnd, size_t n, int mode) {
+  std::vector<uint64_t> keys;
+  uint64_t key = 0;
+  for (size_t i = 0; i < n; i++) {
+    keys.push_back(key);
+    switch (mode) {
+      case 0: key += 1; break;
+      case 1: key += 1 + rnd->Uniform(1 << 20); break;
+      case 2: key += 1 + rnd->Skewed(30); break;
+      case 3: key += rnd->OneIn(4) ? 0 : 1 + rnd->Uniform(1000); break;
+    }
+  }
+  return keys;
+}
+
+static void CheckModel(const FileModel* model, const std::vector<uint64_t>& keys) {
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (i > 0 && keys[i] == keys[i - 1]) continue;  // only first positions are promised
+    double lower, upper;
+    model->Predict(keys[i], &lower, &upper);
+    ASSERT_LE(std::floor(lower), (double) i);
+    ASSERT_GE(std::ceil(upper), (double) i);
+  }
+}
+
+static FileModel* Train(ModelType type, double error, const std::vector<uint64_t>& keys) {
+  FileModel* model = NewFileModel(type, error);
+  for (uint64_t key : keys) model->Add(key);
+  ASSERT_TRUE(model->Finish());
+  return model;
+}
+
+TEST(FileModelTest, Names) {
+  for (int i = 0; i < kNumModelTypes; i++) {
+    ModelType type;
+    ASSERT_TRUE(ParseModelType(ModelTypeName(static_cast<ModelType>(i)), &type));
+    ASSERT_EQ(type, i);
+  }
+  ModelType type;
+  ASSERT_TRUE(!ParseModelType("btree", &type));
+}
+
+TEST(FileModelTest, Empty) {
+  for (int i = 0; i < kNumModelTypes; i++) {
+    FileModel* model = NewFileModel(static_cast<ModelType>(i), 8);
+    ASSERT_EQ(model->Type(), i);
+    ASSERT_TRUE(!model->Finish());
+    delete model;
+  }
+}
+
+TEST(FileModelTest, IntervalHoldsKey) {
+  leveldb::Random rnd(301);
+  const double errors[] = {1, 8, 32};
+  for (int i = 0; i < kNumModelTypes; i++) {
+    for (int mode = 0; mode < 4; mode++) {
+      for (size_t n : {1, 2, 3, 100, 20000}) {
+        for (double error : errors) {
+          std::vector<uint64_t> keys = MakeKeys(&rnd, n, mode);
+          FileModel* model = Train(static_cast<ModelType>(i), error, keys);
+          ASSERT_GT(model->NumSegments(), 0);
+          ASSERT_GT(model->MemorySize(), 0);
+          CheckModel(model, keys);
+          delete model;
+        }
+      }
+    }
+  }
+}
+
+TEST(FileModelTest, EncodeDecode) {
+  leveldb::Random rnd(17);
+  for (int i = 0; i < kNumModelTypes; i++) {
+    std::vector<uint64_t> keys = MakeKeys(&rnd, 5000, 2);
+    FileModel* model = Train(static_cast<ModelType>(i), 8, keys);
+    std::string encoding;
+    model->EncodeTo(&encoding);
+    encoding.append("tail");
+
+    FileModel* decoded = NewFileModel(static_cast<ModelType>(i), 8);
+    leveldb::Slice input(encoding);
+    ASSERT_TRUE(decoded->DecodeFrom(&input));
+    ASSERT_EQ(input.ToString(), "tail");
+    ASSERT_EQ(decoded->NumSegments(), model->NumSegments());
+    for (uint64_t key : keys) {
+      double lower1, upper1, lower2, upper2;
+      model->Predict(key, &lower1, &upper1);
+      decoded->Predict(key, &lower2, &upper2);
+      ASSERT_EQ(lower1, lower2);
+      ASSERT_EQ(upper1, upper2);
+    }
+
+    leveldb::Slice truncated(encoding.data(), encoding.size() / 2);
+    FileModel* broken = NewFileModel(static_cast<ModelType>(i), 8);
+    ASSERT_TRUE(!broken->DecodeFrom(&truncated));
+    delete broken;
+    delete decoded;
+    delete model;
+  }
+}
+
+}  // namespace koo
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -0,0 +1,103 @@
+// Checks that SliceToInteger() maps keys of any bytes to integers in their
+// bytewise order, and that stripping the prefix that SharedPrefixLength()
+// finds tells apart long keys that only differ after it.
+
+#include "koo/util.h"
+
+#include <algorithm>
+#include <vector>
+#include "hyperleveldb/comparator.h"
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace koo {
+
+class KeyMappingTest { };
+
+static bool BytewiseLess(const std::string& a, const std::string& b) {
+  return leveldb::BytewiseComparator()->Compare(a, b) < 0;
+}
+
+// Consecutive keys of "keys", sorted bytewise, never map to decreasing
+// integers
+static void CheckOrder(std::vector<std::string> keys, size_t prefix_length) {
+  std::sort(keys.begin(), keys.end(), BytewiseLess);
+  for (size_t i = 1; i < keys.size(); i++) {
+    ASSERT_LE(SliceToInteger(keys[i - 1], prefix_length),
+              SliceToInteger(keys[i], prefix_length));
+  }
+}
+
+TEST(KeyMappingTest, BinaryKeys) {
+  // Bytes above 0x7f must not sign-extend
+  ASSERT_LT(SliceToInteger(std::string("\x7f", 1)),
+            SliceToInteger(std::string("\x80", 1)));
+  ASSERT_LT(SliceToInteger(std::string("\x80", 1)),
+            SliceToInteger(std::string("\xff", 1)));
+  ASSERT_LT(SliceToInteger(std::string("\x00\xff", 2)),
+            SliceToInteger(std::string("\x01\x00", 2)));
+  // Shorter keys are zero padded, so a trailing zero byte ties
+  ASSERT_EQ(SliceToInteger("a"), SliceToInteger(std::string("a\0", 2)));
+  ASSERT_LT(SliceToInteger("a"), SliceToInteger("a\x01"));
+
+  leveldb::Random rnd(301);
+  std::vector<std::string> keys;
+  for (int i = 0; i < 10000; i++) {
+    std::string key;
+    const int length = rnd.Uniform(12);
+    for (int j = 0; j < length; j++) {
+      // Mostly the bytes at the edges of the signed and unsigned ranges
+      static const char kBytes[] = { '\x00', '\x01', '\x7f', '\x80', '\xfe',
+                                     '\xff', 'a', 'z' };
+      key.push_back(rnd.OneIn(4) ? static_cast<char>(rnd.Uniform(256))
+                                 : kBytes[rnd.Uniform(sizeof(kBytes))]);
+    }
+    keys.push_back(key);
+  }
+  CheckOrder(keys, 0);
+}
+
+TEST(KeyMappingTest, SharedPrefix) {
+  ASSERT_EQ(SharedPrefixLength("", "abc"), 0u);
+  ASSERT_EQ(SharedPrefixLength("abc", "abd"), 2u);
+  ASSERT_EQ(SharedPrefixLength("abc", "abcdef"), 3u);
+  ASSERT_EQ(SharedPrefixLength(std::string("\x80\x00", 2),
+                               std::string("\x80\x01", 2)), 1u);
+
+  // Keys longer than 8 bytes that only differ after a long shared prefix
+  // all map to the same integer unless the prefix is stripped first
+  std::vector<std::string> keys;
+  for (int i = 0; i < 1000; i++) {
+    char buf[100];
+    snprintf(buf, sizeof(buf), "user_profile/%08d/name", i * 13);
+    keys.push_back(buf);
+  }
+  const size_t prefix = SharedPrefixLength(keys.front(), keys.back());
+  ASSERT_EQ(prefix, std::string("user_profile/000").size());
+  ASSERT_EQ(SliceToInteger(keys.front()), SliceToInteger(keys.back()));
+  for (size_t i = 1; i < keys.size(); i++) {
+    ASSERT_LT(SliceToInteger(keys[i - 1], prefix),
+              SliceToInteger(keys[i], prefix));
+  }
+  CheckOrder(keys, prefix);
+
+  // Binary keys with a shared prefix of bytes above 0x7f
+  keys.clear();
+  leveldb::Random rnd(302);
+  for (int i = 0; i < 1000; i++) {
+    std::string key("\xff\xfe\x80\x80\x80\x80\x80\x80\x80\x80", 10);
+    for (int j = 0; j < 6; j++) {
+      key.push_back(static_cast<char>(rnd.Uniform(256)));
+    }
+    keys.push_back(key);
+  }
+  std::sort(keys.begin(), keys.end(), BytewiseLess);
+  ASSERT_GE(SharedPrefixLength(keys.front(), keys.back()), 10u);
+  CheckOrder(keys, SharedPrefixLength(keys.front(), keys.back()));
+}
+
+}  // namespace koo
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
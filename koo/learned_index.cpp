@@ -5,13 +5,16 @@
 #include "koo/learned_index.h"
 
 #include "db/version_set.h"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <utility>
+#include "util/coding.h"
 #include "util/mutexlock.h"
+#include "koo/epoch.h"
 #include "koo/util.h"
 #include "koo/koo.h"
 
@@ -19,35 +22,22 @@ namespace koo {
 
 std::pair<uint64_t, uint64_t> LearnedIndexData::GetPosition(
     const Slice& target_x) const {
-  assert(string_segments.size() > 1);
   ++served;
+  if (file_model == nullptr) return std::make_pair(size, size);
 
   // check if the key is within the model bounds
-  uint64_t target_int = SliceToInteger(target_x);
+  uint64_t target_int = SliceToInteger(target_x, prefix_length);
   if (target_int > max_key) return std::make_pair(size, size);
   if (target_int < min_key) return std::make_pair(size, size);
+  target_int -= min_key;
 
-  // binary search between segments
-  uint32_t left = 0, right = (uint32_t)string_segments.size() - 1;
-  while (left != right - 1) {
-    uint32_t mid = (right + left) / 2;
-    if (target_int < string_segments[mid].x)
-      right = mid;
-    else
-      left = mid;
-  }
-
-	// TODO x보다 1 작은 키 찾는 버그
-  /*if (left < (uint32_t)string_segments.size()-1 && target_int+1 == string_segments[left+1].x)
-  	left++;*/
-
-  // calculate the interval according to the selected segment
-  double result =
-      target_int * string_segments[left].k + string_segments[left].b;
-  result = is_level ? result / 2 : result;
+  // ask the model for the interval and round it outwards
+  double predicted_lower, predicted_upper;
+  file_model->Predict(target_int, &predicted_lower, &predicted_upper);
   uint64_t lower =
-      result - error > 0 ? (uint64_t)std::floor(result - error) : 0;
-  uint64_t upper = (uint64_t)std::ceil(result + error);
+      predicted_lower > 0 ? (uint64_t)std::floor(predicted_lower) : 0;
+  uint64_t upper =
+      predicted_upper > 0 ? (uint64_t)std::ceil(predicted_upper) : 0;
   if (lower >= size) return std::make_pair(size, size);
   upper = upper < size ? upper : size - 1;
   //                printf("%s %s %s\n", string_keys[lower].c_str(),
@@ -62,26 +52,47 @@ uint64_t LearnedIndexData::MaxPosition() const { return size - 1; }
 
 double LearnedIndexData::GetError() const { return error; }
 
-// Actual function doing learning
-bool LearnedIndexData::Learn() {
-  // FILL IN GAMMA (error)
-  PLR plr = PLR(LEARN_MODEL_ERROR);
+ModelType LearnedIndexData::GetModelType() const {
+  return file_model != nullptr ? file_model->Type() : model_types[level];
+}
 
-  // check if data if filled
-  if (string_keys.empty()) assert(false);
+size_t LearnedIndexData::NumSegments() const {
+  return file_model != nullptr ? file_model->NumSegments() : 0;
+}
 
-  // fill in some bounds for the model
-  uint64_t temp = atoll(string_keys.back().c_str());
-  min_key = atoll(string_keys.front().c_str());
-  max_key = atoll(string_keys.back().c_str());
-  size = string_keys.size();
+size_t LearnedIndexData::MemorySize() const {
+  return file_model != nullptr ? file_model->MemorySize() : 0;
+}
 
-  // actual training
-  std::vector<Segment> segs = plr.train(string_keys, !is_level);
-  if (segs.empty()) return false;
-  // fill in a dummy last segment (used in segment binary search)
-  segs.push_back((Segment){temp, 0, 0});
-  string_segments = std::move(segs);
+void LearnedIndexData::SetKeyRange(const Slice& smallest, const Slice& largest) {
+  assert(size == 0);
+  prefix_length = SharedPrefixLength(smallest, largest);
+}
+
+void LearnedIndexData::AddKey(const Slice& key) {
+  if (file_model == nullptr) file_model = NewFileModel(model_types[level], error);
+
+  uint64_t key_int = SliceToInteger(key, prefix_length);
+  if (size == 0) {
+    min_key = key_int;
+  } else if (key_int == max_key) {
+    has_ties = true;
+  }
+  max_key = key_int;
+  ++size;
+  file_model->Add(key_int - min_key);
+}
+
+bool LearnedIndexData::FinishOnlineLearn() {
+  if (file_model == nullptr) return false;
+
+  // level reads have no index block to fall back to, so level models need distinct keys
+  if (!file_model->Finish() || (is_level && has_ties)) {
+    delete file_model;
+    file_model = nullptr;
+    return false;
+  }
+  filled = true;
 
   learned.store(true);
   return true;
@@ -89,74 +100,75 @@ bool LearnedIndexData::Learn() {
 
 // static learning function to be used with LevelDB background scheduling
 // level learning
-void LearnedIndexData::LevelLearn(void* arg, bool nolock) {
-  /*Stats* instance = Stats::GetInstance();
+void LearnedIndexData::LevelLearn(void* arg) {
+  Stats* instance = Stats::GetInstance();
   bool success = false;
-  bool entered = false;
-  instance->StartTimer(8);
+  uint64_t time_started = instance->StartTimer(8);
 
+  // vas holds a reference on the model until it is deleted below
   VersionAndSelf* vas = reinterpret_cast<VersionAndSelf*>(arg);
-  LearnedIndexData* self = vas->self;
-  self->is_level = true;
+  LearnedIndexData* self = vas->self.get();
   self->level = vas->level;
-  Version* c;
-  if (!nolock) {
-    c = db->GetCurrentVersion();
-  }
-  if (db->version_count == vas->v_count) {
-    entered = true;
-    if (vas->version->FillLevel(koo::read_options, vas->level)) {
-      self->filled = true;
-      if (db->version_count == vas->v_count) {
-        if (env->compaction_awaiting.load() == 0 && self->Learn()) {
-          success = true;
-        } else {
-          self->learning.store(false);
-        }
-      }
-    }
-  }
-  if (!nolock) {
-    koo::db->ReturnCurrentVersion(c);
-  }
 
-  auto time = instance->PauseTimer(8, true);
+  // Learn from the current version as long as it still serves this model,
+  // i.e. the level did not change since the model was scheduled.
+  Version* c = db->GetCurrentVersion();
+  if (c->level_models_[vas->level].get() == self) {
+    success = c->LearnLevel(vas->level, self, vas->v_count);
+  }
+  koo::db->ReturnCurrentVersion(c);
 
-  if (entered) {
+  auto time = instance->PauseTimer(time_started, 8, true);
+  if (success) {
     self->cost = time.second - time.first;
-    learn_counter_mutex.Lock();
-    events[1].push_back(new LearnEvent(time, 0, self->level, success));
-    levelled_counters[6].Increment(vas->level, time.second - time.first);
-    learn_counter_mutex.Unlock();
   }
+  // learning is left set: the files of a level model never change, so a
+  // failed attempt would only fail again
 
-  delete vas;*/
+  delete vas;
 }
 
 // static learning function to be used with LevelDB background scheduling
-// file learning
+// file learning; takes over the reference held on mas->self
 uint64_t LearnedIndexData::FileLearn(void* arg) {
   Stats* instance = Stats::GetInstance();
   bool entered = false;
-  instance->StartTimer(11);
 
   MetaAndSelf* mas = reinterpret_cast<MetaAndSelf*>(arg);
   LearnedIndexData* self = mas->self;
-  self->learning.store(true);
+  bool busy;
+  {
+    // MarkDelete() frees the model of a file unless it is being learned
+    leveldb::MutexLock l(&self->mutex_delete_);
+    // the learning policy may ask again for a file learned or being learned
+    busy = self->learning.load() || self->Learned();
+    if (!busy) self->learning.store(true);
+  }
+  if (busy) {
+    if (!fresh_write) delete mas->meta;
+    delete mas;
+    self->Unref();
+    return 0;
+  }
   self->level = mas->level;
+  uint64_t time_started = instance->StartTimer(11);
 
+  // The file may have been compacted away while the job waited, and may go
+  // while its blocks are read: DeleteModel() aborts the model then.
   Version* c = db->GetCurrentVersion();
-  if (self->FillData(c, mas->meta)) {
-    self->Learn();
-    entered = true;
+  if (!self->Aborted() && db->IsLiveFile(mas->meta->number) && self->FillData(c, mas->meta)) {
+    entered = self->FinishOnlineLearn() && !self->Aborted();
   }
-  self->learning.store(false);
   koo::db->ReturnCurrentVersion(c);
 
-  auto time = instance->PauseTimer(11, true);
+  auto time = instance->PauseTimer(time_started, 11, true);
   if (entered) {
     // count how many file learning are done.
     self->cost = time.second - time.first;
+    file_data->UpdateCharge(self);
+  } else {
+    // most likely the table is gone already: do not keep an empty model for it
+    file_data->DeleteModel(mas->meta->number);
   }
 
   //        if (fresh_write) {
@@ -165,59 +177,49 @@ uint64_t LearnedIndexData::FileLearn(void* arg) {
   //            self->string_keys.clear();
   //            self->num_entries_accumulated.array.clear();
   //        }
+  {
+    leveldb::MutexLock l(&self->mutex_delete_);
+    self->learning.store(false);
 #if BOURBON_PLUS
-	self->string_keys.clear();
-	self->string_keys.shrink_to_fit();
-	if (self->Deleted()) {
-		self->string_segments.clear();
-		self->string_segments.shrink_to_fit();
-	}
+    if (self->Deleted()) {
+      delete self->file_model;
+      self->file_model = nullptr;
+    }
 #endif
+  }
   if (!fresh_write) delete mas->meta;
   delete mas;
+  self->Unref();
   return entered ? time.second - time.first : 0;
 }
 
-// general model checker
+// general model checker; file models are shared by lock-free lookups, so
+// this only reads (an acquire load costs a plain load on x86 anyway)
 bool LearnedIndexData::Learned() {
-  if (learned_not_atomic)
-    return true;
-  else if (learned.load()) {
-    learned_not_atomic = true;
-    return true;
-  } else
-    return false;
+  return learned.load(std::memory_order_acquire);
 }
 
-// level model checker, used to be also learning trigger
+// level model checker and learning trigger: the model is learned once it
+// has been asked for allowed_seek times
 bool LearnedIndexData::Learned(Version* version, int v_count, int level) {
-  if (learned_not_atomic)
-    return true;
-  else if (learned.load()) {
-    learned_not_atomic = true;
+  // shared by the versions and the reads using the level
+  if (learned.load(std::memory_order_acquire)) {
     return true;
   }
+  if (current_seek.fetch_add(1, std::memory_order_relaxed) + 1 >= allowed_seek &&
+      !learning.exchange(true)) {
+    // version, which the caller holds, owns this model
+    assert(version->level_models_[level].get() == this);
+    env->Schedule(&LearnedIndexData::LevelLearn,
+                  new VersionAndSelf{version, v_count, version->level_models_[level], level});
+  }
   return false;
-  //        } else {
-  //            if (level_learning_enabled && ++current_seek >= allowed_seek &&
-  //            !learning.exchange(true)) {
-  //                env->ScheduleLearning(&LearnedIndexData::Learn, new
-  //                VersionAndSelf{version, v_count, this, level}, 0);
-  //            }
-  //            return false;
-  //        }
 }
 
 // file model checker, used to be also learning trigger
 bool LearnedIndexData::Learned(Version* version, int v_count,
                                FileMetaData* meta, int level) {
-  if (learned_not_atomic)
-    return true;
-  else if (learned.load()) {
-    learned_not_atomic = true;
-    return true;
-  } else
-    return false;
+  return learned.load(std::memory_order_acquire);
   //        } else {
   //            if (file_learning_enabled && (true || level != 0 && level != 1)
   //            && ++current_seek >= allowed_seek && !learning.exchange(true)) {
@@ -229,69 +231,73 @@ bool LearnedIndexData::Learned(Version* version, int v_count,
 }
 
 bool LearnedIndexData::FillData(Version* version, FileMetaData* meta) {
-  // if (filled) return true;
+  if (filled) return true;
+
+  // start over from whatever an earlier attempt left
+  delete file_model;
+  file_model = nullptr;
+  size = 0;
+  has_ties = false;
+  SetKeyRange(meta->smallest.user_key(), meta->largest.user_key());
+
+  // learning reads every block once: keep them out of the block cache
+  ReadOptions options;
+  options.fill_cache = false;
+  return version->FillData(options, meta, this);
+}
 
-  if (version->FillData(koo::read_options, meta, this)) {
-    // filled = true;
-    return true;
-  }
-  return false;
+void LearnedIndexData::EncodeTo(std::string* dst) const {
+  assert(file_model != nullptr);
+  uint64_t error_bits;
+  memcpy(&error_bits, &error, sizeof(double));
+  leveldb::PutVarint64(dst, min_key);
+  leveldb::PutVarint64(dst, max_key);
+  leveldb::PutVarint64(dst, size);
+  leveldb::PutVarint64(dst, prefix_length);
+  dst->push_back(has_ties ? 1 : 0);
+  dst->push_back(static_cast<char>(file_model->Type()));
+  leveldb::PutFixed64(dst, error_bits);
+  file_model->EncodeTo(dst);
 }
 
-void LearnedIndexData::WriteModel(const string& filename) {
-  if (!learned.load()) return;
-	std::ofstream ofs(filename, std::ios::binary);
-	ofs.write(reinterpret_cast<const char*>(&koo::block_num_entries), sizeof(uint64_t));
-	ofs.write(reinterpret_cast<const char*>(&koo::block_size), sizeof(uint64_t));
-	ofs.write(reinterpret_cast<const char*>(&koo::entry_size), sizeof(uint64_t));
-	size_t segs_size = string_segments.size();
-	ofs.write(reinterpret_cast<const char*>(&segs_size), sizeof(size_t));
-	for (Segment& s : string_segments) {
-		ofs.write(reinterpret_cast<const char*>(&s.x), sizeof(uint64_t));
-		ofs.write(reinterpret_cast<const char*>(&s.k), sizeof(double));
-		ofs.write(reinterpret_cast<const char*>(&s.b), sizeof(double));
-	}
-	ofs.write(reinterpret_cast<const char*>(&min_key), sizeof(uint64_t));
-	ofs.write(reinterpret_cast<const char*>(&max_key), sizeof(uint64_t));
-	ofs.write(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
-	ofs.write(reinterpret_cast<const char*>(&level), sizeof(int));
-	ofs.write(reinterpret_cast<const char*>(&cost), sizeof(uint64_t));
-	ofs.write(reinterpret_cast<const char*>(&file_number), sizeof(uint64_t));
-	ofs.close();
-}
-
-void LearnedIndexData::ReadModel(const string& filename) {
-	if (learned.load()) return;
-
-	std::ifstream ifs(filename, std::ios::binary);
-	if (!ifs.good()) return;
-	ifs.read(reinterpret_cast<char*>(&koo::block_num_entries), sizeof(uint64_t));
-	ifs.read(reinterpret_cast<char*>(&koo::block_size), sizeof(uint64_t));
-	ifs.read(reinterpret_cast<char*>(&koo::entry_size), sizeof(uint64_t));
-	size_t segs_size;
-	ifs.read(reinterpret_cast<char*>(&segs_size), sizeof(size_t));
-	for (int i=0; i<segs_size; i++) {
-		uint64_t x, x_last;
-		double k, b;
-		uint32_t y_last;
-		ifs.read(reinterpret_cast<char*>(&x), sizeof(uint64_t));
-		ifs.read(reinterpret_cast<char*>(&k), sizeof(double));
-		ifs.read(reinterpret_cast<char*>(&b), sizeof(double));
-		string_segments.emplace_back(Segment(x, k, b));
-	}
-	ifs.read(reinterpret_cast<char*>(&min_key), sizeof(uint64_t));
-	ifs.read(reinterpret_cast<char*>(&max_key), sizeof(uint64_t));
-	ifs.read(reinterpret_cast<char*>(&size), sizeof(uint64_t));
-	ifs.read(reinterpret_cast<char*>(&level), sizeof(int));
-	ifs.read(reinterpret_cast<char*>(&cost), sizeof(uint64_t));
-	ifs.read(reinterpret_cast<char*>(&file_number), sizeof(uint64_t));
-	ifs.close();
+bool LearnedIndexData::DecodeFrom(const Slice& src) {
+  if (learned.load()) return false;
+
+  Slice input = src;
+  uint64_t prefix;
+  if (!leveldb::GetVarint64(&input, &min_key) ||
+      !leveldb::GetVarint64(&input, &max_key) ||
+      !leveldb::GetVarint64(&input, &size) ||
+      !leveldb::GetVarint64(&input, &prefix) ||
+      input.size() < 2 + sizeof(uint64_t)) {
+    return false;
+  }
+  prefix_length = prefix;
+  has_ties = input[0] != 0;
+  uint8_t type = static_cast<uint8_t>(input[1]);
+  if (type >= kNumModelTypes) return false;
+  input.remove_prefix(2);
+  // the bound the model was trained with, whatever the current setting
+  uint64_t error_bits = leveldb::DecodeFixed64(input.data());
+  input.remove_prefix(sizeof(uint64_t));
+  memcpy(&error, &error_bits, sizeof(double));
+
+  FileModel* decoded = NewFileModel(static_cast<ModelType>(type), error);
+  if (!decoded->DecodeFrom(&input)) {
+    delete decoded;
+    return false;
+  }
+  delete file_model;
+  file_model = decoded;
+  filled = true;
 
   learned.store(true);
+  return true;
 }
 
 #if BOURBON_PLUS
 LearnedIndexData::~LearnedIndexData() {
+	delete file_model;
 	//if (!buckets_data) delete buckets_data;
 	//buckets_data = nullptr;
 	// TODO unlink write했던 파일들 삭제
@@ -310,134 +316,289 @@ void LearnedIndexData::MarkDelete() {
 
 	mutex_delete_.Lock();
 	if (!learning.load()) {
-		string_segments.clear();
-		string_segments.shrink_to_fit();
+		delete file_model;
+		file_model = nullptr;
 	}
 	mutex_delete_.Unlock();
 }
 
-void FileLearnedIndexData::DeleteModel(int number) {
-	//leveldb::MutexLock l(&mutex);
-	if (file_learned_index_data.size() <= number) return;
-	if (file_learned_index_data[number] == nullptr) return;
-
-	file_learned_index_data[number]->MarkDelete();
-	//delete file_learned_index_data[number];
-	//file_learned_index_data[number] = nullptr;
-	return;
+void FileLearnedIndexData::DeleteModel(uint64_t number) {
+	LearnedIndexData* model = nullptr;
+	{
+		leveldb::MutexLock l(&mutex);
+		ModelSlot* slot = table.load(std::memory_order_relaxed)->Find(number);
+		if (slot == nullptr) return;
+		slot->evicted_reads.store(-1, std::memory_order_relaxed);
+		model = slot->model.load(std::memory_order_relaxed);
+		if (model == nullptr) return;
+		// a job learning the file stops at its next block
+		model->aborted.store(true, std::memory_order_relaxed);
+		Remove(slot, true);
+	}
 }
 #endif
 
 void LearnedIndexData::ReportStats() {
-  //        double neg_gain, pos_gain;
-  //        if (num_neg_model == 0 || num_neg_baseline == 0) {
-  //            neg_gain = 0;
-  //        } else {
-  //            neg_gain = ((double) time_neg_baseline / num_neg_baseline -
-  //            (double) time_neg_model / num_neg_model) * num_neg_model;
-  //        }
-  //        if (num_pos_model == 0 || num_pos_baseline == 0) {
-  //            pos_gain = 0;
-  //        } else {
-  //            pos_gain = ((double) time_pos_baseline / num_pos_baseline -
-  //            (double) time_pos_model / num_pos_model) * num_pos_model;
-  //        }
+  printf("%d %d %lu %lu %lu %s %lu %u %.1f\n", level, served, NumSegments(), cost,
+         size, ModelTypeName(GetModelType()), MemorySize(),
+         shadow_samples.load(std::memory_order_relaxed), ShadowGain());
+}
+
+void LearnedIndexData::AddShadowSample(uint64_t baseline_time, uint64_t model_time) {
+  const int64_t gain = (int64_t) baseline_time - (int64_t) model_time;
+  shadow_gain.fetch_add(gain, std::memory_order_relaxed);
+  shadow_samples.fetch_add(1, std::memory_order_relaxed);
+
+  leveldb::MutexLock l(&shadow_mutex_);
+  window_gain += gain;
+  if (++window_samples == kBypassWindow) {
+    bypass.store(window_gain < 0, std::memory_order_relaxed);
+    window_samples = 0;
+    window_gain = 0;
+  }
+}
+
+double LearnedIndexData::ShadowGain() const {
+  const uint32_t samples = shadow_samples.load(std::memory_order_relaxed);
+  if (samples == 0) return 0;
+  return (double) shadow_gain.load(std::memory_order_relaxed) / samples;
+}
+
+namespace {
+
+void UnrefModel(void* arg) {
+  reinterpret_cast<LearnedIndexData*>(arg)->Unref();
+}
 
-  printf("%d %d %lu %lu %lu\n", level, served, string_segments.size(), cost,
-         size);  //, file_size);
-  //        printf("\tPredicted: %lu %lu %lu %lu %d %d %d %d %d %lf\n",
-  //        time_neg_baseline_p, time_neg_model_p, time_pos_baseline_p,
-  //        time_pos_model_p,
-  //                num_neg_baseline_p, num_neg_model_p, num_pos_baseline_p,
-  //                num_pos_model_p, num_files_p, gain_p);
-  //        printf("\tActual: %lu %lu %lu %lu %d %d %d %d %f\n",
-  //        time_neg_baseline, time_neg_model, time_pos_baseline,
-  //        time_pos_model,
-  //               num_neg_baseline, num_neg_model, num_pos_baseline,
-  //               num_pos_model, pos_gain + neg_gain);
-}
-
-void LearnedIndexData::FillCBAStat(bool positive, bool model, uint64_t time) {
-  //        int& num_to_update = positive ? (model ? num_pos_model :
-  //        num_pos_baseline) : (model ? num_neg_model : num_neg_baseline);
-  //        uint64_t& time_to_update =  positive ? (model ? time_pos_model :
-  //        time_pos_baseline) : (model ? time_neg_model : time_neg_baseline);
-  //        time_to_update += time;
-  //        num_to_update += 1;
-}
-
-LearnedIndexData* FileLearnedIndexData::GetModel(int number) {
 #if BOURBON_PLUS
-  if (file_learned_index_data.size() <= number) {
-  	mutex.Lock();
-		if (file_learned_index_data.size() <= number) {
-			file_learned_index_data.resize(number + 100, nullptr);
-			file_learned_index_data[number] = new LearnedIndexData(file_allowed_seek, false, (uint64_t)number);
-			mutex.Unlock();
-			return file_learned_index_data[number];
-		}
-		mutex.Unlock();
-	}
-  if (file_learned_index_data[number] == nullptr) {
-  	mutex.Lock();
-		if (file_learned_index_data[number] == nullptr) {
-			file_learned_index_data[number] = new LearnedIndexData(file_allowed_seek, false, number);
-			mutex.Unlock();
-			return file_learned_index_data[number];
-		}
-		mutex.Unlock();
-	}
-	return file_learned_index_data[number];
-#else
-  leveldb::MutexLock l(&mutex);
-  if (file_learned_index_data.size() <= number)
-    file_learned_index_data.resize(number + 1, nullptr);
-  if (file_learned_index_data[number] == nullptr)
-    file_learned_index_data[number] = new LearnedIndexData(file_allowed_seek, false, number);
-  return file_learned_index_data[number];
+void UnrefDeletedModel(void* arg) {
+  LearnedIndexData* model = reinterpret_cast<LearnedIndexData*>(arg);
+  model->MarkDelete();
+  model->Unref();
+}
 #endif
+
+}  // namespace
+
+FileLearnedIndexData::ModelTable::ModelTable(int bits)
+    : bits(bits), used(0), slots(new ModelSlot[size_t(1) << bits]) {
+  for (size_t i = 0; i < (size_t(1) << bits); ++i) {
+    slots[i].number.store(kEmptySlot, std::memory_order_relaxed);
+    slots[i].model.store(nullptr, std::memory_order_relaxed);
+    slots[i].evicted_reads.store(-1, std::memory_order_relaxed);
+    slots[i].evicted_charge.store(0, std::memory_order_relaxed);
+  }
 }
 
-#if BOURBON_PLUS
-LearnedIndexData* FileLearnedIndexData::GetModelForLookup(int number) {
-  if (file_learned_index_data.size() <= number) return nullptr;
-  if (file_learned_index_data[number] == nullptr) return nullptr;
-  return file_learned_index_data[number];
+FileLearnedIndexData::ModelTable::~ModelTable() { delete[] slots; }
+
+FileLearnedIndexData::ModelSlot* FileLearnedIndexData::ModelTable::Find(uint64_t number) const {
+  // linear probing; the table is never more than half full
+  const size_t mask = (size_t(1) << bits) - 1;
+  for (size_t i = (number * 0x9E3779B97F4A7C15ull) >> (64 - bits); ; i = (i + 1) & mask) {
+    uint64_t n = slots[i].number.load(std::memory_order_acquire);
+    if (n == number) return &slots[i];
+    if (n == kEmptySlot) return nullptr;
+  }
+}
+
+void FileLearnedIndexData::DeleteTable(void* arg) {
+  // the models were handed over to the table replacing this one
+  delete reinterpret_cast<ModelTable*>(arg);
 }
+
+FileLearnedIndexData::FileLearnedIndexData()
+    : table(new ModelTable(6)), memory_usage(0), watermark(0) {}
+
+FileLearnedIndexData::ModelSlot* FileLearnedIndexData::Insert(uint64_t number) {
+  mutex.AssertHeld();
+  ModelTable* current = table.load(std::memory_order_relaxed);
+  ModelSlot* slot = current->Find(number);
+  if (slot != nullptr) return slot;
+
+  const size_t capacity = size_t(1) << current->bits;
+  if (2 * (current->used + 1) > capacity) {
+    // Slots of deleted files are never freed in place, so rebuild with only
+    // the files still in use and room to grow.
+    size_t live = 0;
+    for (size_t i = 0; i < capacity; ++i) {
+      ModelSlot& s = current->slots[i];
+      if (s.model.load(std::memory_order_relaxed) != nullptr ||
+          s.evicted_reads.load(std::memory_order_relaxed) >= 0) {
+        ++live;
+      }
+    }
+    int bits = 6;
+    while ((size_t(1) << bits) < 4 * (live + 1)) ++bits;
+    ModelTable* rebuilt = new ModelTable(bits);
+    for (size_t i = 0; i < capacity; ++i) {
+      ModelSlot& s = current->slots[i];
+      LearnedIndexData* model = s.model.load(std::memory_order_relaxed);
+      int evicted_reads = s.evicted_reads.load(std::memory_order_relaxed);
+      if (model == nullptr && evicted_reads < 0) continue;
+      const uint64_t n = s.number.load(std::memory_order_relaxed);
+      const size_t mask = (size_t(1) << bits) - 1;
+      size_t j = (n * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+      while (rebuilt->slots[j].number.load(std::memory_order_relaxed) != kEmptySlot) j = (j + 1) & mask;
+      ModelSlot& d = rebuilt->slots[j];
+      d.model.store(model, std::memory_order_relaxed);
+      d.evicted_reads.store(evicted_reads, std::memory_order_relaxed);
+      d.evicted_charge.store(s.evicted_charge.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      d.number.store(n, std::memory_order_relaxed);
+      ++rebuilt->used;
+    }
+    table.store(rebuilt, std::memory_order_release);
+    // readers still probing the old table only see models still alive or
+    // retired after it was replaced
+    Retire(&DeleteTable, current);
+    current = rebuilt;
+  }
+
+  const size_t mask = (size_t(1) << current->bits) - 1;
+  size_t i = (number * 0x9E3779B97F4A7C15ull) >> (64 - current->bits);
+  while (current->slots[i].number.load(std::memory_order_relaxed) != kEmptySlot) i = (i + 1) & mask;
+  ++current->used;
+  current->slots[i].number.store(number, std::memory_order_release);
+  return &current->slots[i];
+}
+
+LearnedIndexData* FileLearnedIndexData::GetModel(uint64_t number) {
+  leveldb::MutexLock l(&mutex);
+  ModelSlot* slot = Insert(number);
+  LearnedIndexData* model = slot->model.load(std::memory_order_relaxed);
+  if (model == nullptr) {
+    model = new LearnedIndexData(file_allowed_seek, false, number);
+    model->Ref();
+    slot->evicted_reads.store(-1, std::memory_order_relaxed);
+    slot->model.store(model, std::memory_order_release);
+  }
+  model->Ref();
+  return model;
+}
+
+void FileLearnedIndexData::InstallModel(uint64_t number, LearnedIndexData* model) {
+  model->file_number = number;
+  leveldb::MutexLock l(&mutex);
+  ModelSlot* slot = Insert(number);
+  if (slot->model.load(std::memory_order_relaxed) != nullptr) {
+    // a model already exists for this file; keep the one readers may be using
+    delete model;
+    return;
+  }
+  model->Ref();
+  model->persisted = true;
+  model->referenced.store(true, std::memory_order_relaxed);
+  model->charge = model->MemorySize();
+  memory_usage += model->charge;
+  slot->evicted_reads.store(-1, std::memory_order_relaxed);
+  slot->model.store(model, std::memory_order_release);
+  EvictColdModels();
+}
+
+void FileLearnedIndexData::UpdateCharge(LearnedIndexData* model) {
+  leveldb::MutexLock l(&mutex);
+  ModelSlot* slot = table.load(std::memory_order_relaxed)->Find(model->file_number);
+  if (slot == nullptr || slot->model.load(std::memory_order_relaxed) != model) return;
+  memory_usage -= model->charge;
+  model->charge = model->MemorySize();
+  memory_usage += model->charge;
+  EvictColdModels();
+}
+
+void FileLearnedIndexData::Remove(ModelSlot* slot, bool file_deleted) {
+  mutex.AssertHeld();
+  LearnedIndexData* model = slot->model.load(std::memory_order_relaxed);
+  memory_usage -= model->charge;
+  model->charge = 0;
+  slot->model.store(nullptr, std::memory_order_release);
+  // drop the reference of the registry once no lookup can be using it
+#if BOURBON_PLUS
+  if (file_deleted) {
+    Retire(&UnrefDeletedModel, model);
+    return;
+  }
 #endif
+  Retire(&UnrefModel, model);
+}
 
-bool FileLearnedIndexData::FillData(Version* version, FileMetaData* meta) {
-  LearnedIndexData* model = GetModel(meta->number);
-  return model->FillData(version, meta);
+void FileLearnedIndexData::EvictColdModels() {
+  mutex.AssertHeld();
+  if (model_memory_budget == 0 || memory_usage <= model_memory_budget) return;
+
+  // Make some room at once rather than evicting on every new model. The
+  // sweeps work as a CLOCK: a model read since the previous sweep is spared
+  // once. Models the table holds a copy of go first as they are cheap to get
+  // back; the others are lost until the file is learned again.
+  ModelTable* current = table.load(std::memory_order_relaxed);
+  const size_t capacity = size_t(1) << current->bits;
+  const size_t target = model_memory_budget - model_memory_budget / 10;
+  for (int pass = 0; pass < 4 && memory_usage > target; ++pass) {
+    const bool persisted_only = pass < 2;
+    for (size_t i = 0; i < capacity && memory_usage > target; ++i) {
+      ModelSlot* slot = &current->slots[i];
+      LearnedIndexData* model = slot->model.load(std::memory_order_relaxed);
+      if (model == nullptr || model->charge == 0 || (persisted_only && !model->persisted) ||
+          model->referenced.exchange(false, std::memory_order_relaxed)) {
+        continue;
+      }
+      if (model->persisted) {
+        slot->evicted_charge.store(model->charge, std::memory_order_relaxed);
+        slot->evicted_reads.store(0, std::memory_order_release);
+      }
+      Remove(slot, false);
+    }
+  }
 }
 
-std::vector<std::string>& FileLearnedIndexData::GetData(FileMetaData* meta) {
-  auto* model = GetModel(meta->number);
-  return model->string_keys;
+bool FileLearnedIndexData::HasModel(uint64_t number) {
+  leveldb::MutexLock l(&mutex);
+  ModelSlot* slot = table.load(std::memory_order_relaxed)->Find(number);
+  return slot != nullptr && slot->model.load(std::memory_order_relaxed) != nullptr;
 }
 
-bool FileLearnedIndexData::Learned(Version* version, FileMetaData* meta,
-                                   int level) {
-  LearnedIndexData* model = GetModel(meta->number);
-  return model->Learned(version, db->version_count, meta, level);
+bool FileLearnedIndexData::Evicted(uint64_t number) {
+  leveldb::MutexLock l(&mutex);
+  ModelSlot* slot = table.load(std::memory_order_relaxed)->Find(number);
+  return slot != nullptr && slot->evicted_reads.load(std::memory_order_relaxed) >= 0;
 }
 
-AccumulatedNumEntriesArray* FileLearnedIndexData::GetAccumulatedArray(
-    int file_num) {
-  auto* model = GetModel(file_num);
-  return &model->num_entries_accumulated;
+size_t FileLearnedIndexData::MemoryUsage() {
+  return memory_usage.load(std::memory_order_relaxed);
 }
 
-std::pair<uint64_t, uint64_t> FileLearnedIndexData::GetPosition(
-    const Slice& key, int file_num) {
-  return file_learned_index_data[file_num]->GetPosition(key);
+#if BOURBON_PLUS
+LearnedIndexData* FileLearnedIndexData::GetModelForLookup(uint64_t number, bool* reload) {
+  *reload = false;
+  ModelSlot* slot = table.load(std::memory_order_acquire)->Find(number);
+  if (slot == nullptr) return nullptr;
+  LearnedIndexData* model = slot->model.load(std::memory_order_acquire);
+  if (model != nullptr) {
+    // skip the store when possible to keep the line shared among readers
+    if (!model->referenced.load(std::memory_order_relaxed)) {
+      model->referenced.store(true, std::memory_order_relaxed);
+    }
+    return model;
+  }
+  if (slot->evicted_reads.load(std::memory_order_acquire) < 0) return nullptr;
+  // A file read only now and then is served fine by its index block. Only
+  // new models make room, so that a budget too small for the models of all
+  // the files read does not keep evicting and reloading them.
+  *reload = slot->evicted_reads.fetch_add(1, std::memory_order_relaxed) + 1 >= file_allowed_seek &&
+            memory_usage.load(std::memory_order_relaxed) +
+            slot->evicted_charge.load(std::memory_order_relaxed) <= model_memory_budget;
+  return nullptr;
 }
+#endif
 
 FileLearnedIndexData::~FileLearnedIndexData() {
-  leveldb::MutexLock l(&mutex);
-  for (auto pointer : file_learned_index_data) {
-		if (pointer != nullptr) delete pointer;
+  ModelTable* current = table.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < (size_t(1) << current->bits); ++i) {
+    LearnedIndexData* model = current->slots[i].model.load(std::memory_order_relaxed);
+    if (model != nullptr) model->Unref();
   }
+  delete current;
+  // free the models and tables retired by this registry
+  ReclaimRetired();
 }
 
 void FileLearnedIndexData::Report() {
@@ -446,13 +607,30 @@ void FileLearnedIndexData::Report() {
   std::set<uint64_t> live_files;
   //koo::db->versions_->AddLiveFiles(&live_files);
 
-  for (size_t i = 0; i < file_learned_index_data.size(); ++i) {
-    auto pointer = file_learned_index_data[i];
-    if (pointer != nullptr && pointer->cost != 0) {
-      printf("FileModel %lu %d ", i, i > watermark);
+  ModelTable* current = table.load(std::memory_order_relaxed);
+  std::vector<std::pair<uint64_t, LearnedIndexData*>> entries;
+  size_t evicted = 0;
+  for (size_t i = 0; i < (size_t(1) << current->bits); ++i) {
+    ModelSlot& slot = current->slots[i];
+    LearnedIndexData* model = slot.model.load(std::memory_order_relaxed);
+    if (model != nullptr) {
+      entries.emplace_back(slot.number.load(std::memory_order_relaxed), model);
+    } else if (slot.evicted_reads.load(std::memory_order_relaxed) >= 0) {
+      ++evicted;
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  size_t bypassed = 0;
+  for (auto& entry : entries) {
+    LearnedIndexData* pointer = entry.second;
+    if (pointer->Bypassed()) ++bypassed;
+    if (pointer->cost != 0) {
+      printf("FileModel %lu %d ", entry.first, entry.first > watermark);
       pointer->ReportStats();
     }
   }
+  printf("FileModels %lu %lu bytes, %lu evicted, %lu bypassed\n", entries.size(), memory_usage.load(),
+         evicted, bypassed);
 }
 
 void AccumulatedNumEntriesArray::Add(uint64_t num_entries, string&& key) {
@@ -463,54 +641,29 @@ bool AccumulatedNumEntriesArray::Search(const Slice& key, uint64_t lower,
                                         uint64_t upper, size_t* index,
                                         uint64_t* relative_lower,
                                         uint64_t* relative_upper) {
-  if (koo::MOD == 4) {
-    uint64_t lower_pos = lower / array[0].first;
-    uint64_t upper_pos = upper / array[0].first;
-    if (lower_pos != upper_pos) {
-      while (true) {
-        if (lower_pos >= array.size()) return false;
-        //if (key <= array[lower_pos].second) break;
-        lower = array[lower_pos].first;
-        ++lower_pos;
-      }
-      upper = std::min(upper, array[lower_pos].first - 1);
-      *index = lower_pos;
-      *relative_lower =
-          lower_pos > 0 ? lower - array[lower_pos - 1].first : lower;
-      *relative_upper =
-          lower_pos > 0 ? upper - array[lower_pos - 1].first : upper;
-      return true;
-    }
-    *index = lower_pos;
-    *relative_lower = lower % array[0].first;
-    *relative_upper = upper % array[0].first;
-    return true;
-
-  } else {
-    size_t left = 0, right = array.size() - 1;
-    while (left < right) {
-      size_t mid = (left + right) / 2;
-      if (lower < array[mid].first)
-        right = mid;
-      else
-        left = mid + 1;
-    }
-
-    if (upper >= array[left].first) {
-      while (true) {
-        if (left >= array.size()) return false;
-        //if (key <= array[left].second) break;
-        lower = array[left].first;
-        ++left;
-      }
-      upper = std::min(upper, array[left].first - 1);
-    }
+  // first file whose accumulated count covers lower
+  size_t left = 0, right = array.size();
+  while (left < right) {
+    size_t mid = (left + right) / 2;
+    if (lower < array[mid].first)
+      right = mid;
+    else
+      left = mid + 1;
+  }
+  if (left >= array.size()) return false;
 
-    *index = left;
-    *relative_lower = left > 0 ? lower - array[left - 1].first : lower;
-    *relative_upper = left > 0 ? upper - array[left - 1].first : upper;
-    return true;
+  // the interval runs into the next files: their largest keys tell where the key is
+  while (upper >= array[left].first && key.compare(array[left].second) > 0) {
+    lower = array[left].first;
+    if (++left >= array.size()) return false;
   }
+  upper = std::min(upper, array[left].first - 1);
+
+  uint64_t base = left > 0 ? array[left - 1].first : 0;
+  *index = left;
+  *relative_lower = lower - base;
+  *relative_upper = upper - base;
+  return true;
 }
 
 bool AccumulatedNumEntriesArray::SearchNoError(uint64_t position, size_t* index,
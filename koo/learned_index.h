@@ -8,9 +8,11 @@
 
 #include <vector>
 #include <cstring>
+#include <memory>
+#include <unordered_map>
 #include "koo/util.h"
 #include <atomic>
-#include "koo/plr.h"
+#include "koo/file_model.h"
 #include "koo/koo.h"
 #include "port/port.h"
 
@@ -49,7 +51,8 @@ namespace koo {
     public:
         Version* version;
         int v_count;
-        LearnedIndexData* self;
+        // the level may get a new model before the job is done with this one
+        std::shared_ptr<LearnedIndexData> self;
         int level;
     };
 
@@ -66,20 +69,31 @@ namespace koo {
     class LearnedIndexData {
         friend class leveldb::Version;
         friend class leveldb::VersionSet;
+        friend class FileLearnedIndexData;
     private:
         // predefined model error
         double error;
         // some flags used in online learning to control the state of the model
         std::atomic<bool> learned;
         std::atomic<bool> aborted;
-        bool learned_not_atomic;
         std::atomic<bool> learning;
         // some params for level triggering policy, deprecated
         int allowed_seek;
-        int current_seek;
+        std::atomic<int> current_seek;
 				bool deleted_not_atomic;
 				std::atomic<bool> deleted;
 				port::Mutex mutex_delete_;
+        // model of the kind chosen for the level, null until training starts
+        FileModel* file_model;
+        // file models are shared by FileLearnedIndexData and the reads and
+        // learning jobs using them; the last Unref() deletes the model
+        std::atomic<int> refs;
+        // set by reads, cleared by the eviction sweep of FileLearnedIndexData
+        std::atomic<bool> referenced;
+        // the table holds a copy in its learned_index block
+        bool persisted;
+        // bytes accounted for this model in FileLearnedIndexData
+        size_t charge;
     public:
 				uint64_t file_number;
         // is the data of this model filled (ready for learning)
@@ -87,17 +101,19 @@ namespace koo {
         // is this a level model
         bool is_level;
 
-        // Learned linear segments and some other data needed
-        std::vector<Segment> string_segments;
+        // Bounds of the keys learned. The model sees keys relative to min_key,
+        // taken after the prefix shared by all keys.
         uint64_t min_key;
         uint64_t max_key;
         uint64_t size;
+        size_t prefix_length;
+        // some keys map to the same integer as the key before them, so their
+        // positions are not covered by the error bound
+        bool has_ties;
 
 
 
     public:
-        // all keys in the file/level to be leraned from
-        std::vector<std::string> string_keys;
         // only used in level models
         AccumulatedNumEntriesArray num_entries_accumulated;
 
@@ -105,25 +121,35 @@ namespace koo {
         mutable int served;
         uint64_t cost;
 
-//        int num_neg_model = 0, num_pos_model = 0, num_neg_baseline = 0, num_pos_baseline = 0;
-//        uint64_t time_neg_model = 0, time_pos_model = 0, time_neg_baseline = 0, time_pos_baseline = 0;
-//
-//        int num_neg_model_p = 0, num_pos_model_p = 0, num_neg_baseline_p = 0, num_pos_baseline_p = 0, num_files_p = 0;
-//        uint64_t time_neg_model_p = 0, time_pos_model_p = 0, time_neg_baseline_p = 0, time_pos_baseline_p = 0;
-//        double gain_p = 0;
-//        uint64_t file_size = 0;
-
-
-
+        // Shadow lookups: lookups of this file timed both through the model
+        // and through the index block, and the nanoseconds the model saved
+        // over all of them (negative if it lost)
+        std::atomic<uint32_t> shadow_samples;
+        std::atomic<int64_t> shadow_gain;
+        // Lookups skip a model that lost to the index block over the last
+        // kBypassWindow shadow lookups, until it wins over the next ones:
+        // the shadow lookups go on either way
+        static const uint32_t kBypassWindow = 32;
+        std::atomic<bool> bypass;
+        port::Mutex shadow_mutex_;
+        uint32_t window_samples;
+        int64_t window_gain;
 
         explicit LearnedIndexData(int allowed_seek, bool level_model) : error(level_model?level_model_error:LEARN_MODEL_ERROR), learned(false), aborted(false), learning(false),
 						deleted(false), deleted_not_atomic(false),
-            learned_not_atomic(false), allowed_seek(allowed_seek), current_seek(0), filled(false), is_level(level_model), level(0), served(0), cost(0) {};
+            allowed_seek(allowed_seek), current_seek(0), file_model(nullptr), refs(0), referenced(false), persisted(false), charge(0), filled(false), is_level(level_model), min_key(0), max_key(0), size(0), prefix_length(0), has_ties(false), level(0), served(0), cost(0), shadow_samples(0), shadow_gain(0), bypass(false), window_samples(0), window_gain(0) {};
 
         explicit LearnedIndexData(int allowed_seek, bool level_model, uint64_t number) : error(level_model?level_model_error:LEARN_MODEL_ERROR), file_number(number), learned(false), aborted(false), learning(false),
 						deleted(false), deleted_not_atomic(false),
-            learned_not_atomic(false), allowed_seek(allowed_seek), current_seek(0), filled(false), is_level(level_model), level(0), served(0), cost(0) {};
+            allowed_seek(allowed_seek), current_seek(0), file_model(nullptr), refs(0), referenced(false), persisted(false), charge(0), filled(false), is_level(level_model), min_key(0), max_key(0), size(0), prefix_length(0), has_ties(false), level(0), served(0), cost(0), shadow_samples(0), shadow_gain(0), bypass(false), window_samples(0), window_gain(0) {};
         LearnedIndexData(const LearnedIndexData& other) = delete;
+        void Ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+        // Whether the file of the model was deleted, so that learning it is
+        // wasted work
+        bool Aborted() const { return aborted.load(std::memory_order_relaxed); }
+        void Unref() {
+          if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+        }
 #if BOURBON_PLUS
 				~LearnedIndexData();
 				bool Deleted();
@@ -137,49 +163,116 @@ namespace koo {
         std::pair<uint64_t, uint64_t> GetPosition(const Slice& key) const;
         uint64_t MaxPosition() const;
         double GetError() const;
+        // Kind, pieces and bytes of the trained model
+        ModelType GetModelType() const;
+        size_t NumSegments() const;
+        size_t MemorySize() const;
         
-        // Learning function and checker (check if this model is available)
-        bool Learn();
+        // Learning checkers (check if this model is available) and triggers
         bool Learned();
         bool Learned(Version* version, int v_count, int level);
         bool Learned(Version* version, int v_count, FileMetaData* meta, int level);
-        static void LevelLearn(void* arg, bool no_lock=false);
+        static void LevelLearn(void* arg);
         static uint64_t FileLearn(void* arg);
 
-        // Load all the keys in the file/level
+        // Streaming learning: keys are fed one by one, while the table is being
+        // built or by FillData(), and FinishOnlineLearn() turns them into a usable
+        // model. SetKeyRange() may be called first with bounds of the keys to come
+        // to strip their shared prefix. The kind of model is taken from
+        // model_types[level] on the first key.
+        void SetKeyRange(const Slice& smallest, const Slice& largest);
+        void AddKey(const Slice& key);
+        bool FinishOnlineLearn();
+
+        // Feed all the keys of the file to a fresh model, bypassing the block cache
         bool FillData(Version* version, FileMetaData* meta);
 
-        // writing this model to disk and load this model from disk
-        void WriteModel(const string& filename);
-        void ReadModel(const string& filename);
+        // serialize this model into the learned_index block of its table and load it back
+        void EncodeTo(std::string* dst) const;
+        bool DecodeFrom(const Slice& src);
         
         // print model stats
         void ReportStats();
 
-        // test functions when developing CBA...
-        void FillCBAStat(bool positive, bool model, uint64_t time);
+        // Record a shadow lookup that took baseline_time nanoseconds through
+        // the index block and model_time through the model
+        void AddShadowSample(uint64_t baseline_time, uint64_t model_time);
+        // Nanoseconds the model saved per shadow lookup, 0 before any
+        double ShadowGain() const;
+        // Whether lookups should go through the index block instead of the
+        // model, which was slower for this file lately
+        bool Bypassed() const { return bypass.load(std::memory_order_relaxed); }
 
         bool Learn(bool file);
     };
 
-    // an array storing all file models and provide similar access interface with multithread protection
+    // The models of the live table files, keyed by file number. A model leaves
+    // when its table is deleted. Learned models are charged by their size, and
+    // above model_memory_budget the coldest ones are evicted, those with a copy
+    // in their table first: that copy is loaded back once the file is read
+    // file_allowed_seek times again and there is room for it.
+    //
+    // Lookups take no lock: the models are kept in an open-addressing table
+    // that writers update under the mutex and replace when it fills up, and
+    // removed models and replaced tables are freed through koo::Retire(). A
+    // model returned by GetModelForLookup() stays valid as long as the caller
+    // holds the koo::EpochGuard it was looked up under. Models returned by
+    // GetModel() are referenced and must be released with Unref().
     class FileLearnedIndexData {
     private:
+        struct ModelSlot {
+          // kEmptySlot until taken, then never changes
+          std::atomic<uint64_t> number;
+          // null once removed or evicted
+          std::atomic<LearnedIndexData*> model;
+          // reads since the model was evicted, -1 unless it was evicted and
+          // can be read back from the table
+          std::atomic<int> evicted_reads;
+          std::atomic<size_t> evicted_charge;
+        };
+        struct ModelTable {
+          explicit ModelTable(int bits);
+          ~ModelTable();
+          ModelSlot* Find(uint64_t number) const;
+          int bits;
+          size_t used;  // slots taken, including the ones now unused
+          ModelSlot* slots;
+        };
+        static const uint64_t kEmptySlot = ~0ull;
+
         leveldb::port::Mutex mutex;
-        std::vector<LearnedIndexData*> file_learned_index_data;
+        std::atomic<ModelTable*> table;
+        std::atomic<size_t> memory_usage;
+
+        // Slot of the file in the current table, taken if absent
+        ModelSlot* Insert(uint64_t number);
+        // Take the model out of its slot, releasing it once no lookup can see
+        // it; file_deleted also frees its segments before the last Unref()
+        void Remove(ModelSlot* slot, bool file_deleted);
+        static void DeleteTable(void* arg);
+        // Move models out until memory_usage fits the budget again
+        void EvictColdModels();
     public:
         uint64_t watermark;
 
-
-        bool Learned(Version* version, FileMetaData* meta, int level);
-        bool FillData(Version* version, FileMetaData* meta);
-        std::vector<std::string>& GetData(FileMetaData* meta);
-        std::pair<uint64_t, uint64_t> GetPosition(const Slice& key, int file_num);
-        AccumulatedNumEntriesArray* GetAccumulatedArray(int file_num);
-        LearnedIndexData* GetModel(int number);
+        FileLearnedIndexData();
+        // Model of the file, created empty for learning if there is none
+        LearnedIndexData* GetModel(uint64_t number);
+        // Take ownership of a model trained while its table was written or read
+        // from its table.
+        void InstallModel(uint64_t number, LearnedIndexData* model);
+        // Account for a model that finished learning
+        void UpdateCharge(LearnedIndexData* model);
+        bool HasModel(uint64_t number);
+        // Whether the model of the file was evicted and its table has a copy
+        bool Evicted(uint64_t number);
+        size_t MemoryUsage();
 #if BOURBON_PLUS
-        LearnedIndexData* GetModelForLookup(int number);
-				void DeleteModel(int number);
+        // Model of the file if there is one, null otherwise. Must be called
+        // under a koo::EpochGuard. When the file has no model, *reload tells
+        // whether its evicted model is wanted back.
+        LearnedIndexData* GetModelForLookup(uint64_t number, bool* reload);
+				void DeleteModel(uint64_t number);
 #endif
         void Report();
         ~FileLearnedIndexData();
@@ -0,0 +1,218 @@
+// Checks that FileLearnedIndexData frees the models of deleted files, keeps
+// the learned ones within model_memory_budget and serves lookups without
+// locks while models come and go.
+
+#include "koo/learned_index.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "koo/epoch.h"
+#include "util/coding.h"
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace koo {
+
+class FileLearnedIndexDataTest {
+ public:
+  FileLearnedIndexDataTest() { model_memory_budget = 0; }
+  ~FileLearnedIndexDataTest() { model_memory_budget = 0; }
+};
+
+// Feeds n distinct, increasingly spread 8-byte keys to the model.
+static void Train(LearnedIndexData* model, int n) {
+  char buf[8];
+  for (int i = 0; i < n; i++) {
+    // big-endian so that keys sort as integers
+    uint64_t key = __builtin_bswap64(static_cast<uint64_t>(i) * i * 7);
+    leveldb::EncodeFixed64(buf, key);
+    model->AddKey(Slice(buf, 8));
+  }
+  ASSERT_TRUE(model->FinishOnlineLearn());
+}
+
+static LearnedIndexData* NewTrainedModel(uint64_t number, int n) {
+  LearnedIndexData* model = new LearnedIndexData(file_allowed_seek, false, number);
+  Train(model, n);
+  return model;
+}
+
+TEST(FileLearnedIndexDataTest, DeleteReclaims) {
+  FileLearnedIndexData registry;
+  registry.InstallModel(5, NewTrainedModel(5, 1000));
+  registry.InstallModel(1000000, NewTrainedModel(1000000, 1000));
+  ASSERT_TRUE(registry.HasModel(5));
+  ASSERT_TRUE(registry.MemoryUsage() > 0);
+
+  // a reader keeps the model alive past the deletion of its file
+  {
+    EpochGuard guard;
+    bool reload;
+    LearnedIndexData* model = registry.GetModelForLookup(5, &reload);
+    ASSERT_TRUE(model != nullptr);
+    registry.DeleteModel(5);
+    ASSERT_TRUE(!registry.HasModel(5));
+    ASSERT_TRUE(registry.GetModelForLookup(5, &reload) == nullptr);
+    ASSERT_TRUE(!reload);
+    ASSERT_TRUE(model->Learned());
+    ASSERT_TRUE(NumRetired() > 0);
+  }
+  SynchronizeEpochs();
+
+  registry.DeleteModel(1000000);
+  ASSERT_EQ(registry.MemoryUsage(), 0u);
+  registry.DeleteModel(1000000);
+  registry.DeleteModel(7);
+}
+
+TEST(FileLearnedIndexDataTest, DeleteAbortsLearning) {
+  FileLearnedIndexData registry;
+  // as taken by a learning job
+  LearnedIndexData* model = registry.GetModel(9);
+  ASSERT_TRUE(!model->Aborted());
+  registry.DeleteModel(9);
+  ASSERT_TRUE(model->Aborted());
+  model->Unref();
+}
+
+TEST(FileLearnedIndexDataTest, ShadowGain) {
+  LearnedIndexData* model = NewTrainedModel(7, 1000);
+  ASSERT_EQ(model->ShadowGain(), 0.0);
+  model->AddShadowSample(1000, 600);
+  model->AddShadowSample(1000, 1200);
+  ASSERT_EQ(model->ShadowGain(), 100.0);
+  model->AddShadowSample(300, 1000);
+  ASSERT_TRUE(model->ShadowGain() < 0);
+  delete model;
+}
+
+TEST(FileLearnedIndexDataTest, BypassSlowModel) {
+  LearnedIndexData* model = NewTrainedModel(7, 1000);
+  ASSERT_TRUE(!model->Bypassed());
+  // decided once per window, on the window alone
+  for (uint32_t i = 0; i < LearnedIndexData::kBypassWindow - 1; i++) {
+    model->AddShadowSample(500, 800);
+  }
+  ASSERT_TRUE(!model->Bypassed());
+  model->AddShadowSample(500, 800);
+  ASSERT_TRUE(model->Bypassed());
+  // still probed while bypassed, and back once the model wins again
+  for (uint32_t i = 0; i < LearnedIndexData::kBypassWindow; i++) {
+    model->AddShadowSample(800, 500);
+  }
+  ASSERT_TRUE(!model->Bypassed());
+  delete model;
+}
+
+TEST(FileLearnedIndexDataTest, DuplicateInstall) {
+  FileLearnedIndexData registry;
+  registry.InstallModel(3, NewTrainedModel(3, 100));
+  size_t usage = registry.MemoryUsage();
+  registry.InstallModel(3, NewTrainedModel(3, 5000));
+  ASSERT_EQ(registry.MemoryUsage(), usage);
+}
+
+TEST(FileLearnedIndexDataTest, StaysWithinBudget) {
+  FileLearnedIndexData registry;
+  LearnedIndexData* probe = NewTrainedModel(0, 2000);
+  const size_t model_size = probe->MemorySize();
+  delete probe;
+  model_memory_budget = 10 * model_size;
+
+  // models learned after their table was written have no copy to reload
+  for (uint64_t number = 1000; number < 1003; number++) {
+    LearnedIndexData* model = registry.GetModel(number);
+    Train(model, 2000);
+    registry.UpdateCharge(model);
+    model->Unref();
+  }
+  for (uint64_t number = 1; number <= 50; number++) {
+    registry.InstallModel(number, NewTrainedModel(number, 2000));
+    ASSERT_TRUE(registry.MemoryUsage() <= model_memory_budget);
+  }
+
+  int resident = 0, evicted = 0;
+  for (uint64_t number = 1; number <= 50; number++) {
+    if (registry.HasModel(number)) {
+      resident++;
+      ASSERT_TRUE(!registry.Evicted(number));
+    } else {
+      evicted++;
+      ASSERT_TRUE(registry.Evicted(number));
+    }
+  }
+  ASSERT_EQ(resident + evicted, 50);
+  ASSERT_TRUE(evicted > 0);
+  // the models that cannot be reloaded go last
+  for (uint64_t number = 1000; number < 1003; number++) {
+    ASSERT_TRUE(registry.HasModel(number));
+  }
+
+  // an evicted model comes back once read from its table again
+  uint64_t victim = 1;
+  while (registry.HasModel(victim)) victim++;
+  {
+    EpochGuard guard;
+    bool reload = false;
+    for (int i = 0; i < file_allowed_seek && !reload; i++) {
+      ASSERT_TRUE(registry.GetModelForLookup(victim, &reload) == nullptr);
+    }
+    ASSERT_TRUE(reload);
+  }
+  registry.InstallModel(victim, NewTrainedModel(victim, 2000));
+  ASSERT_TRUE(registry.HasModel(victim));
+  ASSERT_TRUE(!registry.Evicted(victim));
+
+  // deleting the file forgets the evicted model
+  while (registry.HasModel(victim)) victim++;
+  registry.DeleteModel(victim);
+  ASSERT_TRUE(!registry.Evicted(victim));
+}
+
+// Lookups racing with installs, deletions and evictions, enough of them to
+// rebuild the table several times.
+TEST(FileLearnedIndexDataTest, ConcurrentLookups) {
+  FileLearnedIndexData registry;
+  LearnedIndexData* probe = NewTrainedModel(0, 200);
+  model_memory_budget = 20 * probe->MemorySize();
+  delete probe;
+
+  std::atomic<uint64_t> next(1);
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> found(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&registry, &next, &done, &found, t] {
+      leveldb::Random rnd(t + 1);
+      while (!done.load(std::memory_order_relaxed)) {
+        EpochGuard guard;
+        uint64_t last = next.load(std::memory_order_relaxed);
+        uint64_t number = last - rnd.Uniform(last > 64 ? 64 : last);
+        bool reload;
+        LearnedIndexData* model = registry.GetModelForLookup(number, &reload);
+        if (model != nullptr && model->Learned()) {
+          ASSERT_EQ(model->file_number, number);
+          ASSERT_TRUE(model->MemorySize() > 0);
+          found.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 3000; i++) {
+    uint64_t number = next.load(std::memory_order_relaxed);
+    registry.InstallModel(number, NewTrainedModel(number, 200));
+    next.store(number + 1, std::memory_order_relaxed);
+    if (number > 32) registry.DeleteModel(number - 32);
+  }
+  done.store(true);
+  for (std::thread& reader : readers) reader.join();
+  ASSERT_TRUE(found.load() > 0);
+  ASSERT_TRUE(registry.MemoryUsage() <= model_memory_budget);
+}
+
+}  // namespace koo
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
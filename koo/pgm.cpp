@@ -0,0 +1,299 @@
+//
+// PGM-index style model, after https://github.com/gvinciguerra/PGM-index
+
+#include "koo/pgm.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "util/coding.h"
+
+namespace koo {
+
+namespace {
+
+typedef OptimalPLA::Point Point;
+
+// Direction from b to a, compared as slopes of vectors sharing the sign of x
+struct Slope {
+    __int128 dx;
+    __int128 dy;
+    bool operator<(const Slope& p) const { return dy * p.dx < dx * p.dy; }
+    bool operator>(const Slope& p) const { return dy * p.dx > dx * p.dy; }
+};
+
+Slope operator-(const Point& a, const Point& b) {
+    return Slope{a.x - b.x, a.y - b.y};
+}
+
+__int128 Cross(const Point& o, const Point& a, const Point& b) {
+    Slope oa = a - o, ob = b - o;
+    return oa.dx * ob.dy - oa.dy * ob.dx;
+}
+
+// error allowed when indexing the first keys of the level below
+const uint64_t kRecursiveError = 4;
+
+}  // namespace
+
+OptimalPLA::OptimalPLA(uint64_t epsilon)
+    : epsilon(epsilon), first_x(0), points_in_hull(0), lower_start(0), upper_start(0) {}
+
+bool OptimalPLA::Add(uint64_t x, uint64_t y) {
+    Point p1{x, (__int128) y + epsilon};
+    Point p2{x, (__int128) y - epsilon};
+
+    if (points_in_hull == 0) {
+        first_x = x;
+        rectangle[0] = p1;
+        rectangle[1] = p2;
+        upper.clear();
+        lower.clear();
+        upper.push_back(p1);
+        lower.push_back(p2);
+        upper_start = lower_start = 0;
+        ++points_in_hull;
+        return true;
+    }
+
+    if (points_in_hull == 1) {
+        rectangle[2] = p2;
+        rectangle[3] = p1;
+        upper.push_back(p1);
+        lower.push_back(p2);
+        ++points_in_hull;
+        return true;
+    }
+
+    Slope slope1 = rectangle[2] - rectangle[0];
+    Slope slope2 = rectangle[3] - rectangle[1];
+    bool outside_line1 = p1 - rectangle[2] < slope1;
+    bool outside_line2 = p2 - rectangle[3] > slope2;
+    if (outside_line1 || outside_line2) {
+        points_in_hull = 0;
+        return false;
+    }
+
+    if (p1 - rectangle[1] < slope2) {
+        // the steepest line now ends at p1: find where it starts on the lower hull
+        Slope min = lower[lower_start] - p1;
+        size_t min_i = lower_start;
+        for (size_t i = lower_start + 1; i < lower.size(); i++) {
+            Slope val = lower[i] - p1;
+            if (val > min) break;
+            min = val;
+            min_i = i;
+        }
+        rectangle[1] = lower[min_i];
+        rectangle[3] = p1;
+        lower_start = min_i;
+
+        size_t end = upper.size();
+        for (; end >= upper_start + 2 && Cross(upper[end - 2], upper[end - 1], p1) <= 0; --end) {
+        }
+        upper.resize(end);
+        upper.push_back(p1);
+    }
+
+    if (p2 - rectangle[0] > slope1) {
+        // the flattest line now ends at p2: find where it starts on the upper hull
+        Slope max = upper[upper_start] - p2;
+        size_t max_i = upper_start;
+        for (size_t i = upper_start + 1; i < upper.size(); i++) {
+            Slope val = upper[i] - p2;
+            if (val < max) break;
+            max = val;
+            max_i = i;
+        }
+        rectangle[0] = upper[max_i];
+        rectangle[2] = p2;
+        upper_start = max_i;
+
+        size_t end = lower.size();
+        for (; end >= lower_start + 2 && Cross(lower[end - 2], lower[end - 1], p2) >= 0; --end) {
+        }
+        lower.resize(end);
+        lower.push_back(p2);
+    }
+
+    ++points_in_hull;
+    return true;
+}
+
+void OptimalPLA::GetSegment(double* slope, double* intercept) const {
+    if (points_in_hull == 1) {
+        *slope = 0;
+        *intercept = (double) ((rectangle[0].y + rectangle[1].y) / 2);
+        return;
+    }
+
+    // Every line through the crossing of the flattest and the steepest line
+    // with a slope between theirs fits; take the middle one.
+    const Point& p0 = rectangle[0];
+    const Point& p1 = rectangle[1];
+    const Point& p2 = rectangle[2];
+    const Point& p3 = rectangle[3];
+    Slope slope1 = p2 - p0;
+    Slope slope2 = p3 - p1;
+    long double min_slope = (long double) slope1.dy / (long double) slope1.dx;
+    long double max_slope = (long double) slope2.dy / (long double) slope2.dx;
+    long double i_x, i_y;
+    __int128 a = slope1.dx * slope2.dy - slope1.dy * slope2.dx;
+    if (a == 0) {
+        i_x = (long double) p0.x;
+        i_y = (long double) p0.y;
+    } else {
+        Slope p0p1 = p1 - p0;
+        long double b = (long double) (p0p1.dx * slope2.dy - p0p1.dy * slope2.dx) / (long double) a;
+        i_x = (long double) p0.x + b * (long double) slope1.dx;
+        i_y = (long double) p0.y + b * (long double) slope1.dy;
+    }
+    long double mid_slope = (min_slope + max_slope) / 2;
+    *slope = (double) mid_slope;
+    *intercept = (double) (i_y - (i_x - (long double) first_x) * mid_slope);
+}
+
+PGMModel::PGMModel(double error)
+    : error(error), pla(nullptr), num_positions(0), num_distinct(0), last_key(0), segment_first(0) {}
+
+PGMModel::~PGMModel() {
+    delete pla;
+}
+
+void PGMModel::Add(uint64_t key) {
+    uint64_t position = num_positions++;
+    if (num_distinct != 0 && key == last_key) return;
+    if (pla == nullptr) {
+        pla = new OptimalPLA((uint64_t) std::ceil(error));
+        levels.resize(1);
+    }
+    if (!pla->Add(key, position)) {
+        PGMSegment s{pla->FirstX(), segment_first, 0, 0};
+        pla->GetSegment(&s.slope, &s.intercept);
+        levels[0].push_back(s);
+        pla->Add(key, position);
+        segment_first = position;
+    }
+    last_key = key;
+    ++num_distinct;
+}
+
+bool PGMModel::Finish() {
+    if (pla == nullptr) return false;
+    PGMSegment s{pla->FirstX(), segment_first, 0, 0};
+    pla->GetSegment(&s.slope, &s.intercept);
+    levels[0].push_back(s);
+    delete pla;
+    pla = nullptr;
+    levels[0].shrink_to_fit();
+    BuildUpperLevels();
+    return true;
+}
+
+void PGMModel::BuildLevel(uint64_t epsilon, const std::vector<PGMSegment>& below,
+                          std::vector<PGMSegment>* result) {
+    OptimalPLA level_pla(epsilon);
+    uint64_t first = 0;
+    for (uint64_t j = 0; j < below.size(); ++j) {
+        if (!level_pla.Add(below[j].key, j)) {
+            PGMSegment s{level_pla.FirstX(), first, 0, 0};
+            level_pla.GetSegment(&s.slope, &s.intercept);
+            result->push_back(s);
+            level_pla.Add(below[j].key, j);
+            first = j;
+        }
+    }
+    PGMSegment s{level_pla.FirstX(), first, 0, 0};
+    level_pla.GetSegment(&s.slope, &s.intercept);
+    result->push_back(s);
+    result->shrink_to_fit();
+}
+
+void PGMModel::BuildUpperLevels() {
+    levels.resize(1);
+    while (levels.back().size() > 1) {
+        std::vector<PGMSegment> level;
+        BuildLevel(kRecursiveError, levels.back(), &level);
+        levels.push_back(std::move(level));
+    }
+}
+
+void PGMModel::Predict(uint64_t x, double* lower, double* upper) const {
+    size_t i = 0;
+    for (size_t l = levels.size() - 1; l > 0; --l) {
+        const std::vector<PGMSegment>& level = levels[l];
+        const std::vector<PGMSegment>& below = levels[l - 1];
+        const PGMSegment& s = level[i];
+        // past the last key of a segment its line may run into the next one
+        double limit = i + 1 < level.size() ? level[i + 1].first : below.size();
+        double p = x > s.key ? std::min(std::max(s.Evaluate(x), (double) s.first), limit) : s.first;
+
+        // last segment of the level below starting at or before x
+        size_t lo = p > kRecursiveError + 1 ? (size_t) std::floor(p - kRecursiveError - 1) : 0;
+        size_t hi = std::min((size_t) std::ceil(p + kRecursiveError) + 1, below.size());
+        auto it = std::upper_bound(below.begin() + lo, below.begin() + hi, x,
+                                   [](uint64_t key, const PGMSegment& seg) { return key < seg.key; });
+        i = it == below.begin() + lo ? lo : (it - below.begin()) - 1;
+    }
+    const PGMSegment& leaf = levels[0][i];
+    double estimate = x > leaf.key ? leaf.Evaluate(x) : leaf.intercept;
+    *lower = estimate - error;
+    *upper = estimate + error;
+}
+
+void PGMModel::EncodeTo(std::string* dst) const {
+    const std::vector<PGMSegment>& leaves = levels[0];
+    leveldb::PutVarint64(dst, leaves.size());
+    uint64_t prev_key = 0, prev_first = 0;
+    for (const PGMSegment& s : leaves) {
+        uint64_t slope, intercept;
+        memcpy(&slope, &s.slope, sizeof(double));
+        memcpy(&intercept, &s.intercept, sizeof(double));
+        leveldb::PutVarint64(dst, s.key - prev_key);
+        leveldb::PutVarint64(dst, s.first - prev_first);
+        leveldb::PutFixed64(dst, slope);
+        leveldb::PutFixed64(dst, intercept);
+        prev_key = s.key;
+        prev_first = s.first;
+    }
+}
+
+bool PGMModel::DecodeFrom(leveldb::Slice* input) {
+    uint64_t num_segments;
+    if (!leveldb::GetVarint64(input, &num_segments) || num_segments == 0) return false;
+    std::vector<PGMSegment> leaves;
+    leaves.reserve(num_segments);
+    uint64_t key = 0, first = 0;
+    for (uint64_t i = 0; i < num_segments; ++i) {
+        uint64_t key_diff, first_diff;
+        if (!leveldb::GetVarint64(input, &key_diff) || !leveldb::GetVarint64(input, &first_diff) ||
+            input->size() < 2 * sizeof(uint64_t)) {
+            return false;
+        }
+        key += key_diff;
+        first += first_diff;
+        uint64_t slope = leveldb::DecodeFixed64(input->data());
+        uint64_t intercept = leveldb::DecodeFixed64(input->data() + sizeof(uint64_t));
+        input->remove_prefix(2 * sizeof(uint64_t));
+        PGMSegment s{key, first, 0, 0};
+        memcpy(&s.slope, &slope, sizeof(double));
+        memcpy(&s.intercept, &intercept, sizeof(double));
+        leaves.push_back(s);
+    }
+    levels.clear();
+    levels.push_back(std::move(leaves));
+    BuildUpperLevels();
+    return true;
+}
+
+size_t PGMModel::MemorySize() const {
+    size_t bytes = levels.capacity() * sizeof(std::vector<PGMSegment>);
+    for (const std::vector<PGMSegment>& level : levels) bytes += level.capacity() * sizeof(PGMSegment);
+    return bytes;
+}
+
+size_t PGMModel::NumSegments() const {
+    return levels.empty() ? 0 : levels[0].size();
+}
+
+}
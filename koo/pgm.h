@@ -0,0 +1,87 @@
+//
+// PGM-index style model (Ferragina and Vinciguerra, VLDB 2020): the keys are
+// cut into the fewest linear segments within the error bound, and the first
+// keys of those segments are indexed the same way, level after level, until
+// a single segment remains.
+
+#ifndef LEVELDB_PGM_H
+#define LEVELDB_PGM_H
+
+
+#include <vector>
+#include "koo/file_model.h"
+
+namespace koo {
+
+    // Streaming optimal piecewise linear approximation: keeps the convex
+    // hulls of the points shifted by +-epsilon and the extreme lines through
+    // them, so a segment is closed only when no line fits all its points.
+    class OptimalPLA {
+    public:
+        struct Point {
+            __int128 x;
+            __int128 y;
+        };
+
+        explicit OptimalPLA(uint64_t epsilon);
+
+        // Returns false, leaving the current segment closed, if (x, y) cannot
+        // join it. x must increase between calls for one segment.
+        bool Add(uint64_t x, uint64_t y);
+        // Slope and intercept at the first x of the current segment
+        void GetSegment(double* slope, double* intercept) const;
+        uint64_t FirstX() const { return first_x; }
+
+    private:
+        const __int128 epsilon;
+        uint64_t first_x;
+        size_t points_in_hull;
+        std::vector<Point> lower;
+        std::vector<Point> upper;
+        size_t lower_start;
+        size_t upper_start;
+        Point rectangle[4];
+    };
+
+    class PGMModel : public FileModel {
+    private:
+        struct PGMSegment {
+            uint64_t key;    // first key covered
+            uint64_t first;  // its position
+            double slope;
+            double intercept;
+            double Evaluate(uint64_t x) const { return (double) (x - key) * slope + intercept; }
+        };
+
+        double error;
+        // training state
+        OptimalPLA* pla;
+        uint64_t num_positions;
+        uint64_t num_distinct;
+        uint64_t last_key;
+        uint64_t segment_first;
+
+        // levels[0] maps keys to positions; levels[i] maps keys to segments of levels[i - 1]
+        std::vector<std::vector<PGMSegment>> levels;
+
+        static void BuildLevel(uint64_t epsilon, const std::vector<PGMSegment>& below,
+                               std::vector<PGMSegment>* result);
+        void BuildUpperLevels();
+
+    public:
+        explicit PGMModel(double error);
+        ~PGMModel() override;
+
+        ModelType Type() const override { return kPGMModel; }
+        void Add(uint64_t key) override;
+        bool Finish() override;
+        void Predict(uint64_t x, double* lower, double* upper) const override;
+        void EncodeTo(std::string* dst) const override;
+        bool DecodeFrom(leveldb::Slice* input) override;
+        size_t MemorySize() const override;
+        size_t NumSegments() const override;
+    };
+
+}
+
+#endif //LEVELDB_PGM_H
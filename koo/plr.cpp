@@ -1,8 +1,7 @@
 #include "koo/plr.h"
 #include "koo/util.h"
+#include <assert.h>
 #include <algorithm>
-#include <iostream>
-#include <string>
 #include <vector>
 #include <math.h>
 
@@ -57,27 +56,29 @@ get_lower_bound(struct point pt, double gamma) {
 }
 
 GreedyPLR::GreedyPLR(double gamma) {
-    this->state = "need2";
+    this->state = kNeed2;
     this->gamma = gamma;
 }
 
-int counter = 0;
-
 Segment
 GreedyPLR::process(const struct point& pt, bool file) {
     Segment s = {0, 0, 0};
-    if (this->state.compare("need2") == 0) {
-        this->s0 = pt;
-        this->state = "need1";
-    } else if (this->state.compare("need1") == 0) {
-        this->s1 = pt;
-        setup();
-        this->state = "ready";
-    } else if (this->state.compare("ready") == 0) {
-        s = process__(pt, file);
-    } else {
-        // impossible
-        std::cout << "ERROR in process" << std::endl;
+    switch (this->state) {
+        case kNeed2:
+            this->s0 = pt;
+            this->state = kNeed1;
+            break;
+        case kNeed1:
+            this->s1 = pt;
+            setup();
+            this->state = kReady;
+            break;
+        case kReady:
+            s = process__(pt, file);
+            break;
+        case kFinished:
+            assert(false);
+            break;
     }
     this->last_pt = pt;
     return s;
@@ -111,11 +112,11 @@ GreedyPLR::process__(struct point pt, bool file) {
             this->s0 = last_pt;
             this->s1 = pt;
             setup();
-            this->state = "ready";
+            this->state = kReady;
             return prev_segment;
         } else {
             this->s0 = pt;
-            this->state = "need1";
+            this->state = kNeed1;
         }
         return prev_segment;
     }
@@ -135,64 +136,59 @@ GreedyPLR::process__(struct point pt, bool file) {
 Segment
 GreedyPLR::finish() {
     Segment s = {0, 0, 0};
-    if (this->state.compare("need2") == 0) {
-        this->state = "finished";
-        return s;
-    } else if (this->state.compare("need1") == 0) {
-        this->state = "finished";
-        s.x = this->s0.x;
-        s.k = 0;
-        s.b = this->s0.y;
-        return s;
-    } else if (this->state.compare("ready") == 0) {
-        this->state = "finished";
-        return current_segment();
-    } else {
-        std::cout << "ERROR in finish" << std::endl;
-        return s;
+    switch (this->state) {
+        case kNeed2:
+            break;
+        case kNeed1:
+            s.x = this->s0.x;
+            s.k = 0;
+            s.b = this->s0.y;
+            break;
+        case kReady:
+            s = current_segment();
+            break;
+        case kFinished:
+            assert(false);
+            break;
     }
+    this->state = kFinished;
+    return s;
 }
 
-PLR::PLR(double gamma) {
-    this->gamma = gamma;
+PLR::PLR(double gamma, bool file) : gamma(gamma), file(file), plr(gamma), segment_start(0), last_key(0), count(0) {
 }
 
-std::vector<Segment>&
-PLR::train(std::vector<std::string>& keys, bool file) {
-    GreedyPLR plr(this->gamma);
-    int count = 0;
-    size_t size = keys.size();
-    uint64_t x = stoull(keys[0]);
-    for (int i = 0; i < size; ++i) {
-        Segment seg = plr.process(point((double) stoull(keys[i]), i), file);
-        if (seg.x != 0 ||
-            seg.k != 0 ||
-            seg.b != 0) {
-
-						// Learning error? x=x_last, k=-nan, b=nan인 선분 생성된다
-						/*if (std::isnan(seg.b)) {
-							segments.clear();				// TODO 삭제 말고 해결방법?
-							return segments;
-						} else this->segments.push_back(seg);*/
-						seg.x = x;
-						this->segments.push_back(seg);
-						x = stoull(keys[i]);
-        }
-
-        if (!file && ++count % 10 == 0 /*&& koo::env->compaction_awaiting.load() != 0*/) {
-            segments.clear();
-            return segments;
-        }
+void
+PLR::Add(uint64_t key) {
+    if (count == 0) {
+        segment_start = key;
+    } else if (key == last_key) {
+        ++count;
+        return;
+    }
+    last_key = key;
+    Segment seg = plr.process(point((double) key, count), file);
+    if (seg.x != 0 ||
+        seg.k != 0 ||
+        seg.b != 0) {
+        seg.x = segment_start;
+        this->segments.push_back(seg);
+        segment_start = key;
     }
+    ++count;
+}
 
+std::vector<Segment>&
+PLR::Finish() {
     Segment last = plr.finish();
+    // a lone first key yields an all-zero segment that is still valid
     if (last.x != 0 ||
         last.k != 0 ||
-        last.b != 0) {
-	      last.x = x;
+        last.b != 0 ||
+        (this->segments.empty() && count != 0)) {
+        last.x = segment_start;
         this->segments.push_back(last);
     }
-
     return this->segments;
 }
 
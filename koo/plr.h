@@ -1,4 +1,7 @@
-#include <string>
+#ifndef LEVELDB_PLR_H
+#define LEVELDB_PLR_H
+
+#include <cstdint>
 #include <vector>
 #include <deque>
 
@@ -23,6 +26,7 @@ class Segment {
 public:
     Segment(uint64_t _x, double _k, double _b) : x(_x), k(_k), b(_b) {}
     Segment(const Segment& copy) : x(copy.x), k(copy.k), b(copy.b) {}
+    Segment& operator=(const Segment& copy) = default;
     ~Segment() {}
     uint64_t x;
     double k;
@@ -42,7 +46,10 @@ struct point get_lower_bound(struct point pt, double gamma);
 
 class GreedyPLR {
 private:
-    std::string state;
+    // points still needed before a segment can be bounded
+    enum State { kNeed2, kNeed1, kReady, kFinished };
+
+    State state;
     double gamma;
     struct point last_pt;
     struct point s0;
@@ -64,13 +71,25 @@ public:
 class PLR {
 private:
     double gamma;
+    bool file;
+    GreedyPLR plr;
+    uint64_t segment_start;
+    uint64_t last_key;
+    uint64_t count;
     std::vector<Segment> segments;
 
 public:
-    PLR(double gamma);
-    std::vector<Segment>& train(std::vector<std::string>& keys, bool file);
+    PLR(double gamma, bool file = true);
+
+    // Feed keys in sorted order, one call per entry, then collect the
+    // segments with Finish(). A key equal to the previous one only takes
+    // up a position; the segments are fit to the first of each run.
+    void Add(uint64_t key);
+    std::vector<Segment>& Finish();
 //    std::vector<double> predict(std::vector<double> xx);
 //    double mae(std::vector<double> y_true, std::vector<double> y_pred);
 };
 
 }
+
+#endif //LEVELDB_PLR_H
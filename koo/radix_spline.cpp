@@ -0,0 +1,164 @@
+//
+// RadixSpline model, after https://github.com/learnedsystems/RadixSpline
+
+#include "koo/radix_spline.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "util/coding.h"
+
+namespace koo {
+
+namespace {
+
+enum Orientation { kCollinear, kClockwise, kCounterClockwise };
+
+// Turn from vector (dx1, dy1) to vector (dx2, dy2)
+Orientation ComputeOrientation(double dx1, double dy1, double dx2, double dy2) {
+    const double expr = std::fma(dy1, dx2, -(dy2 * dx1));
+    if (expr > std::numeric_limits<double>::epsilon()) return kClockwise;
+    if (expr < -std::numeric_limits<double>::epsilon()) return kCounterClockwise;
+    return kCollinear;
+}
+
+// table sized to about two slots per spline point
+const uint32_t kMaxRadixBits = 18;
+
+}  // namespace
+
+RadixSplineModel::RadixSplineModel(double error)
+    : error(error), num_positions(0), num_distinct(0), prev_point(), upper_limit(),
+      lower_limit(), num_shift_bits(0) {}
+
+void RadixSplineModel::Add(uint64_t key) {
+    uint64_t position = num_positions++;
+    if (num_distinct != 0 && key == prev_point.x) return;
+    AddPoint(key, position);
+}
+
+void RadixSplineModel::AddPoint(uint64_t key, uint64_t position) {
+    const double upper_y = position + error;
+    const double lower_y = position > error ? position - error : 0;
+    if (num_distinct == 0) {
+        points.push_back(Coord{key, (double) position});
+    } else if (num_distinct == 1) {
+        upper_limit = Coord{key, upper_y};
+        lower_limit = Coord{key, lower_y};
+    } else {
+        const Coord& last = points.back();
+        const double upper_x_diff = upper_limit.x - last.x;
+        const double upper_y_diff = upper_limit.y - last.y;
+        const double lower_x_diff = lower_limit.x - last.x;
+        const double lower_y_diff = lower_limit.y - last.y;
+        const double x_diff = key - last.x;
+        const double y_diff = position - last.y;
+
+        if (ComputeOrientation(upper_x_diff, upper_y_diff, x_diff, y_diff) != kClockwise ||
+            ComputeOrientation(lower_x_diff, lower_y_diff, x_diff, y_diff) != kCounterClockwise) {
+            // the point left the error corridor: the previous one ends the spline segment
+            points.push_back(prev_point);
+            upper_limit = Coord{key, upper_y};
+            lower_limit = Coord{key, lower_y};
+        } else {
+            // narrow the corridor
+            if (ComputeOrientation(upper_x_diff, upper_y_diff, x_diff, upper_y - last.y) == kClockwise) {
+                upper_limit = Coord{key, upper_y};
+            }
+            if (ComputeOrientation(lower_x_diff, lower_y_diff, x_diff, lower_y - last.y) == kCounterClockwise) {
+                lower_limit = Coord{key, lower_y};
+            }
+        }
+    }
+    prev_point = Coord{key, (double) position};
+    ++num_distinct;
+}
+
+bool RadixSplineModel::Finish() {
+    if (num_distinct == 0) return false;
+    if (points.back().x != prev_point.x) points.push_back(prev_point);
+    points.shrink_to_fit();
+    BuildRadixTable();
+    return true;
+}
+
+void RadixSplineModel::BuildRadixTable() {
+    uint32_t num_radix_bits = 1;
+    while (num_radix_bits < kMaxRadixBits && (1ull << num_radix_bits) < 2 * points.size()) {
+        ++num_radix_bits;
+    }
+    const uint64_t max_key = points.back().x;
+    const uint32_t key_bits = max_key == 0 ? 0 : 64 - __builtin_clzll(max_key);
+    num_shift_bits = key_bits > num_radix_bits ? key_bits - num_radix_bits : 0;
+
+    radix_table.assign((1ull << num_radix_bits) + 2, 0);
+    uint64_t prev_prefix = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+        const uint64_t prefix = points[i].x >> num_shift_bits;
+        for (uint64_t p = prev_prefix + 1; p <= prefix; ++p) radix_table[p] = i;
+        prev_prefix = prefix;
+    }
+    for (uint64_t p = prev_prefix + 1; p < radix_table.size(); ++p) radix_table[p] = points.size();
+}
+
+void RadixSplineModel::Predict(uint64_t x, double* lower, double* upper) const {
+    double estimate;
+    if (x <= points.front().x) {
+        estimate = points.front().y;
+    } else if (x >= points.back().x) {
+        estimate = points.back().y;
+    } else {
+        // first spline point at or after x, searched among those sharing its prefix
+        const uint64_t prefix = x >> num_shift_bits;
+        const uint32_t begin = radix_table[prefix];
+        const uint32_t end = radix_table[prefix + 1];
+        size_t i = std::lower_bound(points.begin() + begin, points.begin() + end, x,
+                                    [](const Coord& c, uint64_t key) { return c.x < key; }) -
+                   points.begin();
+        const Coord& down = points[i - 1];
+        const Coord& up = points[i];
+        estimate = down.y + (double) (x - down.x) * (up.y - down.y) / (double) (up.x - down.x);
+    }
+    *lower = estimate - error;
+    *upper = estimate + error;
+}
+
+void RadixSplineModel::EncodeTo(std::string* dst) const {
+    leveldb::PutVarint64(dst, points.size());
+    uint64_t prev_x = 0, prev_y = 0;
+    for (const Coord& c : points) {
+        uint64_t y = (uint64_t) c.y;
+        leveldb::PutVarint64(dst, c.x - prev_x);
+        leveldb::PutVarint64(dst, y - prev_y);
+        prev_x = c.x;
+        prev_y = y;
+    }
+}
+
+bool RadixSplineModel::DecodeFrom(leveldb::Slice* input) {
+    uint64_t num_points;
+    if (!leveldb::GetVarint64(input, &num_points) || num_points == 0) return false;
+    std::vector<Coord> decoded;
+    decoded.reserve(num_points);
+    uint64_t x = 0, y = 0;
+    for (uint64_t i = 0; i < num_points; ++i) {
+        uint64_t x_diff, y_diff;
+        if (!leveldb::GetVarint64(input, &x_diff) || !leveldb::GetVarint64(input, &y_diff)) return false;
+        x += x_diff;
+        y += y_diff;
+        decoded.push_back(Coord{x, (double) y});
+    }
+    points = std::move(decoded);
+    BuildRadixTable();
+    return true;
+}
+
+size_t RadixSplineModel::MemorySize() const {
+    return points.capacity() * sizeof(Coord) + radix_table.capacity() * sizeof(uint32_t);
+}
+
+size_t RadixSplineModel::NumSegments() const {
+    return points.size();
+}
+
+}
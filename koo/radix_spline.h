@@ -0,0 +1,54 @@
+//
+// RadixSpline (Kipf et al., aiDM 2020): a single pass over the keys picks
+// spline points so that interpolating between neighbours stays within the
+// error bound, and a table indexed by the top bits of a key narrows the
+// search for the surrounding spline points.
+
+#ifndef LEVELDB_RADIX_SPLINE_H
+#define LEVELDB_RADIX_SPLINE_H
+
+
+#include <vector>
+#include "koo/file_model.h"
+
+namespace koo {
+
+    class RadixSplineModel : public FileModel {
+    private:
+        struct Coord {
+            uint64_t x;
+            double y;
+        };
+
+        double error;
+        // training state
+        uint64_t num_positions;
+        uint64_t num_distinct;
+        Coord prev_point;
+        Coord upper_limit;
+        Coord lower_limit;
+
+        std::vector<Coord> points;
+        uint32_t num_shift_bits;
+        // radix_table[p] is the first spline point whose key prefix is >= p
+        std::vector<uint32_t> radix_table;
+
+        void AddPoint(uint64_t key, uint64_t position);
+        void BuildRadixTable();
+
+    public:
+        explicit RadixSplineModel(double error);
+
+        ModelType Type() const override { return kRadixSplineModel; }
+        void Add(uint64_t key) override;
+        bool Finish() override;
+        void Predict(uint64_t x, double* lower, double* upper) const override;
+        void EncodeTo(std::string* dst) const override;
+        bool DecodeFrom(leveldb::Slice* input) override;
+        size_t MemorySize() const override;
+        size_t NumSegments() const override;
+    };
+
+}
+
+#endif //LEVELDB_RADIX_SPLINE_H
@@ -0,0 +1,65 @@
+//
+// Read-optimized, frozen copy of the segments of a learned model.
+
+#include "koo/segment_index.h"
+
+#include <limits>
+
+namespace koo {
+
+namespace {
+
+// In-order walk of the implicit tree, handing out sorted entries.
+void FillEytzinger(const std::vector<uint64_t>& keys, const std::vector<const Segment*>& coefs,
+                   size_t* next, size_t slot, uint64_t* out_keys, double* out_slopes,
+                   double* out_intercepts, size_t size) {
+    if (slot > size) return;
+    FillEytzinger(keys, coefs, next, 2 * slot, out_keys, out_slopes, out_intercepts, size);
+    out_keys[slot] = keys[*next];
+    out_slopes[slot] = coefs[*next]->k;
+    out_intercepts[slot] = coefs[*next]->b;
+    ++*next;
+    FillEytzinger(keys, coefs, next, 2 * slot + 1, out_keys, out_slopes, out_intercepts, size);
+}
+
+}  // namespace
+
+void SegmentIndex::Build(const std::vector<Segment>& segments) {
+    Clear();
+    if (segments.size() < 2) return;
+
+    // Searching for the first key above x: pair every segment start but the
+    // first with the coefficients of its predecessor, and close with a key
+    // no x reaches for the last real segment.
+    size_t num_real = segments.size() - 1;
+    std::vector<uint64_t> sorted_keys;
+    std::vector<const Segment*> sorted_coefs;
+    sorted_keys.reserve(num_real);
+    sorted_coefs.reserve(num_real);
+    for (size_t i = 1; i < num_real; ++i) {
+        sorted_keys.push_back(segments[i].x);
+        sorted_coefs.push_back(&segments[i - 1]);
+    }
+    sorted_keys.push_back(std::numeric_limits<uint64_t>::max());
+    sorted_coefs.push_back(&segments[num_real - 1]);
+
+    size_ = num_real;
+    keys_.resize(size_ + 1);
+    slopes_.resize(size_ + 1);
+    intercepts_.resize(size_ + 1);
+    size_t next = 0;
+    FillEytzinger(sorted_keys, sorted_coefs, &next, 1, keys_.data(), slopes_.data(),
+                  intercepts_.data(), size_);
+}
+
+void SegmentIndex::Clear() {
+    size_ = 0;
+    keys_.clear();
+    keys_.shrink_to_fit();
+    slopes_.clear();
+    slopes_.shrink_to_fit();
+    intercepts_.clear();
+    intercepts_.shrink_to_fit();
+}
+
+}
@@ -0,0 +1,59 @@
+//
+// Read-optimized, frozen copy of the segments of a learned model.
+// Segment start keys are kept apart from the coefficients and laid out in
+// Eytzinger (BFS) order so the search touches one cache line per few levels
+// and compiles to a branch-free loop.
+
+#ifndef LEVELDB_SEGMENT_INDEX_H
+#define LEVELDB_SEGMENT_INDEX_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "koo/plr.h"
+
+namespace koo {
+
+    class SegmentIndex {
+    private:
+        // number of searchable entries; slots are 1-based
+        size_t size_;
+        // keys_[i] is the start of a segment; slopes_[i] and intercepts_[i]
+        // belong to the segment just before it in key order
+        std::vector<uint64_t> keys_;
+        std::vector<double> slopes_;
+        std::vector<double> intercepts_;
+
+    public:
+        SegmentIndex() : size_(0) {}
+
+        // Freeze segments sorted by x whose last entry is the dummy end
+        // segment appended after learning.
+        void Build(const std::vector<Segment>& segments);
+        void Clear();
+        bool Empty() const { return size_ == 0; }
+        size_t NumSegments() const { return size_; }
+        size_t MemorySize() const {
+            return keys_.capacity() * sizeof(uint64_t) +
+                   (slopes_.capacity() + intercepts_.capacity()) * sizeof(double);
+        }
+
+        // Predicted position of x using the last segment starting at or
+        // before x. REQUIRES: !Empty()
+        double Predict(uint64_t x) const {
+            const uint64_t* keys = keys_.data();
+            size_t i = 1;
+            while (i <= size_) {
+                __builtin_prefetch(keys + 8 * i);
+                i = 2 * i + (keys[i] <= x);
+            }
+            // strip the trailing right turns to get the first key above x
+            i >>= __builtin_ffsll(~i);
+            return x * slopes_[i] + intercepts_[i];
+        }
+    };
+
+}
+
+#endif //LEVELDB_SEGMENT_INDEX_H
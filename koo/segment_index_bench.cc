@@ -0,0 +1,64 @@
+// Microbenchmark of segment search: binary search over std::vector<Segment>
+// as GetPosition used to do, against the frozen SegmentIndex.
+//
+//   segment_index_bench [num_lookups]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "koo/segment_index.h"
+
+namespace {
+
+double BinarySearch(const std::vector<koo::Segment>& segments, uint64_t x) {
+  uint32_t left = 0, right = (uint32_t)segments.size() - 1;
+  while (left != right - 1) {
+    uint32_t mid = (right + left) / 2;
+    if (x < segments[mid].x)
+      right = mid;
+    else
+      left = mid;
+  }
+  return x * segments[left].k + segments[left].b;
+}
+
+template <typename F>
+double NanosPerLookup(const std::vector<uint64_t>& queries, F f) {
+  double sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (uint64_t q : queries) sink += f(q);
+  auto end = std::chrono::steady_clock::now();
+  if (sink == 42) printf(" ");  // keep the loop alive
+  return std::chrono::duration<double, std::nano>(end - start).count() / queries.size();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t num_lookups = argc > 1 ? atol(argv[1]) : 10000000;
+  std::mt19937_64 rng(301);
+
+  printf("%10s %12s %12s\n", "segments", "vector ns", "frozen ns");
+  for (size_t n : {16, 256, 4096, 65536, 1048576}) {
+    std::vector<koo::Segment> segments;
+    uint64_t x = 0;
+    for (size_t i = 0; i < n; ++i) {
+      segments.push_back(koo::Segment(x, 0.001 * (rng() % 1000), (double)(rng() % 100000)));
+      x += 1 + rng() % (1 << 20);
+    }
+    segments.push_back(koo::Segment(x, 0, 0));
+
+    koo::SegmentIndex index;
+    index.Build(segments);
+
+    std::vector<uint64_t> queries(num_lookups);
+    for (uint64_t& q : queries) q = rng() % x;
+
+    double vector_ns = NanosPerLookup(queries, [&](uint64_t q) { return BinarySearch(segments, q); });
+    double frozen_ns = NanosPerLookup(queries, [&](uint64_t q) { return index.Predict(q); });
+    printf("%10zu %12.1f %12.1f\n", n, vector_ns, frozen_ns);
+  }
+  return 0;
+}
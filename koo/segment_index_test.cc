@@ -0,0 +1,69 @@
+// Checks the frozen segment layout against a plain scan of the segments.
+
+#include "koo/segment_index.h"
+
+#include "util/random.h"
+#include "util/testharness.h"
+
+namespace koo {
+
+class SegmentIndexTest { };
+
+// Segments starting at 0 with random gaps, closed by the dummy end segment.
+static std::vector<Segment> RandomSegments(leveldb::Random* rnd, size_t n) {
+  std::vector<Segment> segments;
+  uint64_t x = 0;
+  for (size_t i = 0; i < n; i++) {
+    segments.push_back(Segment(x, rnd->Uniform(1000) / 100.0, rnd->Uniform(100000)));
+    x += 1 + rnd->Uniform(1000);
+  }
+  segments.push_back(Segment(x, 0, 0));
+  return segments;
+}
+
+static double Expected(const std::vector<Segment>& segments, uint64_t x) {
+  size_t i = 0;
+  while (i + 2 < segments.size() && segments[i + 1].x <= x) i++;
+  return x * segments[i].k + segments[i].b;
+}
+
+TEST(SegmentIndexTest, Empty) {
+  SegmentIndex index;
+  ASSERT_TRUE(index.Empty());
+  std::vector<Segment> segments;
+  segments.push_back(Segment(0, 0, 0));
+  index.Build(segments);
+  ASSERT_TRUE(index.Empty());
+}
+
+TEST(SegmentIndexTest, MatchesScan) {
+  leveldb::Random rnd(301);
+  for (size_t n = 1; n <= 300; n += (n < 20 ? 1 : 37)) {
+    std::vector<Segment> segments = RandomSegments(&rnd, n);
+    SegmentIndex index;
+    index.Build(segments);
+    ASSERT_EQ(index.NumSegments(), n);
+    uint64_t end = segments.back().x;
+    for (uint64_t x = 0; x <= end; x++) {
+      ASSERT_EQ(index.Predict(x), Expected(segments, x));
+    }
+  }
+}
+
+TEST(SegmentIndexTest, Rebuild) {
+  leveldb::Random rnd(17);
+  SegmentIndex index;
+  index.Build(RandomSegments(&rnd, 50));
+  std::vector<Segment> segments = RandomSegments(&rnd, 5);
+  index.Build(segments);
+  ASSERT_EQ(index.NumSegments(), 5u);
+  ASSERT_EQ(index.Predict(segments[3].x), Expected(segments, segments[3].x));
+  index.Clear();
+  ASSERT_TRUE(index.Empty());
+}
+
+}  // namespace koo
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
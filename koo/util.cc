@@ -1,6 +1,7 @@
 #include "koo/util.h"
 #include "util/mutexlock.h"
 #include <x86intrin.h>
+#include <algorithm>
 #include "koo/learned_index.h"
 
 namespace koo {
@@ -19,33 +20,59 @@ namespace koo {
 
 	//uint64_t fd_limit = 1024 * 1024;
 	bool fresh_write = false;			// TODO ???
-	bool block_num_entries_recorded = false;
-	uint64_t block_num_entries = 0;
-	uint64_t block_size = 0;
-	uint64_t entry_size = 0;
 	float reference_frequency = 2.6;
 	uint64_t learn_trigger_time = 50000000;
-	int policy = 0;
 	int level_allowed_seek = 1;
 	int file_allowed_seek = 10;
+	// train file models in TableBuilder while the table is written instead of re-reading it later;
+	// only these models are stored in the table and survive a restart
+	bool online_learning = false;
+	// kind of model trained for the files and the level model of each level
+	ModelType model_types[leveldb::config::kNumLevels] = {
+		kPLRModel, kPLRModel, kPLRModel, kPLRModel, kPLRModel, kPLRModel, kPLRModel};
+	// bytes the file models may take before cold ones are evicted, 0 for no limit
+	uint64_t model_memory_budget = 0;
+	// threads training file models in the background
+	int learning_threads = 1;
+	// CPU time the learning threads may use together, in percent of one core, 0 for no limit
+	int learning_cpu_percent = 0;
+	// one in this many lookups of learned files is also timed through the
+	// index block to measure what the model saves, 0 for none
+	int shadow_sample_interval = 128;
+	// bytes per second the value log garbage collector may scan, 0 for no collection
+	uint64_t vlog_gc_rate = 0;
+	// bytes after which the value log starts a new segment file, below 4GB
+	uint64_t vlog_segment_size = 64 << 20;
+	// value log partitions, each with its own buffers and files, that the
+	// writer threads spread over
+	int vlog_partitions = 1;
 
 	leveldb::port::Mutex file_stats_mutex;
 	map<int, FileStats> file_stats;
 
-  uint64_t SliceToInteger(const Slice& slice) {
-    const char* data = slice.data();
+  bool SampleShadowLookup() {
+    static thread_local uint32_t lookups = 0;
+    const int interval = shadow_sample_interval;
+    return interval > 0 && ++lookups % interval == 0;
+  }
+
+  uint64_t SliceToInteger(const Slice& slice, size_t prefix_length) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(slice.data());
     size_t size = slice.size();
     uint64_t num = 0;
-		bool leading_zeros = true;
 
-		for (int i = 0; i < size; ++i) {
-			int temp = data[i];
-      if (leading_zeros && temp == '0') continue;
-      leading_zeros = false;
-      num = (num << 3) + (num << 1) + temp - 48;
+    for (size_t i = prefix_length; i < prefix_length + 8; ++i) {
+      num = (num << 8) | (i < size ? data[i] : 0);
     }
     return num;
   }
 
+  size_t SharedPrefixLength(const Slice& a, const Slice& b) {
+    size_t length = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < length && a[i] == b[i]) ++i;
+    return i;
+  }
+
 
 }
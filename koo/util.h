@@ -13,6 +13,7 @@
 #include "koo/Counter.h"
 #include "koo/CBModel_Learn.h"
 #include "koo/koo.h"
+#include "koo/file_model.h"
 
 using std::string;
 using std::vector;
@@ -25,6 +26,8 @@ namespace koo {
 	class LearnedIndexData;
 	class FileStats;
 
+	// 9 learns a model per level on top of the file models, which
+	// Options::learning_policy picks
 	extern int MOD;
 	extern uint32_t level_model_error;
 	extern FileLearnedIndexData* file_data;
@@ -37,20 +40,31 @@ namespace koo {
 
 	//extern uint64_t fd_limit;
 	extern bool fresh_write;
-	extern bool block_num_entries_recorded;
-	extern uint64_t block_num_entries;
-	extern uint64_t block_size;
-	extern uint64_t entry_size;
 	extern float reference_frequency;
 	extern uint64_t learn_trigger_time;
-	extern int policy;
 	extern int level_allowed_seek;
 	extern int file_allowed_seek;
+	extern bool online_learning;
+	extern ModelType model_types[leveldb::config::kNumLevels];
+	extern uint64_t model_memory_budget;
+	extern int learning_threads;
+	extern int learning_cpu_percent;
+	extern int shadow_sample_interval;
+	extern uint64_t vlog_gc_rate;
+	extern uint64_t vlog_segment_size;
+	extern int vlog_partitions;
 
 	extern leveldb::port::Mutex file_stats_mutex;
 	extern map<int, FileStats> file_stats;
 
-	uint64_t SliceToInteger(const Slice& slice);
+	// Order-preserving map of a key to an integer: the first 8 bytes after
+	// prefix_length, big-endian and zero padded. Keys that only differ past
+	// those bytes map to the same integer.
+	uint64_t SliceToInteger(const Slice& slice, size_t prefix_length = 0);
+	// Whether the calling thread should time its current lookup of a learned
+	// file through the index block as well: one in shadow_sample_interval
+	bool SampleShadowLookup();
+	size_t SharedPrefixLength(const Slice& a, const Slice& b);
 
   // data structure containing infomation for CBA
   class FileStats {
@@ -61,8 +75,14 @@ namespace koo {
     uint32_t num_lookup_neg;
     uint32_t num_lookup_pos;
     uint64_t size;
+    // lookups per nanosecond the key range of the file served in the files
+    // it was compacted from, negative if unknown
+    double inherited_rate;
+    // the file was there when the DB was opened: start is the open, not
+    // when the file was written
+    bool recovered;
 
-    explicit FileStats(int level_, uint64_t size_) : start(0), end(0), level(level_), num_lookup_pos(0), num_lookup_neg(0), size(size_) {
+    explicit FileStats(int level_, uint64_t size_) : start(0), end(0), level(level_), num_lookup_pos(0), num_lookup_neg(0), size(size_), inherited_rate(-1), recovered(false) {
       koo::Stats* instance = koo::Stats::GetInstance();
       uint32_t dummy;
       start = (__rdtscp(&dummy) - instance->initial_time) / koo::reference_frequency;
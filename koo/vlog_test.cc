@@ -0,0 +1,471 @@
+// Checks that the value log keeps its records readable across segments and
+// while its garbage collector moves the live ones out of the segments that
+// are mostly garbage and deletes them.
+
+#include "koo/Vlog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <thread>
+
+#include "db/db_impl.h"
+#include "db/filename.h"
+#include "hyperleveldb/db.h"
+#include "koo/util.h"
+#include "util/coding.h"
+#include "util/testharness.h"
+
+namespace koo {
+
+static std::string Value(int i, int round) {
+  char buf[100];
+  snprintf(buf, sizeof(buf), "%08d.%d.", i, round);
+  std::string value(buf);
+  value.resize(1000, 'v');
+  return value;
+}
+
+// Fails the syncs of the files it opened for writing once fail_sync is set
+class SyncFailingEnv : public leveldb::EnvWrapper {
+ public:
+  std::atomic<bool> fail_sync;
+
+  SyncFailingEnv() : EnvWrapper(leveldb::Env::Default()), fail_sync(false) { }
+
+  class File : public leveldb::WritableFile {
+   public:
+    File(SyncFailingEnv* env, leveldb::WritableFile* target)
+        : env_(env), target_(target) { }
+    virtual ~File() { delete target_; }
+    virtual leveldb::Status Append(const Slice& data) {
+      return target_->Append(data);
+    }
+    virtual leveldb::Status Close() { return target_->Close(); }
+    virtual leveldb::Status Flush() { return target_->Flush(); }
+    virtual leveldb::Status Sync() {
+      if (env_->fail_sync.load()) {
+        return leveldb::Status::IOError("sync failed");
+      }
+      return target_->Sync();
+    }
+
+   private:
+    SyncFailingEnv* env_;
+    leveldb::WritableFile* target_;
+  };
+
+  virtual leveldb::Status NewWritableFile(const std::string& fname,
+                                          leveldb::WritableFile** result) {
+    leveldb::Status s = target()->NewWritableFile(fname, result);
+    if (s.ok()) {
+      *result = new File(this, *result);
+    }
+    return s;
+  }
+};
+
+class VLogTest {
+ public:
+  std::string dbname_;
+
+  VLogTest() {
+    dbname_ = leveldb::test::TmpDir() + "/vlog_test";
+    leveldb::DestroyDB(dbname_, leveldb::Options());
+    koo::env = leveldb::Env::Default();
+    koo::env->CreateDir(dbname_);
+  }
+
+  ~VLogTest() {
+    koo::vlog_gc_rate = 0;
+    koo::vlog_segment_size = 64 << 20;
+    koo::vlog_partitions = 1;
+    leveldb::DestroyDB(dbname_, leveldb::Options());
+  }
+};
+
+TEST(VLogTest, RotatesSegments) {
+  koo::vlog_segment_size = 1 << 20;
+  std::vector<uint64_t> addresses;
+  VLog* vlog = new VLog(dbname_);
+  for (int i = 0; i < 5000; i++) {
+    addresses.push_back(vlog->AddRecord(Value(i, 0).substr(0, 8), Value(i, 0)));
+  }
+  ASSERT_OK(vlog->Sync());
+  ASSERT_EQ(VLog::SegmentOf(addresses[0]), 1);
+  ASSERT_GE(VLog::SegmentOf(addresses[4999]), 4);
+  std::vector<uint64_t> sealed, heads;
+  vlog->Segments(&sealed, &heads);
+  ASSERT_GE(sealed.size(), 3);
+  ASSERT_EQ(sealed[0], 1);
+  ASSERT_EQ(heads.size(), 1);
+
+  // Every record of segment 1, and a third of segment 2, was dropped
+  for (int i = 0; i < 5000; i++) {
+    const uint64_t segment = VLog::SegmentOf(addresses[i]);
+    if (segment == 1 || (segment == 2 && i % 3 == 0)) {
+      char pointer[sizeof(uint64_t) + sizeof(uint32_t)];
+      EncodeFixed64(pointer, addresses[i]);
+      EncodeFixed32(pointer + sizeof(uint64_t), 1000);
+      vlog->AddGarbage(8, Slice(pointer, sizeof(pointer)));
+    }
+  }
+  uint64_t segment, size;
+  ASSERT_TRUE(vlog->PickSegment(0.5, &segment, &size));
+  ASSERT_EQ(segment, 1);
+  ASSERT_OK(vlog->RemoveSegment(1));
+  ASSERT_TRUE(!koo::env->FileExists(vlog->SegmentFileName(1)));
+  ASSERT_TRUE(!vlog->PickSegment(0.5, &segment, &size));
+  delete vlog;
+
+  // The records and the garbage of the other segments survive a restart
+  vlog = new VLog(dbname_);
+  ASSERT_EQ(vlog->ReadRecord(addresses[4000], 1000), Value(4000, 0));
+  ASSERT_TRUE(vlog->PickSegment(0.3, &segment, &size));
+  ASSERT_EQ(segment, 2);
+  delete vlog;
+}
+
+// The moved records that a removed segment held must be on disk first
+TEST(VLogTest, KeepsSegmentIfSyncFails) {
+  SyncFailingEnv env;
+  koo::env = &env;
+  koo::vlog_segment_size = 1 << 20;
+  VLog* vlog = new VLog(dbname_);
+  std::vector<uint64_t> addresses;
+  for (int i = 0; i < 3000; i++) {
+    addresses.push_back(vlog->AddRecord(Value(i, 0).substr(0, 8), Value(i, 0)));
+  }
+  ASSERT_OK(vlog->Sync());
+  ASSERT_GE(VLog::SegmentOf(addresses[2999]), 2);
+
+  env.fail_sync = true;
+  vlog->AddRecord("moved", Value(0, 1));
+  ASSERT_TRUE(!vlog->RemoveSegment(1).ok());
+  ASSERT_TRUE(env.FileExists(vlog->SegmentFileName(1)));
+  ASSERT_EQ(vlog->ReadRecord(addresses[0], 1000), Value(0, 0));
+  env.fail_sync = false;
+  delete vlog;
+
+  vlog = new VLog(dbname_);
+  ASSERT_EQ(vlog->ReadRecord(addresses[0], 1000), Value(0, 0));
+  ASSERT_OK(vlog->RemoveSegment(1));
+  ASSERT_TRUE(!env.FileExists(vlog->SegmentFileName(1)));
+  delete vlog;
+  koo::env = leveldb::Env::Default();
+}
+
+TEST(VLogTest, ConcurrentWriters) {
+  const int kThreads = 8;
+  const int kRecords = 2000;
+  VLog* vlog = new VLog(dbname_);
+  std::vector<uint64_t> addresses(kThreads * kRecords);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (int i = t * kRecords; i < (t + 1) * kRecords; i++) {
+        // Now and then a record larger than a buffer
+        std::string value = Value(i, 0);
+        if (i % 997 == 0) value.resize(300 << 10, 'w');
+        addresses[i] = vlog->AddRecord(value.substr(0, 8), value);
+        if (i % 499 == 0) {
+          ASSERT_OK(vlog->SyncTo(addresses[i] + value.size()));
+        }
+      }
+    }));
+  }
+  for (int t = 0; t < kThreads; t++) {
+    threads[t].join();
+  }
+
+  // Some records are still in the buffers, some in the file, and all of
+  // them in the file once the log is closed
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < kThreads * kRecords; i++) {
+      std::string value = Value(i, 0);
+      if (i % 997 == 0) value.resize(300 << 10, 'w');
+      ASSERT_EQ(vlog->ReadRecord(addresses[i], value.size()), value);
+    }
+    delete vlog;
+    vlog = new VLog(dbname_);
+  }
+  delete vlog;
+}
+
+// Records read back right after they are added are copied out of buffers
+// that the flush thread is writing out and recycling, while other threads
+// sync the whole log
+TEST(VLogTest, ReadersAndSyncs) {
+  const int kThreads = 4;
+  const int kRecords = 3000;
+  VLog* vlog = new VLog(dbname_);
+  std::atomic<bool> done(false);
+  std::thread syncer([&]() {
+    while (!done.load()) {
+      ASSERT_OK(vlog->Sync());
+    }
+  });
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      std::vector<uint64_t> addresses;
+      for (int i = 0; i < kRecords; i++) {
+        std::string value = Value(t * kRecords + i, 0);
+        if (i % 101 == 0) value.resize(300 << 10, 'w');
+        addresses.push_back(vlog->AddRecord(value.substr(0, 8), value));
+        ASSERT_EQ(vlog->ReadRecord(addresses.back(), value.size()), value);
+        if (i >= 10) {
+          // A record further back, which may have left the buffers by now
+          const int j = i - 10;
+          value = Value(t * kRecords + j, 0);
+          if (j % 101 == 0) value.resize(300 << 10, 'w');
+          ASSERT_EQ(vlog->ReadRecord(addresses[j], value.size()), value);
+        }
+      }
+    }));
+  }
+  for (int t = 0; t < kThreads; t++) {
+    threads[t].join();
+  }
+  done = true;
+  syncer.join();
+  ASSERT_OK(vlog->Sync());
+  delete vlog;
+}
+
+TEST(VLogTest, Partitions) {
+  const int kThreads = 4;
+  const int kRecords = 1000;
+  koo::vlog_partitions = kThreads;
+  VLog* vlog = new VLog(dbname_);
+  std::vector<uint64_t> addresses(kThreads * kRecords);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (int i = t * kRecords; i < (t + 1) * kRecords; i++) {
+        addresses[i] = vlog->AddRecord(Value(i, 0).substr(0, 8), Value(i, 0));
+      }
+    }));
+  }
+  for (int t = 0; t < kThreads; t++) {
+    threads[t].join();
+  }
+  // Each thread wrote to a partition of its own
+  std::set<uint64_t> partitions;
+  for (int t = 0; t < kThreads; t++) {
+    const uint64_t partition =
+        VLog::PartitionOf(VLog::SegmentOf(addresses[t * kRecords]));
+    for (int i = t * kRecords; i < (t + 1) * kRecords; i++) {
+      ASSERT_EQ(VLog::PartitionOf(VLog::SegmentOf(addresses[i])), partition);
+    }
+    partitions.insert(partition);
+  }
+  ASSERT_EQ(partitions.size(), kThreads);
+  ASSERT_OK(vlog->Sync());
+  delete vlog;
+
+  // The partitions are found again with fewer configured
+  koo::vlog_partitions = 1;
+  vlog = new VLog(dbname_);
+  std::vector<uint64_t> sealed, heads;
+  vlog->Segments(&sealed, &heads);
+  ASSERT_EQ(heads.size(), kThreads);
+  for (int i = 0; i < kThreads * kRecords; i++) {
+    ASSERT_EQ(vlog->ReadRecord(addresses[i], 1000), Value(i, 0));
+  }
+  delete vlog;
+}
+
+TEST(VLogTest, RecoversFromLostValues) {
+  const int kKeys = 100;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  options.write_ahead_log = true;
+  leveldb::DB* db;
+  ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+  for (int i = 0; i < kKeys; i++) {
+    ASSERT_OK(db->Put(leveldb::WriteOptions(), Value(i, 0).substr(0, 8),
+                      Value(i, 0)));
+  }
+  leveldb::DBImpl* impl = reinterpret_cast<leveldb::DBImpl*>(db);
+  const std::string head = impl->vlog->SegmentFileName(1);
+  delete db;
+
+  // A crash lost the values from the middle of the one of key 50 on, while
+  // the log records that point to them made it to disk
+  const size_t kRecordSize = VLog::RecordSize(8, 1000);
+  std::string contents;
+  ASSERT_OK(leveldb::ReadFileToString(koo::env, head, &contents));
+  ASSERT_EQ(contents.size(), kKeys * kRecordSize);
+  ASSERT_OK(koo::env->DeleteFile(head));
+  ASSERT_OK(leveldb::WriteStringToFile(koo::env,
+      Slice(contents.data(), 50 * kRecordSize + 500), head));
+
+  for (int round = 0; round < 2; round++) {
+    ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+    for (int i = 0; i < kKeys; i++) {
+      std::string value;
+      leveldb::Status s =
+          db->Get(leveldb::ReadOptions(), Value(i, 0).substr(0, 8), &value);
+      if (i < 50) {
+        ASSERT_OK(s);
+        ASSERT_EQ(value, Value(i, 0));
+      } else {
+        ASSERT_TRUE(s.IsNotFound());
+      }
+    }
+    // The records after the torn one are found again
+    ASSERT_OK(db->Put(leveldb::WriteOptions(), "new", Value(0, 1)));
+    std::string value;
+    ASSERT_OK(db->Get(leveldb::ReadOptions(), "new", &value));
+    ASSERT_EQ(value, Value(0, 1));
+    delete db;
+  }
+}
+
+// The tail of the head may hold bytes that look like records after a crash:
+// zeros from a file extended but not written, or a record whose lengths
+// made it to disk but not all of its value
+TEST(VLogTest, RecoversFromCorruptTail) {
+  const int kKeys = 100;
+  const size_t kRecordSize = VLog::RecordSize(8, 1000);
+  leveldb::Options options;
+  options.create_if_missing = true;
+  options.write_ahead_log = true;
+  for (int corruption = 0; corruption < 2; corruption++) {
+    leveldb::DestroyDB(dbname_, options);
+    leveldb::DB* db;
+    ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+    for (int i = 0; i < kKeys; i++) {
+      ASSERT_OK(db->Put(leveldb::WriteOptions(), Value(i, 0).substr(0, 8),
+                        Value(i, 0)));
+    }
+    leveldb::DBImpl* impl = reinterpret_cast<leveldb::DBImpl*>(db);
+    const std::string head = impl->vlog->SegmentFileName(1);
+    delete db;
+
+    std::string contents;
+    ASSERT_OK(leveldb::ReadFileToString(koo::env, head, &contents));
+    ASSERT_EQ(contents.size(), kKeys * kRecordSize);
+    if (corruption == 0) {
+      std::fill(contents.begin() + 50 * kRecordSize, contents.end(), '\0');
+    } else {
+      contents[50 * kRecordSize + 500] ^= 0x40;
+    }
+    ASSERT_OK(koo::env->DeleteFile(head));
+    ASSERT_OK(leveldb::WriteStringToFile(koo::env, contents, head));
+
+    ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+    for (int i = 0; i < kKeys; i++) {
+      std::string value;
+      leveldb::Status s =
+          db->Get(leveldb::ReadOptions(), Value(i, 0).substr(0, 8), &value);
+      if (i < 50) {
+        ASSERT_OK(s);
+        ASSERT_EQ(value, Value(i, 0));
+      } else {
+        ASSERT_TRUE(s.IsNotFound());
+      }
+    }
+    delete db;
+  }
+}
+
+TEST(VLogTest, WithoutWriteAheadLog) {
+  const int kKeys = 1000;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  options.write_ahead_log = false;
+  leveldb::DB* db;
+  ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+  for (int i = 0; i < kKeys; i++) {
+    ASSERT_OK(db->Put(leveldb::WriteOptions(), Value(i, 0).substr(0, 8),
+                      Value(i, 0)));
+  }
+  for (int i = 0; i < kKeys; i += 3) {
+    ASSERT_OK(db->Delete(leveldb::WriteOptions(), Value(i, 0).substr(0, 8)));
+  }
+  delete db;
+
+  // Nothing went to the log, and the writes are in a table file instead
+  std::vector<std::string> children;
+  ASSERT_OK(koo::env->GetChildren(dbname_, &children));
+  for (size_t i = 0; i < children.size(); i++) {
+    uint64_t number, size;
+    leveldb::FileType type;
+    if (leveldb::ParseFileName(children[i], &number, &type) &&
+        type == leveldb::kLogFile) {
+      ASSERT_OK(koo::env->GetFileSize(dbname_ + "/" + children[i], &size));
+      ASSERT_EQ(size, 0);
+    }
+  }
+  ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+  for (int i = 0; i < kKeys; i++) {
+    std::string value;
+    leveldb::Status s =
+        db->Get(leveldb::ReadOptions(), Value(i, 0).substr(0, 8), &value);
+    if (i % 3 == 0) {
+      ASSERT_TRUE(s.IsNotFound());
+    } else {
+      ASSERT_OK(s);
+      ASSERT_EQ(value, Value(i, 0));
+    }
+  }
+  delete db;
+}
+
+TEST(VLogTest, CollectsOverwrittenValues) {
+  const int kKeys = 2000;
+  const int kRounds = 5;
+  koo::vlog_gc_rate = 1ull << 30;
+  koo::vlog_segment_size = 1 << 20;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  options.write_buffer_size = 256 << 10;
+  leveldb::DB* db;
+  ASSERT_OK(leveldb::DB::Open(options, dbname_, &db));
+  leveldb::DBImpl* impl = reinterpret_cast<leveldb::DBImpl*>(db);
+
+  for (int round = 0; round < kRounds; round++) {
+    for (int i = 0; i < kKeys; i++) {
+      char key[100];
+      snprintf(key, sizeof(key), "%08d", i);
+      if (round == kRounds - 1 && i % 2 == 1) {
+        ASSERT_OK(db->Delete(leveldb::WriteOptions(), key));
+      } else {
+        ASSERT_OK(db->Put(leveldb::WriteOptions(), key, Value(i, round)));
+      }
+    }
+  }
+
+  // Compactions drop the overwritten pointers, which makes the early
+  // segments garbage.  The rewrites of the collector fill the memtables
+  // that let it delete the segments they came from.
+  db->CompactRange(NULL, NULL);
+  for (int i = 0; i < 1000 && koo::env->FileExists(impl->vlog->SegmentFileName(3)); i++) {
+    impl->TEST_CompactMemTable();
+    leveldb::Env::Default()->SleepForMicroseconds(10000);
+  }
+  ASSERT_TRUE(!koo::env->FileExists(impl->vlog->SegmentFileName(1)));
+  ASSERT_TRUE(!koo::env->FileExists(impl->vlog->SegmentFileName(3)));
+
+  for (int i = 0; i < kKeys; i++) {
+    char key[100];
+    snprintf(key, sizeof(key), "%08d", i);
+    std::string value;
+    leveldb::Status s = db->Get(leveldb::ReadOptions(), key, &value);
+    if (i % 2 == 1) {
+      ASSERT_TRUE(s.IsNotFound());
+    } else {
+      ASSERT_OK(s);
+      ASSERT_EQ(value, Value(i, kRounds - 1));
+    }
+  }
+  delete db;
+}
+
+}  // namespace koo
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -86,6 +86,15 @@ static const uint64_t kTableMagicNumber = 0xdb4775248b80fb57ull;
 // 1-byte type + 32-bit crc
 static const size_t kBlockTrailerSize = 5;
 
+// Metaindex key of the block holding the file model learned while the
+// table was built.
+static const char kLearnedIndexBlockName[] = "learned_index";
+
+// Metaindex key of the block recording the data block restart interval
+// followed by, for every data block, its number of entries shifted left by
+// one with the low bit set if the block is stored compressed.
+static const char kBlockEntriesBlockName[] = "block_entries";
+
 struct BlockContents {
   BlockContents() : data(), cachable(), heap_allocated() {}
   Slice data;           // Actual contents of data
@@ -76,10 +76,6 @@ Status Table::Open(const Options& options,
 }
 
 void Table::ReadMeta(const Footer& footer) {
-  if (rep_->options.filter_policy == NULL) {
-    return;  // Do not need any metadata
-  }
-
   // TODO(sanjay): Skip this if footer.metaindex_handle() size indicates
   // it is an empty block.
   ReadOptions opt;
@@ -91,11 +87,22 @@ void Table::ReadMeta(const Footer& footer) {
   Block* meta = new Block(contents);
 
   Iterator* iter = meta->NewIterator(BytewiseComparator());
-  std::string key = "filter.";
-  key.append(rep_->options.filter_policy->Name());
-  iter->Seek(key);
-  if (iter->Valid() && iter->key() == Slice(key)) {
-    ReadFilter(iter->value());
+  iter->Seek(kBlockEntriesBlockName);
+  if (iter->Valid() && iter->key() == Slice(kBlockEntriesBlockName)) {
+    ReadBlockEntries(iter->value());
+  }
+  if (rep_->options.filter_policy != NULL) {
+    std::string key = "filter.";
+    key.append(rep_->options.filter_policy->Name());
+    iter->Seek(key);
+    if (iter->Valid() && iter->key() == Slice(key)) {
+      ReadFilter(iter->value());
+    }
+  }
+  iter->Seek(kLearnedIndexBlockName);
+  if (iter->Valid() && iter->key() == Slice(kLearnedIndexBlockName)) {
+    Slice v = iter->value();
+    rep_->has_learned_index = rep_->learned_index_handle.DecodeFrom(&v).ok();
   }
   delete iter;
   delete meta;
@@ -121,6 +128,41 @@ void Table::ReadFilter(const Slice& filter_handle_value) {
   rep_->filter = new FilterBlockReader(rep_->options.filter_policy, block.data);
 }
 
+void Table::ReadBlockEntries(const Slice& block_entries_handle_value) {
+  Slice v = block_entries_handle_value;
+  BlockHandle handle;
+  if (!handle.DecodeFrom(&v).ok()) {
+    return;
+  }
+
+  ReadOptions opt;
+  BlockContents block;
+  if (!ReadBlock(rep_->file, opt, handle, &block).ok()) {
+    return;
+  }
+  Slice input = block.data;
+  uint32_t interval;
+  std::vector<uint64_t> accumulated;
+  std::vector<bool> compressed;
+  bool ok = GetVarint32(&input, &interval) && interval > 0;
+  uint64_t total = 0;
+  while (ok && !input.empty()) {
+    uint64_t count;
+    ok = GetVarint64(&input, &count) && (count >> 1) > 0;
+    total += count >> 1;
+    accumulated.push_back(total);
+    compressed.push_back(count & 1);
+  }
+  if (block.heap_allocated) {
+    delete[] block.data.data();
+  }
+  if (ok) {
+    rep_->restart_interval = interval;
+    rep_->accumulated_block_entries.swap(accumulated);
+    rep_->compressed_blocks.swap(compressed);
+  }
+}
+
 Table::~Table() {
   delete rep_;
 }
@@ -264,36 +306,42 @@ uint64_t Table::ApproximateOffsetOf(const Slice& key) const {
   return result;
 }
 
-void Table::FillData(const ReadOptions& options, koo::LearnedIndexData* data) {
-	if (data->filled) return;
-  Status status;
-  Block::Iter* index_iter = dynamic_cast<Block::Iter*>(rep_->index_block->NewIterator(rep_->options.comparator));
-  for (uint32_t i = 0; i < index_iter->num_restarts_; ++i) {
-    index_iter->SeekToRestartPoint(i);
-    index_iter->ParseNextKey();
-    assert(index_iter->Valid());
-    Block::Iter* block_iter = dynamic_cast<Block::Iter*>(BlockReader(this, options, index_iter->value()));
-
-    ParsedInternalKey parsed_key;
-    int num_entries_this_block = 0;
-    for (block_iter->SeekToRestartPoint(0); block_iter->ParseNextKey(); ++num_entries_this_block) {
-        ParseInternalKey(block_iter->key(), &parsed_key);
-        data->string_keys.emplace_back(parsed_key.user_key.data(), parsed_key.user_key.size());
+bool Table::FillData(const ReadOptions& options, koo::LearnedIndexData* data) {
+  if (data->filled) return true;
+  bool ok = true;
+  Iterator* index_iter = rep_->index_block->NewIterator(rep_->options.comparator);
+  for (index_iter->SeekToFirst(); ok && index_iter->Valid(); index_iter->Next()) {
+    if (data->Aborted()) {
+      ok = false;
+      break;
     }
-
-    if (!koo::block_num_entries_recorded) {
-        koo::block_num_entries = num_entries_this_block;
-        koo::block_num_entries_recorded = true;
-        koo::entry_size = block_iter->restarts_ / num_entries_this_block;
-        BlockHandle temp;
-        Slice temp_slice = index_iter->value();
-        temp.DecodeFrom(&temp_slice);
-        koo::block_size = temp.size() + kBlockTrailerSize;
+    Iterator* block_iter = BlockReader(this, options, index_iter->value());
+    for (block_iter->SeekToFirst(); block_iter->Valid(); block_iter->Next()) {
+      data->AddKey(ExtractUserKey(block_iter->key()));
     }
+    ok = block_iter->status().ok();
     delete block_iter;
   }
-  data->filled = true;
+  ok = ok && index_iter->status().ok();
   delete index_iter;
+  data->filled = ok;
+  return ok;
+}
+
+bool Table::ReadLearnedIndex(koo::LearnedIndexData* data) {
+  if (!rep_->has_learned_index) return false;
+
+  ReadOptions opt;
+  opt.verify_checksums = true;
+  BlockContents block;
+  if (!ReadBlock(rep_->file, opt, rep_->learned_index_handle, &block).ok()) {
+    return false;
+  }
+  bool ok = data->DecodeFrom(block.data);
+  if (block.heap_allocated) {
+    delete[] block.data.data();
+  }
+  return ok;
 }
 
 
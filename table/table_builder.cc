@@ -12,8 +12,11 @@
 #include "table/block_builder.h"
 #include "table/filter_block.h"
 #include "table/format.h"
+#include "table/table_builder_internal.h"
 #include "util/coding.h"
 #include "util/crc32c.h"
+#include "db/dbformat.h"
+#include "koo/learned_index.h"
 
 namespace leveldb {
 
@@ -27,8 +30,12 @@ struct TableBuilder::Rep {
   BlockBuilder index_block;
   std::string last_key;
   int64_t num_entries;
+  int64_t block_entries;  // Entries in the data block being built
   bool closed;          // Either Finish() or Abandon() has been called.
   FilterBlockBuilder* filter_block;
+  koo::LearnedIndexData* learned_index;  // Online trained model, if any
+  std::string block_entries_block;  // Entry count of each data block
+  bool block_entries_valid;  // False if the restart interval changed
 
   // We do not emit the index entry for a block until we have seen the
   // first key for the next data block.  This allows us to use shorter
@@ -54,9 +61,13 @@ struct TableBuilder::Rep {
         index_block(&index_block_options),
         last_key(),
         num_entries(0),
+        block_entries(0),
         closed(false),
         filter_block(opt.filter_policy == NULL ? NULL
                      : new FilterBlockBuilder(opt.filter_policy)),
+        learned_index(NULL),
+        block_entries_block(),
+        block_entries_valid(true),
         pending_index_entry(false),
         pending_handle(),
         compressed_output() {
@@ -91,6 +102,10 @@ Status TableBuilder::ChangeOptions(const Options& options) {
 
   // Note that any live BlockBuilders point to rep_->options and therefore
   // will automatically pick up the updated options.
+  if (options.block_restart_interval !=
+      rep_->options.block_restart_interval) {
+    rep_->block_entries_valid = false;
+  }
   rep_->options = options;
   rep_->index_block_options = options;
   rep_->index_block_options.block_restart_interval = 1;
@@ -120,8 +135,13 @@ void TableBuilder::Add(const Slice& key, const Slice& value) {
     r->filter_block->AddKey(key);
   }
 
+  if (r->learned_index != NULL) {
+    r->learned_index->AddKey(ExtractUserKey(key));
+  }
+
   r->last_key.assign(key.data(), key.size());
   r->num_entries++;
+  r->block_entries++;
   r->data_block.Add(key, value);
 
   const size_t estimated_block_size = r->data_block.CurrentSizeEstimate();
@@ -136,11 +156,16 @@ void TableBuilder::Flush() {
   if (!ok()) return;
   if (r->data_block.empty()) return;
   assert(!r->pending_index_entry);
+  const size_t raw_size = r->data_block.CurrentSizeEstimate();
   WriteBlock(&r->data_block, &r->pending_handle);
   if (ok()) {
     r->pending_index_entry = true;
     r->status = r->file->Flush();
+    const bool compressed = r->pending_handle.size() != raw_size;
+    PutVarint64(&r->block_entries_block,
+                (static_cast<uint64_t>(r->block_entries) << 1) | compressed);
   }
+  r->block_entries = 0;
   if (r->filter_block != NULL) {
     r->filter_block->StartBlock(r->offset);
   }
@@ -215,6 +240,18 @@ Status TableBuilder::Finish() {
   r->closed = true;
 
   BlockHandle filter_block_handle, metaindex_block_handle, index_block_handle;
+  BlockHandle learned_index_handle, block_entries_handle;
+
+  // Write block entries block.  Model-guided reads map positions to data
+  // blocks with it, and read uncompressed blocks through their restart array.
+  bool has_block_entries = false;
+  if (ok() && r->block_entries_valid) {
+    std::string contents;
+    PutVarint32(&contents, r->options.block_restart_interval);
+    contents.append(r->block_entries_block);
+    WriteRawBlock(contents, kNoCompression, &block_entries_handle);
+    has_block_entries = true;
+  }
 
   // Write filter block
   if (ok() && r->filter_block != NULL) {
@@ -222,9 +259,23 @@ Status TableBuilder::Finish() {
                   &filter_block_handle);
   }
 
+  // Write learned index block
+  bool learned = false;
+  if (ok() && r->learned_index != NULL && r->learned_index->FinishOnlineLearn()) {
+    std::string model_encoding;
+    r->learned_index->EncodeTo(&model_encoding);
+    WriteRawBlock(model_encoding, kNoCompression, &learned_index_handle);
+    learned = true;
+  }
+
   // Write metaindex block
   if (ok()) {
     BlockBuilder meta_index_block(&r->options);
+    if (has_block_entries) {
+      std::string handle_encoding;
+      block_entries_handle.EncodeTo(&handle_encoding);
+      meta_index_block.Add(kBlockEntriesBlockName, handle_encoding);
+    }
     if (r->filter_block != NULL) {
       // Add mapping from "filter.Name" to location of filter data
       std::string key = "filter.";
@@ -233,6 +284,11 @@ Status TableBuilder::Finish() {
       filter_block_handle.EncodeTo(&handle_encoding);
       meta_index_block.Add(key, handle_encoding);
     }
+    if (learned) {
+      std::string handle_encoding;
+      learned_index_handle.EncodeTo(&handle_encoding);
+      meta_index_block.Add(kLearnedIndexBlockName, handle_encoding);
+    }
 
     // TODO(postrelease): Add stats and other meta blocks
     WriteBlock(&meta_index_block, &metaindex_block_handle);
@@ -271,6 +327,12 @@ void TableBuilder::Abandon() {
   r->closed = true;
 }
 
+void TableBuilderInternal::SetLearnedIndex(TableBuilder* builder,
+                                           koo::LearnedIndexData* model) {
+  assert(builder->rep_->num_entries == 0);
+  builder->rep_->learned_index = model;
+}
+
 uint64_t TableBuilder::NumEntries() const {
   return rep_->num_entries;
 }
@@ -0,0 +1,28 @@
+// Copyright (c) 2011 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#ifndef STORAGE_LEVELDB_TABLE_TABLE_BUILDER_INTERNAL_H_
+#define STORAGE_LEVELDB_TABLE_TABLE_BUILDER_INTERNAL_H_
+
+#include "hyperleveldb/table_builder.h"
+
+namespace koo { class LearnedIndexData; }
+
+namespace leveldb {
+
+// TableBuilderInternal provides static methods for the learned index hooks
+// of a TableBuilder that we don't want in the public TableBuilder interface.
+class TableBuilderInternal {
+ public:
+  // Train "*model" on the user keys of the table as they are added.  The
+  // model is finished by Finish() and is usable once Finish() returns ok.
+  // Does not take ownership of "*model".
+  // REQUIRES: Add() has not been called
+  static void SetLearnedIndex(TableBuilder* builder,
+                              koo::LearnedIndexData* model);
+};
+
+}  // namespace leveldb
+
+#endif  // STORAGE_LEVELDB_TABLE_TABLE_BUILDER_INTERNAL_H_
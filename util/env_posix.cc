@@ -3,6 +3,7 @@
 // found in the LICENSE file. See the AUTHORS file for names of contributors.
 
 #include <deque>
+#include <list>
 #include <set>
 #include <dirent.h>
 #include <errno.h>
@@ -31,6 +32,7 @@
 #include <queue>
 #include <thread>
 #include "db/version_edit.h"
+#include "db/version_set.h"
 
 namespace leveldb {
 
@@ -836,72 +838,175 @@ class PosixEnv : public Env {
     usleep(micros);
   }
 
-	void PrepareLearn() {
-		koo::Stats* instance = koo::Stats::GetInstance();
-		std::priority_queue<std::pair<double, LearnParam>> learn_pq;
-		bool wait_for_time = false;
-		int64_t time_diff = 1000000;
-		prepare_queue_mutex_.Lock();
-
-		// dead lookp
-		while(true) {
-			while (learning_prepare.empty()) {
-				preparing_queue_cv_.Wait();
-			}
-
-			uint32_t dummy;
-			uint64_t time_start = (__rdtscp(&dummy) - instance->initial_time) / koo::reference_frequency;
-
-			while (!learning_prepare.empty()) {
-				auto front = learning_prepare.front();
-				int level = front.second.first;
-
-				time_diff = front.first + koo::learn_trigger_time - time_start;
-				if (time_diff > 0) {
-					wait_for_time = true;
-					break;
+	// Body of the learning workers. Files wait in learning_prepare until the
+	// age from which CBModel_Learn expects learning them to pay off, as most
+	// short-lived files are gone by then, unless the learning policy wants
+	// them learned at once; the ones still worth it are ranked
+	// by cost-benefit in learn_pq_ and every worker learns the best one next,
+	// while the CPU budget of the pool allows.
+	void LearningWorker() {
+		MutexLock guard(&prepare_queue_mutex_);
+		while (true) {
+			const uint64_t next_due = PickDueFiles();
+
+			if (learn_pq_.empty()) {
+				if (learning_prepare.empty() || learning_timer_running_) {
+					preparing_queue_cv_.Wait();
+				} else {
+					// One worker waits for the next file to be due, the others for
+					// work. The lookup rates move, so look again at least every second.
+					learning_timer_running_ = true;
+					prepare_queue_mutex_.Unlock();
+					SleepForMicroseconds((int) std::min<uint64_t>(next_due / 1000, 1000000));
+					prepare_queue_mutex_.Lock();
+					learning_timer_running_ = false;
 				}
-
-				learning_prepare.pop();
-				double score = koo::learn_cb_model->CalculateCB(level, front.second.second->file_size);
-				if (score > CBModel_Learn::const_size_to_cost) learn_pq.push(std::make_pair(score, front));
+				continue;
 			}
 
-			while (!learn_pq.empty()) {
-				auto& top = learn_pq.top().second;
-				int level = top.second.first;
-				FileMetaData* meta = top.second.second;
-				koo::LearnedIndexData* model = koo::file_data->GetModel(meta->number);
+			uint64_t budget_wait = LearningBudgetWait();
+			if (budget_wait > 0) {
 				prepare_queue_mutex_.Unlock();
-				koo::LearnedIndexData::FileLearn(new koo::MetaAndSelf{nullptr, 0, meta, model, level});
+				SleepForMicroseconds((int) budget_wait);
 				prepare_queue_mutex_.Lock();
-				learn_pq.pop();
+				continue;
 			}
 
-			if (wait_for_time) {
-				prepare_queue_mutex_.Unlock();
-				SleepForMicroseconds((int) (time_diff / 1000));
-				prepare_queue_mutex_.Lock();
-				wait_for_time = false;
+			LearnParam top = learn_pq_.top().second;
+			learn_pq_.pop();
+			int level = top.level;
+			FileMetaData* meta = top.meta;
+			const uint64_t file_size = meta->file_size;
+			koo::LearnedIndexData* model = koo::file_data->GetModel(meta->number);
+			++learning_running_;
+			prepare_queue_mutex_.Unlock();
+			const uint64_t cpu_started = ThreadCpuMicros();
+			uint64_t cost = koo::LearnedIndexData::FileLearn(new koo::MetaAndSelf{nullptr, 0, meta, model, level});
+			const uint64_t cpu_used = ThreadCpuMicros() - cpu_started;
+			if (cost > 0) koo::learn_cb_model->AddLearnCost(level, cost, file_size);
+			prepare_queue_mutex_.Lock();
+			learning_cpu_debt_ += cpu_used;
+			if (--learning_running_ == 0) learning_done_cv_.SignalAll();
+		}
+	}
+
+	// Move the prepared files now worth learning to learn_pq_ and drop the
+	// ones compacted away. Files are prepared before their version is
+	// installed, so they are only gone once they are no longer being written. Returns the nanoseconds until the next file is due.
+	uint64_t PickDueFiles() {
+		prepare_queue_mutex_.AssertHeld();
+		uint64_t next_due = CBModel_Learn::kNeverLearn;
+		if (learning_prepare.empty()) return next_due;
+
+		// StopLearning() waits for this worker while it holds the version
+		++learning_running_;
+		prepare_queue_mutex_.Unlock();
+		Version* current = koo::db->GetCurrentVersion();
+		prepare_queue_mutex_.Lock();
+
+		size_t num_files[config::kNumLevels];
+		for (unsigned level = 0; level < config::kNumLevels; ++level) num_files[level] = current->NumFiles(level);
+		uint32_t dummy;
+		const uint64_t now = (__rdtscp(&dummy) - koo::Stats::GetInstance()->initial_time) / koo::reference_frequency;
+		koo::learn_cb_model->UpdateLookupRates(now, num_files);
+
+		bool moved = false;
+		for (auto it = learning_prepare.begin(); it != learning_prepare.end(); ) {
+			const int level = it->level;
+			FileMetaData* meta = it->meta;
+			if (!current->HasFile(meta->number) && !koo::db->IsLiveFile(meta->number)) {
+				if (!koo::fresh_write) delete meta;
+				it = learning_prepare.erase(it);
+				continue;
+			}
+			const uint64_t age = now > it->time_start ? now - it->time_start : 0;
+			const uint64_t learn_age = it->learn_now ? 0 : koo::learn_cb_model->LearnAge(level, meta->file_size, current->CompactionScore(level));
+			if (learn_age > age) {
+				next_due = std::min(next_due, learn_age - age);
+				++it;
+				continue;
+			}
+			koo::FileStats stats(level, meta->file_size);
+			{
+				MutexLock l(&koo::file_stats_mutex);
+				auto found = koo::file_stats.find(meta->number);
+				if (found != koo::file_stats.end()) {
+					stats = found->second;
+				} else {
+					stats.start = it->time_start;
+				}
+			}
+			// files the policy wants learned now are still ranked by their score
+			double score = koo::learn_cb_model->CalculateCB(stats, now);
+			if (it->learn_now || score > CBModel_Learn::const_size_to_cost) {
+				learn_pq_.push(std::make_pair(score, *it));
+				moved = true;
+			} else if (!koo::fresh_write) {
+				delete meta;
 			}
+			it = learning_prepare.erase(it);
 		}
+		if (moved) preparing_queue_cv_.SignalAll();
+
+		prepare_queue_mutex_.Unlock();
+		koo::db->ReturnCurrentVersion(current);
+		prepare_queue_mutex_.Lock();
+		if (--learning_running_ == 0) learning_done_cv_.SignalAll();
+		return next_due;
 	}
 
-	static void PrepareLearnEntryPoint(PosixEnv* env) {
-		env->PrepareLearn();
+	static void LearningWorkerEntryPoint(PosixEnv* env) {
+		env->LearningWorker();
 	}
 
-	void PrepareLearning(uint64_t time_start, int level, FileMetaData* meta) {
-		if (koo::MOD != 6 && koo::MOD != 7 && koo::MOD != 9) return;
+	static uint64_t ThreadCpuMicros() {
+		struct timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	// Microseconds to wait before the pool may start another job. The pool
+	// earns learning_cpu_percent of a core every second and pays for the CPU
+	// time its jobs used; it only starts a job when it owes nothing.
+	uint64_t LearningBudgetWait() {
+		prepare_queue_mutex_.AssertHeld();
+		const uint64_t now = NowMicros();
+		const int percent = koo::learning_cpu_percent;
+		if (percent > 0) {
+			const uint64_t earned = (now - learning_budget_time_) * percent / 100;
+			learning_cpu_debt_ = learning_cpu_debt_ > earned ? learning_cpu_debt_ - earned : 0;
+		} else {
+			learning_cpu_debt_ = 0;
+		}
+		learning_budget_time_ = now;
+		return percent > 0 ? learning_cpu_debt_ * 100 / percent : 0;
+	}
+
+	void PrepareLearning(uint64_t time_start, int level, FileMetaData* meta, bool learn_now) {
 		MutexLock guard(&prepare_queue_mutex_);
-		if (!preparing_thread_started) {
-			preparing_thread_started = true;
-			std::thread background_thread(PosixEnv::PrepareLearnEntryPoint, this);
+		while (learning_threads_started_ < koo::learning_threads) {
+			++learning_threads_started_;
+			std::thread background_thread(PosixEnv::LearningWorkerEntryPoint, this);
 			background_thread.detach();
 		}
 
 		if (learning_prepare.empty()) preparing_queue_cv_.Signal();
-		learning_prepare.emplace(std::make_pair(time_start, std::make_pair(level, meta)));
+		learning_prepare.push_back(LearnParam{time_start, level, meta, learn_now});
+	}
+
+	void StopLearning() {
+		MutexLock guard(&prepare_queue_mutex_);
+		for (LearnParam& param : learning_prepare) {
+			if (!koo::fresh_write) delete param.meta;
+		}
+		learning_prepare.clear();
+		while (!learn_pq_.empty()) {
+			if (!koo::fresh_write) delete learn_pq_.top().second.meta;
+			learn_pq_.pop();
+		}
+		while (learning_running_ > 0) {
+			learning_done_cv_.Wait();
+		}
 	}
 
  private:
@@ -935,11 +1040,32 @@ class PosixEnv : public Env {
   PosixLockTable locks_;
   MmapLimiter mmap_limit_;
 
-	typedef std::pair<uint64_t, std::pair<int, FileMetaData*>> LearnParam;		// <time_start, <level, meta>>
-	std::queue<LearnParam> learning_prepare;
-	bool preparing_thread_started;
+	struct LearnParam {
+		uint64_t time_start;
+		int level;
+		FileMetaData* meta;
+		bool learn_now;		// skip the cost-benefit check
+	};
+	typedef std::pair<double, LearnParam> ScoredLearnParam;
+	struct ByScore {
+		bool operator()(const ScoredLearnParam& a, const ScoredLearnParam& b) const {
+			return a.first < b.first;
+		}
+	};
+	// new files waiting to be old enough to learn, in creation order
+	std::list<LearnParam> learning_prepare;
+	// files due for learning, best cost-benefit first
+	std::priority_queue<ScoredLearnParam, std::vector<ScoredLearnParam>, ByScore> learn_pq_;
+	int learning_threads_started_;
 	port::Mutex prepare_queue_mutex_;
   port::CondVar preparing_queue_cv_;
+	// a worker is sleeping until the oldest file of learning_prepare is due
+	bool learning_timer_running_;
+	int learning_running_;
+	port::CondVar learning_done_cv_;
+	// CPU microseconds used by learning and not paid back by the budget yet
+	uint64_t learning_cpu_debt_;
+	uint64_t learning_budget_time_;
 };
 
 PosixEnv::PosixEnv() : page_size_(getpagesize()),
@@ -949,9 +1075,14 @@ PosixEnv::PosixEnv() : page_size_(getpagesize()),
                        started_bgthread_(false),
                        queue_(),
                        locks_(),
-											 preparing_thread_started(false),
+                       mmap_limit_(),
+											 learning_threads_started_(0),
 											 preparing_queue_cv_(&prepare_queue_mutex_),
-                       mmap_limit_() {
+											 learning_timer_running_(false),
+											 learning_running_(0),
+											 learning_done_cv_(&prepare_queue_mutex_),
+											 learning_cpu_debt_(0),
+											 learning_budget_time_(0) {
   PthreadCall("mutex_init", pthread_mutex_init(&mu_, NULL));
   PthreadCall("cvar_init", pthread_cond_init(&bgsignal_, NULL));
 }
@@ -0,0 +1,119 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "hyperleveldb/learning_policy.h"
+
+#include "koo/CBModel_Learn.h"
+#include "koo/util.h"
+
+namespace leveldb {
+
+LearningPolicy::~LearningPolicy() { }
+
+namespace {
+class EagerLearningPolicy : public LearningPolicy {
+ public:
+  virtual const char* Name() const {
+    return "leveldb.BuiltinEagerLearning";
+  }
+
+  virtual Action OnFileCreated(int level, uint64_t number,
+                               uint64_t file_size) const {
+    return kLearnNow;
+  }
+
+  virtual bool OnLookup(int level, uint64_t number, uint64_t lookups) const {
+    return false;
+  }
+
+  virtual void OnFileDeleted(int level, uint64_t number,
+                             uint64_t lifetime) const { }
+};
+
+class NoLearningPolicy : public LearningPolicy {
+ public:
+  virtual const char* Name() const {
+    return "leveldb.BuiltinNoLearning";
+  }
+
+  virtual Action OnFileCreated(int level, uint64_t number,
+                               uint64_t file_size) const {
+    return kSkip;
+  }
+
+  virtual bool OnLookup(int level, uint64_t number, uint64_t lookups) const {
+    return false;
+  }
+
+  virtual void OnFileDeleted(int level, uint64_t number,
+                             uint64_t lifetime) const { }
+};
+
+class SeekLearningPolicy : public LearningPolicy {
+ private:
+  uint64_t lookups_;
+
+ public:
+  explicit SeekLearningPolicy(int lookups)
+      : lookups_(lookups < 1 ? 1 : lookups) { }
+
+  virtual const char* Name() const {
+    return "leveldb.BuiltinSeekLearning";
+  }
+
+  virtual Action OnFileCreated(int level, uint64_t number,
+                               uint64_t file_size) const {
+    return kSkip;
+  }
+
+  // Lookups are counted one at a time, so each file sees lookups_ once
+  virtual bool OnLookup(int level, uint64_t number, uint64_t lookups) const {
+    return lookups == lookups_;
+  }
+
+  virtual void OnFileDeleted(int level, uint64_t number,
+                             uint64_t lifetime) const { }
+};
+
+class CostBenefitLearningPolicy : public LearningPolicy {
+ public:
+  virtual const char* Name() const {
+    return "leveldb.BuiltinCostBenefitLearning";
+  }
+
+  virtual Action OnFileCreated(int level, uint64_t number,
+                               uint64_t file_size) const {
+    return kCostBenefit;
+  }
+
+  virtual bool OnLookup(int level, uint64_t number, uint64_t lookups) const {
+    return false;
+  }
+
+  // The age from which a file is worth learning depends on how long the
+  // files of its level live
+  virtual void OnFileDeleted(int level, uint64_t number,
+                             uint64_t lifetime) const {
+    koo::learn_cb_model->AddFileLifetime(level, lifetime);
+  }
+};
+}
+
+const LearningPolicy* NewEagerLearningPolicy() {
+  return new EagerLearningPolicy;
+}
+
+const LearningPolicy* NewNoLearningPolicy() {
+  return new NoLearningPolicy;
+}
+
+const LearningPolicy* NewSeekLearningPolicy(int lookups) {
+  return new SeekLearningPolicy(lookups);
+}
+
+const LearningPolicy* NewCostBenefitLearningPolicy() {
+  return new CostBenefitLearningPolicy;
+}
+
+}  // namespace leveldb
@@ -0,0 +1,56 @@
+// Copyright (c) 2012 The LevelDB Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file. See the AUTHORS file for names of contributors.
+
+#include "hyperleveldb/learning_policy.h"
+
+#include "util/testharness.h"
+
+namespace leveldb {
+
+class LearningPolicyTest { };
+
+TEST(LearningPolicyTest, Eager) {
+  const LearningPolicy* policy = NewEagerLearningPolicy();
+  ASSERT_EQ(policy->OnFileCreated(0, 5, 1 << 20), LearningPolicy::kLearnNow);
+  ASSERT_EQ(policy->OnFileCreated(3, 6, 1 << 20), LearningPolicy::kLearnNow);
+  ASSERT_TRUE(!policy->OnLookup(0, 5, 1));
+  delete policy;
+}
+
+TEST(LearningPolicyTest, Off) {
+  const LearningPolicy* policy = NewNoLearningPolicy();
+  ASSERT_EQ(policy->OnFileCreated(0, 5, 1 << 20), LearningPolicy::kSkip);
+  for (uint64_t lookups = 1; lookups < 1000; lookups++) {
+    ASSERT_TRUE(!policy->OnLookup(0, 5, lookups));
+  }
+  delete policy;
+}
+
+TEST(LearningPolicyTest, Seek) {
+  const LearningPolicy* policy = NewSeekLearningPolicy(10);
+  ASSERT_EQ(policy->OnFileCreated(1, 5, 1 << 20), LearningPolicy::kSkip);
+  // asks exactly once per file
+  int asked = 0;
+  for (uint64_t lookups = 1; lookups < 1000; lookups++) {
+    if (policy->OnLookup(1, 5, lookups)) {
+      ASSERT_EQ(lookups, 10u);
+      asked++;
+    }
+  }
+  ASSERT_EQ(asked, 1);
+  delete policy;
+}
+
+TEST(LearningPolicyTest, CostBenefit) {
+  const LearningPolicy* policy = NewCostBenefitLearningPolicy();
+  ASSERT_EQ(policy->OnFileCreated(2, 5, 1 << 20), LearningPolicy::kCostBenefit);
+  ASSERT_TRUE(!policy->OnLookup(2, 5, 10));
+  delete policy;
+}
+
+}  // namespace leveldb
+
+int main(int argc, char** argv) {
+  return leveldb::test::RunAllTests();
+}
@@ -25,7 +25,9 @@ Options::Options()
       compression(kNoCompression),
       //compression(kSnappyCompression),
       filter_policy(NULL),
-      manual_garbage_collection(false) {
+      learning_policy(NULL),
+      manual_garbage_collection(false),
+      write_ahead_log(false) {
 }
 
 